@@ -0,0 +1,455 @@
+/* Load generator and latency benchmark for the server.
+
+Forks N simulated clients. Each one sends a weighted mix of LIST, HIDE,
+UNHIDE and shell commands, either as fast as the server answers (one command
+in flight) or at a fixed rate per client. At a fixed rate, a command's latency
+is measured from the moment it was due to be sent, so a stalled server cannot
+hide its backlog (no coordinated omission). Latencies from send to the final
+reply chunk are recorded in HDR-histogram style log-linear buckets, merged
+across clients, and printed as one JSON object so runs from different builds
+can be compared mechanically.
+*/
+
+// COMPILE: gcc -o loadgen bench.c clientlib.c shmring.c -lpthread
+// RUN: ./loadgen [-c clients] [-r rate] [-d seconds] [-m mix] [-s command] [-T transport] [-i idle]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "protocol.h"
+#include "shmring.h"
+#include "clientlib.h"
+
+// Log-linear histogram of microseconds: values below SUB_COUNT are exact,
+// above that each power of two is split into SUB_COUNT / 2 buckets (< 1% error)
+#define SUB_BITS 7
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_SHIFT 33              // Covers values up to 2^40 us
+#define HIST_BUCKETS (SUB_COUNT + MAX_SHIFT * (SUB_COUNT / 2))
+
+#define WINDOW 256                // Commands in flight per client at a fixed rate
+#define DRAIN_TIMEOUT_NS 10000000000LL
+
+enum kind { K_LIST, K_HIDE, K_UNHIDE, K_SHELL, K_COUNT, K_EXIT = -1 };
+static const char *kind_names[K_COUNT] = { "list", "hide", "unhide", "shell" };
+static const char *kind_commands[K_COUNT] = { "LIST", "HIDE", "UNHIDE", NULL };  // Shell: -s
+
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    uint64_t sum;
+};
+
+// Filled in by each client process, read by the parent after it exits
+struct client_stats {
+    struct histogram all;
+    struct histogram per_kind[K_COUNT];
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t errors;      // Non-zero status or no reply
+};
+
+// Settings shared by every simulated client
+int clients = 4;
+int rate = 0;                 // Commands per second per client, 0 = closed loop
+int duration = 5;
+int weights[K_COUNT] = { 1, 1, 1, 1 };
+const char *shell_command = "echo hello";
+const char *transport = "msg";
+int idle = 0;                 // Gateway connections held open without sending
+
+// Per-client state (one client per process). Replies are dispatched on the
+// client's own thread, so none of this needs a lock.
+struct client_conn *conn;
+struct client_stats *stats;
+
+struct inflight {
+    int64_t start;
+    int kind;
+};
+struct inflight inflight[WINDOW];
+int outstanding = 0;
+int server_gone = 0;
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int bucket_of(uint64_t v) {
+    if (v < SUB_COUNT) {
+        return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS + 1;
+    if (shift > MAX_SHIFT) {
+        return HIST_BUCKETS - 1;
+    }
+    return SUB_COUNT + (shift - 1) * (SUB_COUNT / 2) + (int)(v >> shift) - SUB_COUNT / 2;
+}
+
+// Highest value that lands in a bucket
+uint64_t bucket_top(int b) {
+    if (b < SUB_COUNT) {
+        return b;
+    }
+    int shift = (b - SUB_COUNT) / (SUB_COUNT / 2) + 1;
+    uint64_t top = (b - SUB_COUNT) % (SUB_COUNT / 2) + SUB_COUNT / 2;
+    return ((top + 1) << shift) - 1;
+}
+
+void hist_record(struct histogram *h, uint64_t v) {
+    h->counts[bucket_of(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+void hist_merge(struct histogram *into, const struct histogram *h) {
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        into->counts[b] += h->counts[b];
+    }
+    into->total += h->total;
+    into->sum += h->sum;
+    if (h->max > into->max) {
+        into->max = h->max;
+    }
+}
+
+uint64_t hist_percentile(const struct histogram *h, double p) {
+    uint64_t rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+void print_latency(const struct histogram *h) {
+    printf("{\"count\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+           "\"p999\": %llu, \"max\": %llu}",
+           (unsigned long long)h->total, h->total ? (double)h->sum / h->total : 0.0,
+           (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+           (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+           (unsigned long long)h->max);
+}
+
+// Reply callback: match each END to the command it answers and record it
+void on_reply(struct client_conn *c, const struct client_reply *reply, void *ctx) {
+    (void)c;
+    (void)ctx;
+    if (!reply->done) {
+        return;
+    }
+    if (reply->status == CLIENT_STATUS_SHUTDOWN) {
+        server_gone = 1;
+    }
+    struct inflight *f = &inflight[reply->id % WINDOW];
+    if (f->kind != K_EXIT && !server_gone) {
+        uint64_t us = (now_ns() - f->start) / 1000;
+        hist_record(&stats->all, us);
+        hist_record(&stats->per_kind[f->kind], us);
+        stats->completed++;
+        if (reply->status != 0) {
+            stats->errors++;
+        }
+    }
+    outstanding--;
+}
+
+int pick_kind(unsigned int *seed) {
+    int total = 0;
+    for (int k = 0; k < K_COUNT; k++) {
+        total += weights[k];
+    }
+    int r = rand_r(seed) % total;
+    for (int k = 0; k < K_COUNT; k++) {
+        if (r < weights[k]) {
+            return k;
+        }
+        r -= weights[k];
+    }
+    return K_SHELL;
+}
+
+// Wait until at most limit commands are in flight. Returns 0 on timeout or
+// if the server went away.
+int wait_outstanding(int limit, int64_t deadline) {
+    while (outstanding > limit && !server_gone) {
+        int64_t left_ms = (deadline - now_ns()) / 1000000;
+        if (left_ms <= 0) {
+            break;
+        }
+        if (client_wait(conn, left_ms) == -1) {
+            server_gone = 1;
+        }
+    }
+    return outstanding <= limit && !server_gone;
+}
+
+// Send a command, waiting while the transport is full
+void send_request(const char *command, int kind, int64_t due) {
+    unsigned int id;
+    while ((id = client_submit(conn, command, 0, on_reply, NULL)) == 0) {
+        if (errno != EAGAIN || client_wait(conn, 10) == -1) {
+            server_gone = 1;
+            return;
+        }
+    }
+    inflight[id % WINDOW].start = due;
+    inflight[id % WINDOW].kind = kind;
+    outstanding++;
+}
+
+void run_client(int index) {
+    unsigned int seed = getpid() ^ (index * 2654435761u);
+    int window = rate > 0 ? WINDOW - 1 : 1;
+    int64_t interval = rate > 0 ? 1000000000LL / rate : 0;
+
+    conn = client_connect(transport);
+    if (!conn) {
+        _exit(1);
+    }
+
+    int64_t start = now_ns();
+    int64_t end = start + duration * 1000000000LL;
+    int64_t next = start;
+    while (now_ns() < end) {
+        int64_t due = now_ns();
+        if (rate > 0) {
+            // Take replies until the next command is due, then time it from then
+            while ((due = now_ns()) < next) {
+                struct timespec ts = { (next - due) / 1000000000LL, (next - due) % 1000000000LL };
+                struct pollfd pfd = { .fd = client_fd(conn), .events = POLLIN };
+                if (ppoll(&pfd, 1, &ts, NULL) > 0 && client_dispatch(conn) == -1) {
+                    server_gone = 1;
+                }
+            }
+            due = next;
+            next += interval;
+        }
+        if (!wait_outstanding(window - 1, end + DRAIN_TIMEOUT_NS)) {
+            break;
+        }
+
+        int kind = pick_kind(&seed);
+        stats->sent++;
+        send_request(kind == K_SHELL ? shell_command : kind_commands[kind], kind, due);
+    }
+
+    // Let the stragglers finish, then unregister
+    wait_outstanding(0, now_ns() + DRAIN_TIMEOUT_NS);
+    send_request("EXIT", K_EXIT, now_ns());
+    wait_outstanding(0, now_ns() + DRAIN_TIMEOUT_NS);
+
+    stats->errors += stats->sent - stats->completed;  // Never answered
+    client_close(conn);
+    _exit(0);
+}
+
+// Parse "list:1,hide:1,unhide:1,shell:2"; kinds left out get weight 0
+int parse_mix(char *mix) {
+    memset(weights, 0, sizeof(weights));
+    for (char *item = strtok(mix, ","); item; item = strtok(NULL, ",")) {
+        char *colon = strchr(item, ':');
+        size_t n = colon ? (size_t)(colon - item) : strlen(item);
+        int k;
+        for (k = 0; k < K_COUNT; k++) {
+            if (strlen(kind_names[k]) == n && strncmp(item, kind_names[k], n) == 0) {
+                break;
+            }
+        }
+        if (k == K_COUNT) {
+            return -1;
+        }
+        weights[k] = colon ? atoi(colon + 1) : 1;
+    }
+    int total = 0;
+    for (int k = 0; k < K_COUNT; k++) {
+        total += weights[k];
+    }
+    return total > 0 ? 0 : -1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c clients] [-r rate] [-d seconds] [-m mix] [-s command] [-T transport] [-i idle]\n", prog);
+    fprintf(stderr, "  -c  simulated clients, one process each (default: 4)\n");
+    fprintf(stderr, "  -r  commands per second per client, 0 = as fast as replies come back (default: 0)\n");
+    fprintf(stderr, "  -d  seconds to send for (default: 5)\n");
+    fprintf(stderr, "  -m  command mix as kind:weight pairs (default: list:1,hide:1,unhide:1,shell:1)\n");
+    fprintf(stderr, "  -s  shell command used for the shell kind (default: \"echo hello\")\n");
+    fprintf(stderr, "  -T  msg, shm, or the server's gateway as unix:path or tcp:port (default: msg)\n");
+    fprintf(stderr, "  -i  extra gateway connections to keep open and idle during the run (default: 0)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:d:m:s:T:i:")) != -1) {
+        switch (opt) {
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'm':
+            if (parse_mix(optarg) == -1) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 's':
+            shell_command = optarg;
+            break;
+        case 'T':
+            transport = optarg;
+            break;
+        case 'i':
+            idle = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    int use_shm = strcmp(transport, "shm") == 0;
+    int gateway = !use_shm && strcmp(transport, "msg") != 0;
+    if (clients < 1 || rate < 0 || duration < 1 || idle < 0 || (idle > 0 && !gateway)) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    // Give a server that is still starting a few seconds to create its queue
+    // (and its request ring, or its gateway)
+    for (int tries = 0; ; tries++) {
+        int ready;
+        if (gateway) {
+            int fd = client_dial(transport);
+            ready = fd != -1;
+            if (ready) {
+                close(fd);
+            }
+        } else {
+            int msgid = msgget(MSG_QUEUE_KEY, 0666);
+            struct shm_ring *ring = use_shm && msgid != -1 ? ring_attach(SHM_REQUEST_KEY, REQUEST_RING_SLOT_SIZE) : NULL;
+            if (ring) {
+                ring_detach(ring);
+            }
+            ready = msgid != -1 && (!use_shm || ring);
+        }
+        if (ready) {
+            break;
+        }
+        if (tries == 50) {
+            fprintf(stderr, "Server is not running (transport %s)\n", transport);
+            exit(1);
+        }
+        usleep(100000);
+    }
+
+    // Idle connections, opened before the clients start so they are measured
+    // with all of them in place
+    int *idle_fds = NULL;
+    if (idle > 0) {
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        idle_fds = malloc(idle * sizeof(int));
+        if (!idle_fds) {
+            perror("malloc failed");
+            exit(1);
+        }
+        for (int i = 0; i < idle; i++) {
+            idle_fds[i] = client_dial(transport);
+            if (idle_fds[i] == -1) {
+                fprintf(stderr, "Could only open %d idle connections: %s\n", i, strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
+    struct client_stats *all_stats = mmap(NULL, clients * sizeof(struct client_stats),
+                                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (all_stats == MAP_FAILED) {
+        perror("mmap failed");
+        exit(1);
+    }
+
+    int64_t start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            stats = &all_stats[i];
+            run_client(i);
+        } else if (pid == -1) {
+            perror("fork failed");
+            exit(1);
+        }
+    }
+    int failed = 0;
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    for (int i = 0; i < idle; i++) {
+        close(idle_fds[i]);
+    }
+    free(idle_fds);
+
+    static struct histogram all, per_kind[K_COUNT];
+    uint64_t sent = 0, completed = 0, errors = 0;
+    for (int i = 0; i < clients; i++) {
+        hist_merge(&all, &all_stats[i].all);
+        for (int k = 0; k < K_COUNT; k++) {
+            hist_merge(&per_kind[k], &all_stats[i].per_kind[k]);
+        }
+        sent += all_stats[i].sent;
+        completed += all_stats[i].completed;
+        errors += all_stats[i].errors;
+    }
+
+    printf("{\"transport\": \"%s\", \"clients\": %d, \"idle_connections\": %d, \"rate\": %d, \"duration_s\": %d, ",
+           transport, clients, idle, rate, duration);
+    printf("\"elapsed_s\": %.3f, \"sent\": %llu, \"completed\": %llu, \"errors\": %llu, "
+           "\"failed_clients\": %d, \"throughput_per_s\": %.1f,\n",
+           elapsed, (unsigned long long)sent, (unsigned long long)completed,
+           (unsigned long long)errors, failed, completed / elapsed);
+    printf(" \"latency_us\": ");
+    print_latency(&all);
+    printf(",\n \"per_command\": {");
+    for (int k = 0; k < K_COUNT; k++) {
+        printf("%s\n  \"%s\": ", k ? "," : "", kind_names[k]);
+        print_latency(&per_kind[k]);
+    }
+    printf("}}\n");
+    return failed ? 1 : 0;
+}
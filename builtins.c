@@ -0,0 +1,422 @@
+/* Native echo, cat, mkdir, rm and ls.
+
+A command only gets here if it is made of plain words (no shell syntax),
+which is exactly the case the executor would exec directly, so the program we
+stand in for is the coreutils one and its output format is well known.
+
+When something goes wrong part of the way through mkdir, rm or cat, the
+arguments already dealt with are dropped and the rest go to the real
+program, so error messages are the real ones. Options are never handled
+here except "ls -l" and "rm -f".
+
+cat reads straight into the reply chunk rather than mapping the file: a
+mapping of a file that someone truncates would kill the server with SIGBUS.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "builtins.h"
+#include "executor.h"
+
+#define LS_MAX_ENTRIES 4096   // Bigger directories go to the real ls
+#define SIX_MONTHS (31556952 / 2)   // ls's idea of "recent", in seconds
+
+struct ls_entry {
+    char *name;
+    struct stat st;
+    char owner[64];
+    char group[64];
+    char *link;      // Symlink target, or NULL
+};
+
+// Split cmd on spaces into buf. Returns the word count, or -1 if too many.
+static int split_words(const char *cmd, char *buf, char **argv) {
+    int argc = 0;
+    strncpy(buf, cmd, MAX_CMD_LEN - 1);
+    buf[MAX_CMD_LEN - 1] = '\0';
+    for (char *save, *w = strtok_r(buf, " ", &save); w; w = strtok_r(NULL, " ", &save)) {
+        if (argc == MAX_ARGS) {
+            return -1;
+        }
+        argv[argc++] = w;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+// Put "argv[0] argv[from] ... argv[argc - 1]" into fallback
+static int fall_back(char *fallback, char **argv, int from, int argc) {
+    int len = snprintf(fallback, MAX_CMD_LEN, "%s", argv[0]);
+    for (int i = from; i < argc && len < MAX_CMD_LEN; i++) {
+        len += snprintf(fallback + len, MAX_CMD_LEN - len, " %s", argv[i]);
+    }
+    return BUILTIN_FALLBACK;
+}
+
+static int has_option(char **argv, int from, int argc) {
+    for (int i = from; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// True if the environment leaves a child's locale category as C, so the
+// real program would collate, format times and word messages the way we do
+static int c_locale(const char *category) {
+    const char *value = getenv("LC_ALL");
+    if (!value || !*value) {
+        value = getenv(category);
+    }
+    if (!value || !*value) {
+        value = getenv("LANG");
+    }
+    return !value || !*value || strcmp(value, "C") == 0 || strcmp(value, "POSIX") == 0 ||
+           strcmp(value, "C.UTF-8") == 0 || strcmp(value, "C.utf8") == 0;
+}
+
+static int run_echo(struct reply *r, int argc, char **argv, char *fallback) {
+    if (argc > 1 && argv[1][0] == '-') {
+        return fall_back(fallback, argv, 1, argc);  // -n, -e, --help, ...
+    }
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) {
+            reply_write(r, " ", 1, 0);
+        }
+        reply_write(r, argv[i], strlen(argv[i]), 0);
+    }
+    reply_write(r, "\n", 1, 0);
+    return BUILTIN_DONE;
+}
+
+// Copy a regular file into the reply. Returns -1 before writing anything if
+// the real cat should handle it instead.
+static int cat_file(struct reply *r, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > BUILTIN_CAT_MAX) {
+        close(fd);
+        return -1;  // Directories, FIFOs, devices and big files
+    }
+    while (1) {
+        ssize_t n = read(fd, r->buf + r->len, REPLY_CHUNK - r->len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            // Too late to hand over; report it the way cat does
+            reply_flush(r, 0);
+            reply_printf(r, "cat: %s: %s\n", path, strerror(errno));
+            r->status = 1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        r->len += n;
+        if (r->len == REPLY_CHUNK) {
+            reply_flush(r, 0);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int run_cat(struct reply *r, int argc, char **argv, char *fallback) {
+    if (argc < 2 || has_option(argv, 1, argc)) {
+        return fall_back(fallback, argv, 1, argc);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (cat_file(r, argv[i]) == -1) {
+            return fall_back(fallback, argv, i, argc);
+        }
+    }
+    return BUILTIN_DONE;
+}
+
+static int run_mkdir(struct reply *r, int argc, char **argv, char *fallback) {
+    (void)r;
+    if (has_option(argv, 1, argc)) {
+        return fall_back(fallback, argv, 1, argc);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (mkdir(argv[i], 0777) == -1) {
+            return fall_back(fallback, argv, i, argc);
+        }
+    }
+    return BUILTIN_DONE;
+}
+
+static int run_rm(struct reply *r, int argc, char **argv, char *fallback) {
+    (void)r;
+    int force = argc > 1 && strcmp(argv[1], "-f") == 0;
+    int first = force ? 2 : 1;
+    if (has_option(argv, first, argc)) {
+        return fall_back(fallback, argv, 1, argc);
+    }
+    for (int i = first; i < argc; i++) {
+        if (unlink(argv[i]) == -1 && !(force && errno == ENOENT)) {
+            if (force) {
+                argv[--i] = "-f";  // Keep the option for what is left
+            }
+            return fall_back(fallback, argv, i, argc);
+        }
+    }
+    return BUILTIN_DONE;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct ls_entry *)a)->name, ((const struct ls_entry *)b)->name);
+}
+
+static void mode_string(mode_t mode, char *out) {
+    out[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISFIFO(mode) ? 'p' :
+             S_ISSOCK(mode) ? 's' : '-';
+    out[1] = mode & S_IRUSR ? 'r' : '-';
+    out[2] = mode & S_IWUSR ? 'w' : '-';
+    out[3] = mode & S_ISUID ? (mode & S_IXUSR ? 's' : 'S') : (mode & S_IXUSR ? 'x' : '-');
+    out[4] = mode & S_IRGRP ? 'r' : '-';
+    out[5] = mode & S_IWGRP ? 'w' : '-';
+    out[6] = mode & S_ISGID ? (mode & S_IXGRP ? 's' : 'S') : (mode & S_IXGRP ? 'x' : '-');
+    out[7] = mode & S_IROTH ? 'r' : '-';
+    out[8] = mode & S_IWOTH ? 'w' : '-';
+    out[9] = mode & S_ISVTX ? (mode & S_IXOTH ? 't' : 'T') : (mode & S_IXOTH ? 'x' : '-');
+    out[10] = '\0';
+}
+
+// True if the file has an ACL or security label, which ls -l marks with an
+// extra character we do not reproduce
+static int has_acl_or_label(const char *path) {
+    char names[1024];
+    ssize_t len = llistxattr(path, names, sizeof(names));
+    if (len == -1) {
+        return errno == ERANGE;
+    }
+    for (char *n = names; n < names + len; n += strlen(n) + 1) {
+        if (strncmp(n, "system.posix_acl_", 17) == 0 || strcmp(n, "security.selinux") == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Fill in owner and group names. Returns -1 if either has none, since ls
+// then prints the number right-aligned instead.
+static int lookup_names(struct ls_entry *e) {
+    char buf[1024];
+    struct passwd pw, *pwp;
+    struct group gr, *grp;
+    if (getpwuid_r(e->st.st_uid, &pw, buf, sizeof(buf), &pwp) != 0 || !pwp) {
+        return -1;
+    }
+    snprintf(e->owner, sizeof(e->owner), "%s", pw.pw_name);
+    if (getgrgid_r(e->st.st_gid, &gr, buf, sizeof(buf), &grp) != 0 || !grp) {
+        return -1;
+    }
+    snprintf(e->group, sizeof(e->group), "%s", gr.gr_name);
+    return 0;
+}
+
+static int digits(unsigned long long n) {
+    int d = 1;
+    while (n >= 10) {
+        n /= 10;
+        d++;
+    }
+    return d;
+}
+
+// Print the entries the way ls -l does in the C locale
+static void print_long(struct reply *r, struct ls_entry *entries, int count) {
+    int nlink_w = 0, owner_w = 0, group_w = 0, size_w = 0;
+    unsigned long long blocks = 0;
+    char line[2 * PATH_MAX + 256];
+
+    for (int i = 0; i < count; i++) {
+        struct ls_entry *e = &entries[i];
+        blocks += e->st.st_blocks;
+        nlink_w = digits(e->st.st_nlink) > nlink_w ? digits(e->st.st_nlink) : nlink_w;
+        size_w = digits(e->st.st_size) > size_w ? digits(e->st.st_size) : size_w;
+        owner_w = (int)strlen(e->owner) > owner_w ? (int)strlen(e->owner) : owner_w;
+        group_w = (int)strlen(e->group) > group_w ? (int)strlen(e->group) : group_w;
+    }
+    int len = snprintf(line, sizeof(line), "total %llu\n", (blocks + 1) / 2);  // 1K blocks
+    reply_write(r, line, len, 0);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i < count; i++) {
+        struct ls_entry *e = &entries[i];
+        char mode[11], date[32];
+        struct tm tm;
+        time_t when = e->st.st_mtim.tv_sec;
+        if (when > now.tv_sec) {
+            clock_gettime(CLOCK_REALTIME, &now);  // Created since we started
+        }
+        int recent = now.tv_sec - SIX_MONTHS < when && when <= now.tv_sec;
+        localtime_r(&when, &tm);
+        strftime(date, sizeof(date), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+        mode_string(e->st.st_mode, mode);
+
+        len = snprintf(line, sizeof(line), "%s %*llu %-*s %-*s %*lld %s %s%s%s\n",
+                       mode, nlink_w, (unsigned long long)e->st.st_nlink, owner_w, e->owner,
+                       group_w, e->group, size_w, (long long)e->st.st_size, date, e->name,
+                       e->link ? " -> " : "", e->link ? e->link : "");
+        reply_write(r, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1, 0);
+    }
+}
+
+// Read the directory, stat what -l needs and print. Returns -1 (having
+// printed nothing) if the real ls should do it.
+static int list_dir(struct reply *r, const char *path, int longform) {
+    struct stat st;
+    if (lstat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return -1;  // Errors, plain files and symlinks, which -l does not follow
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    struct ls_entry *entries = NULL;
+    int count = 0;
+    int ok = 1;
+    struct dirent *d;
+    while (ok && (d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.') {
+            continue;
+        }
+        if (count == LS_MAX_ENTRIES) {
+            ok = 0;
+            break;
+        }
+        if (count % 64 == 0) {
+            struct ls_entry *grown = realloc(entries, (count + 64) * sizeof(struct ls_entry));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            entries = grown;
+        }
+        struct ls_entry *e = &entries[count];
+        e->name = strdup(d->d_name);
+        e->link = NULL;
+        if (!e->name) {
+            ok = 0;
+            break;
+        }
+        count++;
+        if (!longform) {
+            continue;
+        }
+
+        char full[PATH_MAX];
+        snprintf(full, sizeof(full), "%s/%s", path, d->d_name);
+        if (fstatat(dirfd(dir), d->d_name, &e->st, AT_SYMLINK_NOFOLLOW) == -1 ||
+            S_ISCHR(e->st.st_mode) || S_ISBLK(e->st.st_mode) ||
+            has_acl_or_label(full) || lookup_names(e) == -1) {
+            ok = 0;  // Vanished, a device (major, minor), an ACL, or no name
+            break;
+        }
+        if (S_ISLNK(e->st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlinkat(dirfd(dir), d->d_name, target, sizeof(target) - 1);
+            if (n == -1) {
+                ok = 0;
+                break;
+            }
+            target[n] = '\0';
+            e->link = strdup(target);
+            if (!e->link) {
+                ok = 0;
+                break;
+            }
+        }
+    }
+    closedir(dir);
+
+    if (ok) {
+        qsort(entries, count, sizeof(struct ls_entry), compare_entries);
+        if (longform) {
+            print_long(r, entries, count);
+        } else {
+            for (int i = 0; i < count; i++) {
+                reply_write(r, entries[i].name, strlen(entries[i].name), 0);
+                reply_write(r, "\n", 1, 0);
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(entries[i].name);
+        free(entries[i].link);
+    }
+    free(entries);
+    return ok ? 0 : -1;
+}
+
+static int run_ls(struct reply *r, int argc, char **argv, char *fallback) {
+    int longform = argc > 1 && strcmp(argv[1], "-l") == 0;
+    int first = longform ? 2 : 1;
+    // One directory at most, no other options, and nothing in the
+    // environment that changes the format
+    if (argc - first > 1 || has_option(argv, first, argc) ||
+        !c_locale("LC_COLLATE") || !c_locale("LC_TIME") || !c_locale("LC_MESSAGES") ||
+        getenv("LS_BLOCK_SIZE") || getenv("BLOCK_SIZE") || getenv("POSIXLY_CORRECT") ||
+        getenv("QUOTING_STYLE") || getenv("TIME_STYLE")) {
+        return fall_back(fallback, argv, 1, argc);
+    }
+    if (list_dir(r, argc > first ? argv[first] : ".", longform) == -1) {
+        return fall_back(fallback, argv, 1, argc);
+    }
+    return BUILTIN_DONE;
+}
+
+// Run cmd natively if we can. Returns BUILTIN_DONE with the output written
+// to r, or BUILTIN_FALLBACK with the command to start in fallback (the whole
+// of cmd, or what is left of it).
+int builtin_run(struct reply *r, const char *cmd, char *fallback) {
+    static const struct {
+        const char *name;
+        int (*run)(struct reply *, int, char **, char *);
+    } builtins[] = {
+        { "echo", run_echo },
+        { "cat", run_cat },
+        { "mkdir", run_mkdir },
+        { "rm", run_rm },
+        { "ls", run_ls },
+    };
+    char words[MAX_CMD_LEN];
+    char *argv[MAX_ARGS + 1];
+
+    strncpy(fallback, cmd, MAX_CMD_LEN - 1);
+    fallback[MAX_CMD_LEN - 1] = '\0';
+    if (executor_needs_shell(cmd)) {
+        return BUILTIN_FALLBACK;
+    }
+    int argc = split_words(cmd, words, argv);
+    if (argc < 1) {
+        return BUILTIN_FALLBACK;
+    }
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(argv[0], builtins[i].name) == 0) {
+            return builtins[i].run(r, argc, argv, fallback);
+        }
+    }
+    return BUILTIN_FALLBACK;
+}
@@ -0,0 +1,24 @@
+/* In-process versions of the commands clients run most.
+
+Plain-word echo, cat, mkdir, rm and ls (with or without -l) are carried out
+by the worker itself with ordinary system calls, with output written straight
+into the reply, so most requests never start a process. The output is meant
+to be byte-for-byte what the real programs print; anything outside that
+envelope (options we do not implement, a non-C locale, special files, an
+error whose wording we would have to copy) goes to the real program instead.
+*/
+
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "server.h"
+
+#define BUILTIN_CAT_MAX (1 << 20)   // Larger files stream from the real cat
+
+// Results of builtin_run
+#define BUILTIN_DONE 1       // Fully handled; r->status is set
+#define BUILTIN_FALLBACK 0   // Run the command left in fallback instead
+
+int builtin_run(struct reply *r, const char *cmd, char *fallback);
+
+#endif
@@ -0,0 +1,518 @@
+/* Command output cache with inotify invalidation.
+
+Entries live in a chained hash table keyed on "cwd\0command" and on an LRU
+list. Each entry records what it depends on as a watch descriptor plus,
+for a directory, the one name in it that matters (NULL when the whole
+directory does, as for ls); an event drops the entries whose watch fired
+for that name. A small table counts how many entries use each descriptor so
+a watch is removed once nothing needs it.
+
+A miss on a cacheable command adds a pending entry and hangs a cache_fill
+on the reply; reply_flush() feeds it whatever is sent, and the END chunk
+stores it. The entry's id is checked at that point, so if the entry was
+invalidated (and perhaps re-added) in between, the output is thrown away.
+
+Pending inotify events are read at the start of every lookup, under the cache
+lock, rather than by a thread of our own. The kernel queues an event before
+the write that caused it returns, so a client that changes a file and then
+reads it back never gets the old contents.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "cache.h"
+#include "executor.h"
+#include "metrics.h"
+
+#define CACHE_BUCKETS 1024   // Power of two
+#define ENTRY_MAX_DIVISOR 8  // No entry may take more than 1/8 of the budget
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct cache_dep {
+    int wd;
+    char *name;   // Only events for this name in the watched directory, or NULL for all
+};
+
+struct cache_entry {
+    char *key;
+    int key_len;
+    unsigned long long id;
+    int ready;            // 0 while the command is still running
+    char *data;
+    int len;
+    int status;
+    struct cache_dep deps[CACHE_MAX_WATCHES];
+    int dep_count;
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev, *lru_next;   // Most recently used first
+};
+
+struct cache_fill {
+    char *key;
+    int key_len;
+    unsigned long long id;
+    char *data;
+    int len;
+    int cap;
+    int broken;   // Grew too big; store nothing
+};
+
+struct watch_ref {
+    int wd;
+    int refs;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct cache_entry *lru_head = NULL, *lru_tail = NULL;
+static long budget = 0;     // 0 = cache off
+static long used = 0;
+static int entry_count = 0;
+static unsigned long long next_id = 1;
+static int inotify_fd = -1;
+static char cwd[PATH_MAX];
+
+static struct watch_ref *watches = NULL;
+static int watch_count = 0;
+static int watch_cap = 0;
+
+static unsigned int hash_key(const char *key, int len) {
+    unsigned int h = 2166136261u;   // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h & (CACHE_BUCKETS - 1);
+}
+
+static struct cache_entry *find_entry(const char *key, int len) {
+    for (struct cache_entry *e = buckets[hash_key(key, len)]; e; e = e->hash_next) {
+        if (e->key_len == len && memcmp(e->key, key, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(struct cache_entry *e) {
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        lru_tail = e->lru_prev;
+    }
+}
+
+static void lru_push_front(struct cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = e;
+    }
+    lru_head = e;
+    if (!lru_tail) {
+        lru_tail = e;
+    }
+}
+
+static int watch_used(int wd) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Count one more user of wd. Caller holds cache_lock.
+static int watch_hold(int wd) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            watches[i].refs++;
+            return 0;
+        }
+    }
+    if (watch_count == watch_cap) {
+        int cap = watch_cap ? watch_cap * 2 : 64;
+        struct watch_ref *grown = realloc(watches, cap * sizeof(struct watch_ref));
+        if (!grown) {
+            return -1;
+        }
+        watches = grown;
+        watch_cap = cap;
+    }
+    watches[watch_count].wd = wd;
+    watches[watch_count].refs = 1;
+    watch_count++;
+    return 0;
+}
+
+// Drop a user of wd, removing the watch when it was the last. Caller holds
+// cache_lock.
+static void watch_release(int wd) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            if (--watches[i].refs == 0) {
+                inotify_rm_watch(inotify_fd, wd);  // Fails harmlessly if the kernel dropped it
+                watches[i] = watches[--watch_count];
+            }
+            return;
+        }
+    }
+}
+
+static void release_deps(struct cache_entry *e) {
+    for (int i = 0; i < e->dep_count; i++) {
+        watch_release(e->deps[i].wd);
+        free(e->deps[i].name);
+    }
+    e->dep_count = 0;
+}
+
+static void remove_entry(struct cache_entry *e) {
+    struct cache_entry **p = &buckets[hash_key(e->key, e->key_len)];
+    while (*p != e) {
+        p = &(*p)->hash_next;
+    }
+    *p = e->hash_next;
+    lru_unlink(e);
+    release_deps(e);
+    used -= e->len + e->key_len;
+    entry_count--;
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+// Make e depend on path, or on just the entry name in directory path.
+// Returns -1 if it cannot be watched.
+static int add_dep(struct cache_entry *e, const char *path, const char *name) {
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    if (wd == -1) {
+        return -1;
+    }
+    for (int i = 0; i < e->dep_count; i++) {
+        struct cache_dep *d = &e->deps[i];
+        if (d->wd == wd && (!d->name || (name && strcmp(d->name, name) == 0))) {
+            return 0;  // Already covered
+        }
+    }
+    char *copy = name ? strdup(name) : NULL;
+    if (e->dep_count == CACHE_MAX_WATCHES || (name && !copy) || watch_hold(wd) == -1) {
+        free(copy);
+        if (!watch_used(wd)) {
+            inotify_rm_watch(inotify_fd, wd);
+        }
+        return -1;
+    }
+    e->deps[e->dep_count].wd = wd;
+    e->deps[e->dep_count].name = copy;
+    e->dep_count++;
+    return 0;
+}
+
+// Whether inotify cannot be trusted to report changes to path: it is on a
+// filesystem the kernel makes up as it is read (/proc, /sys and the like) or
+// under /dev, or is a device, FIFO or socket rather than a file or directory.
+static int volatile_path(const char *path) {
+    struct statfs fs;
+    struct stat st;
+    char real[PATH_MAX];
+    if (realpath(path, real) && strncmp(real, "/dev", 4) == 0 && (real[4] == '\0' || real[4] == '/')) {
+        return 1;  // devtmpfs says it is tmpfs
+    }
+    if (statfs(path, &fs) == 0) {
+        switch (fs.f_type) {
+        case PROC_SUPER_MAGIC:
+        case SYSFS_MAGIC:
+        case DEVPTS_SUPER_MAGIC:
+        case CGROUP_SUPER_MAGIC:
+        case CGROUP2_SUPER_MAGIC:
+        case DEBUGFS_MAGIC:
+        case TRACEFS_MAGIC:
+        case SECURITYFS_MAGIC:
+        case BPF_FS_MAGIC:
+        case PSTOREFS_MAGIC:
+        case EFIVARFS_MAGIC:
+            return 1;
+        }
+    }
+    return stat(path, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode);
+}
+
+// Depend on each file argument and on its name in its directory, which
+// catches it being created, removed or renamed. ls with no file argument
+// depends on the whole working directory. A command with an argument we can
+// neither watch nor rule out (one in a directory that does not exist) is not
+// cached, and neither is one that reads a pseudo-filesystem or a device.
+static int watch_paths(struct cache_entry *e, int argc, char **argv) {
+    int files = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            continue;
+        }
+        char dir[PATH_MAX];
+        const char *slash = strrchr(argv[i], '/');
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - argv[i]) + 1 : 1, slash ? argv[i] : ".");
+        const char *name = slash ? slash + 1 : argv[i];
+        if (volatile_path(dir) || volatile_path(argv[i])) {
+            return -1;
+        }
+        if (add_dep(e, dir, name[0] ? name : NULL) == -1) {
+            return -1;
+        }
+        if (add_dep(e, argv[i], NULL) == -1 && errno != ENOENT) {
+            return -1;  // A pattern or count that names no file is fine
+        }
+        files++;
+    }
+    if (files == 0 && strcmp(argv[0], "ls") == 0) {
+        return volatile_path(".") ? -1 : add_dep(e, ".", NULL);
+    }
+    return 0;
+}
+
+// Drop every entry that depends on one of the events. Caller holds
+// cache_lock.
+static void invalidate(struct inotify_event **events, int count) {
+    struct cache_entry *next;
+    for (struct cache_entry *e = lru_head; e; e = next) {
+        next = e->lru_next;
+        int hit = 0;
+        for (int i = 0; i < e->dep_count && !hit; i++) {
+            struct cache_dep *d = &e->deps[i];
+            for (int j = 0; j < count && !hit; j++) {
+                hit = d->wd == events[j]->wd &&
+                      (!d->name || events[j]->len == 0 || strcmp(d->name, events[j]->name) == 0);
+            }
+        }
+        if (hit) {
+            remove_entry(e);
+        }
+    }
+}
+
+// Apply every inotify event queued so far. Caller holds cache_lock.
+static void drain_events(void) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *events[512];
+
+    while (1) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return;  // EAGAIN: nothing left
+        }
+        int count = 0;
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW || count == (int)(sizeof(events) / sizeof(events[0]))) {
+                // Events were lost (or there are too many to track): start over
+                while (lru_head) {
+                    remove_entry(lru_head);
+                }
+                count = 0;
+            } else {
+                events[count++] = ev;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        invalidate(events, count);
+    }
+}
+
+// budget_bytes 0 leaves the cache off
+int cache_init(long budget_bytes) {
+    if (budget_bytes <= 0) {
+        return 0;
+    }
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("getcwd failed");
+        return -1;
+    }
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify_fd == -1) {
+        perror("inotify_init1 failed");
+        return -1;
+    }
+    budget = budget_bytes;
+    printf("Result cache: %ld KB\n", budget / 1024);
+    return 0;
+}
+
+// Serve cmd from the cache if we can. Returns 1 on a hit, with the output
+// and status written to r. On a miss of a cacheable command, r->fill is set
+// so the reply is stored when it finishes.
+int cache_lookup(struct reply *r, const char *cmd) {
+    char words[MAX_CMD_LEN];
+    char *argv[MAX_ARGS + 1];
+    char key[PATH_MAX + MAX_CMD_LEN + 1];
+
+    int argc = budget > 0 ? executor_read_only(cmd, words, argv) : 0;
+    if (argc == 0) {
+        return 0;
+    }
+
+    // The key is the working directory and the words with single spaces
+    int key_len = snprintf(key, sizeof(key), "%s", cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        key_len += snprintf(key + key_len, sizeof(key) - key_len, i ? " %s" : "%s", argv[i]);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    drain_events();
+    struct cache_entry *e = find_entry(key, key_len);
+    if (e && e->ready) {
+        char *copy = malloc(e->len + 1);
+        int len = e->len;
+        r->status = e->status;
+        if (copy) {
+            memcpy(copy, e->data, len);
+        }
+        lru_unlink(e);
+        lru_push_front(e);
+        pthread_mutex_unlock(&cache_lock);
+        if (!copy) {
+            return 0;
+        }
+        reply_write(r, copy, len, 0);  // Not under the lock: the client may be slow
+        free(copy);
+        metrics_count(CTR_CACHE_HIT, 1);
+        return 1;
+    }
+    metrics_count(CTR_CACHE_MISS, 1);
+    if (e) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;  // Someone else is filling it; just run the command
+    }
+
+    e = calloc(1, sizeof(struct cache_entry));
+    struct cache_fill *fill = calloc(1, sizeof(struct cache_fill));
+    char *entry_key = malloc(key_len);
+    char *fill_key = malloc(key_len);
+    if (!e || !fill || !entry_key || !fill_key) {
+        pthread_mutex_unlock(&cache_lock);
+        free(e);
+        free(fill);
+        free(entry_key);
+        free(fill_key);
+        return 0;
+    }
+    memcpy(entry_key, key, key_len);
+    memcpy(fill_key, key, key_len);
+    e->key = entry_key;
+    e->key_len = key_len;
+    e->id = next_id++;
+    if (watch_paths(e, argc, argv) == -1) {
+        release_deps(e);
+        pthread_mutex_unlock(&cache_lock);
+        free(e);
+        free(fill);
+        free(entry_key);
+        free(fill_key);
+        return 0;
+    }
+    unsigned int b = hash_key(key, key_len);
+    e->hash_next = buckets[b];
+    buckets[b] = e;
+    lru_push_front(e);
+    used += key_len;
+    entry_count++;
+
+    fill->key = fill_key;
+    fill->key_len = key_len;
+    fill->id = e->id;
+    r->fill = fill;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// Keep a copy of output that was just sent
+void cache_capture(struct cache_fill *fill, const char *data, int len) {
+    if (fill->broken) {
+        return;
+    }
+    if (fill->len + len > budget / ENTRY_MAX_DIVISOR) {
+        fill->broken = 1;
+        return;
+    }
+    if (fill->len + len > fill->cap) {
+        int cap = fill->cap ? fill->cap : 4096;
+        while (cap < fill->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(fill->data, cap);
+        if (!grown) {
+            fill->broken = 1;
+            return;
+        }
+        fill->data = grown;
+        fill->cap = cap;
+    }
+    memcpy(fill->data + fill->len, data, len);
+    fill->len += len;
+}
+
+static void free_fill(struct cache_fill *fill) {
+    free(fill->key);
+    free(fill->data);
+    free(fill);
+}
+
+// The reply is complete: store it if nothing changed while it ran
+void cache_finish(struct cache_fill *fill, int status) {
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *e = find_entry(fill->key, fill->key_len);
+    if (e && e->id == fill->id && !e->ready) {
+        if (fill->broken) {
+            remove_entry(e);
+        } else {
+            e->data = fill->data;
+            e->len = fill->len;
+            e->status = status;
+            e->ready = 1;
+            fill->data = NULL;
+            used += e->len;
+            while (used > budget && lru_tail && lru_tail != e) {
+                remove_entry(lru_tail);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free_fill(fill);
+}
+
+// The reply was cut short (output dropped for a slow client); store nothing
+void cache_abandon(struct cache_fill *fill) {
+    fill->broken = 1;
+    cache_finish(fill, 0);
+}
+
+int cache_report(char *buf, int size) {
+    if (budget == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache_lock);
+    int len = snprintf(buf, size, "cache_entries %d\ncache_bytes %ld\ncache_watches %d\n",
+                       entry_count, used, watch_count);
+    pthread_mutex_unlock(&cache_lock);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,29 @@
+/* Output cache for read-only shell commands.
+
+With -R, the output and exit status of plain cat, ls, grep, head, tail and wc
+commands are kept in memory, keyed on the command's words and the server's
+working directory. Before such a command runs, inotify watches go on every
+argument that exists and on its name in its directory (on the whole working
+directory for a bare ls); any change seen through one of them drops the
+entries that depend on it. An entry is created (empty) before the command starts, so a change
+while it runs discards the result instead of caching stale output. Entries
+are evicted least recently used first once the memory budget is reached.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "server.h"
+
+#define CACHE_MAX_WATCHES 16   // Paths watched for one command
+
+struct cache_fill;
+
+int cache_init(long budget_bytes);
+int cache_lookup(struct reply *r, const char *cmd);
+void cache_capture(struct cache_fill *fill, const char *data, int len);
+void cache_finish(struct cache_fill *fill, int status);
+void cache_abandon(struct cache_fill *fill);
+int cache_report(char *buf, int size);
+
+#endif
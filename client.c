@@ -10,57 +10,151 @@ handle multiple commands concurrently. The server can receive messages from queu
 commands independently. 
 */
 
-// COMPILE: gcc -o client client.c -lpthread -lrt
-// RUN: ./client
+// COMPILE: gcc -o client client.c clientlib.c shmring.c -lpthread -lrt
+// RUN: ./client [-T msg|shm|unix:path|tcp:port] [-f script|-] [-u]
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/ipc.h>
-#include <sys/msg.h>
-#include <pthread.h>
+#include <poll.h>
 #include <signal.h>
+#include <errno.h>
 
-#define MAX_CMD_LEN 256
-#define MSG_QUEUE_KEY 12345
+#include "protocol.h"
+#include "clientlib.h"
 
-// Message structure for the message queue
-struct msg_buffer {
-    long msg_type;
-    char msg_text[MAX_CMD_LEN];
-};
+// Connection to the server; replies come back through clientlib's callbacks
+struct client_conn *conn = NULL;
 
-// Function to handle server shutdown messages
-void *monitor_shutdown(void *arg) {
-    int msgid = *((int *)arg);
-    struct msg_buffer message;
-    while (1) {
-        // Receive shutdown message
-        if (msgrcv(msgid, &message, sizeof(message), 2, 0) != -1) {
-            if (strcmp(message.msg_text, "SHUTDOWN") == 0) {
-                printf("Server is shutting down...\n");
-                exit(0);  // Terminate the client
+// Script mode (-f) keeps up to PIPELINE_WINDOW commands in flight. Their
+// replies can come back in any order, so each command's output is collected
+// by the library and printed whole once its END arrives.
+#define PIPELINE_WINDOW 256
+int show_usage = 0;   // -u: print what each shell command used
+
+// Print a shell command's resource usage (-u)
+void print_usage(const struct reply_usage *usage) {
+    printf("[cpu %.1f ms user, %.1f ms sys; max rss %u KB]\n",
+           usage->user_us / 1000.0, usage->sys_us / 1000.0, usage->maxrss_kb);
+}
+
+// Interactive mode: output arrives in chunks as the command produces it
+void print_output(struct client_conn *c, const struct client_reply *reply, void *ctx) {
+    (void)c;
+    (void)ctx;
+    fwrite(reply->data, 1, reply->len, stdout);
+    if (reply->usage && show_usage) {
+        print_usage(reply->usage);
+    }
+    fflush(stdout);
+}
+
+// Script mode: print a command's whole output, tagged with its sequence
+// number. ctx is the command line, strdup'd when it was sent.
+void print_result(struct client_conn *c, const struct client_reply *reply, void *ctx) {
+    (void)c;
+    printf("--- [%u] %s (status %d) ---\n", reply->id, (char *)ctx, reply->status);
+    fwrite(reply->data, 1, reply->len, stdout);
+    if (reply->usage && show_usage) {
+        print_usage(reply->usage);
+    }
+    fflush(stdout);
+    free(ctx);
+}
+
+// Remove our reply queue (or ring) on the way out
+void close_connection() {
+    if (conn) {
+        client_close(conn);
+        conn = NULL;
+    }
+}
+
+// Ctrl+C: go through exit() so the reply queue is removed
+void handle_interrupt(int sig) {
+    (void)sig;
+    exit(0);
+}
+
+void server_gone() {
+    printf("Server is shutting down...\n");
+    exit(0);  // Terminate the client
+}
+
+// Wait until the server has answered all but limit of the commands we sent
+void wait_for_replies(int limit) {
+    while (client_pending(conn) > limit) {
+        if (client_wait(conn, -1) == -1) {
+            server_gone();
+        }
+    }
+}
+
+// Function to send commands to the server. Built-in commands go as bare
+// opcodes; only shell commands and prompts carry a payload.
+void send_command(struct client_conn *c, const char *command) {
+    if (client_submit(c, command, CLIENT_STREAM, print_output, NULL) == 0) {
+        if (errno == EPIPE) {
+            server_gone();
+        }
+        perror("Could not send command");
+        return;
+    }
+    printf("Sent command: %s\n", command);
+}
+
+// Non-interactive mode: read commands from a file (or stdin) and pipeline
+// them in batches without waiting for each answer
+void run_script(FILE *in) {
+    char line[WIRE_MAX_PAYLOAD];  // Room for a JOB
+    while (fgets(line, sizeof(line), in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strspn(line, " ") == strlen(line)) {
+            continue;  // Skip blank lines
+        }
+        if (client_pending(conn) >= PIPELINE_WINDOW) {
+            client_flush(conn);
+            wait_for_replies(PIPELINE_WINDOW - BATCH_MAX);
+        }
+        char *command = strdup(line);
+        while (client_submit(conn, line, CLIENT_MORE, print_result, command) == 0) {
+            if (errno != EAGAIN) {
+                server_gone();
+            }
+            if (client_wait(conn, -1) == -1) {  // Queue full; let replies drain
+                server_gone();
             }
         }
     }
-    return NULL;
+    client_flush(conn);
+    wait_for_replies(0);
 }
 
-// Function to send commands to the server
-void send_command(int msgid, const char *command) {
-    struct msg_buffer message;
-    message.msg_type = 1;
-    // Include client PID
-    snprintf(message.msg_text, MAX_CMD_LEN, "%d %s", getpid(), command);
-    if (msgsnd(msgid, &message, sizeof(message) - sizeof(long), 0) == -1) {
-        perror("msgsnd failed");
-        exit(1);
+// Wait for a line on stdin, handling a SHUTDOWN broadcast meanwhile
+void wait_for_input() {
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = client_fd(conn), .events = POLLIN },
+    };
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return;
+        }
+        if (fds[1].revents && client_dispatch(conn) == -1) {
+            server_gone();
+        }
+        if (fds[0].revents) {
+            return;
+        }
     }
-    printf("Sent command: %s\n", message.msg_text);
 }
 
 // Function to handle user input commands
-void handle_user_input(int msgid, char *command) {
+void handle_user_input(struct client_conn *conn, char *command) {
     // Check for empty input or commands with only spaces
     if (strlen(command) == 0 || strspn(command, " ") == strlen(command) || strspn(command, "") == strlen(command)) {
         printf("Invalid input. Please enter a valid command.\n");
@@ -77,59 +171,89 @@ void handle_user_input(int msgid, char *command) {
         }
     }
     if (strcmp(command, "EXIT") == 0) {
-        send_command(msgid, "EXIT");
+        send_command(conn, "EXIT");
         printf("Client disconnecting...\n");
     } else if (strcmp(command, "LIST") == 0) {
-        send_command(msgid, "LIST");
+        send_command(conn, "LIST");
     } else if (strcmp(command, "HIDE") == 0) {
-        send_command(msgid, "HIDE");
+        send_command(conn, "HIDE");
     } else if (strcmp(command, "UNHIDE") == 0) {
-        send_command(msgid, "UNHIDE");
+        send_command(conn, "UNHIDE");
     } else if (strcmp(command, "exit") == 0) {
         printf("Ignored 'exit' command as it may exit the shell session...\n");
     } else if (strcmp(command, "chpt new_prompt") == 0) {
-        send_command(msgid, "chpt new_prompt");
+        send_command(conn, "chpt new_prompt");
     } else if (strcmp(command, "CHPT") == 0) {
-        send_command(msgid, "CHPT");
+        send_command(conn, "CHPT");
     } else if (strcmp(command, "EXIT NOW") == 0) {
-        send_command(msgid, "EXIT NOW");
+        send_command(conn, "EXIT NOW");
     } else if (strcmp(command, "LIST all") == 0) {
-        send_command(msgid, "LIST all");
+        send_command(conn, "LIST all");
     } else if (strcmp(command, "HIDE client") == 0) {
-        send_command(msgid, "HIDE client");
+        send_command(conn, "HIDE client");
     } else if (strcmp(command, "UNHIDE user") == 0) {
-        send_command(msgid, "UNHIDE user");
+        send_command(conn, "UNHIDE user");
     }else if (strcmp(command, "SHUTDOWN") == 0) {
         printf ("Invalid because SHUTDOWN is a server-initiated broadcast command and cannot be sent by the client.");
     } else {
-        send_command(msgid, command);  // Send the command to the server
+        send_command(conn, command);  // Send the command to the server
     }
 }
 
 // Main function
-int main() {
-    // Initialize message queue
-    int msgid = msgget(MSG_QUEUE_KEY, 0666);
-    if (msgid == -1) {
-        perror("msgget failed");
+int main(int argc, char *argv[]) {
+    const char *transport = "msg";
+    FILE *script = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "T:f:u")) != -1) {
+        if (opt == 'T') {
+            transport = optarg;  // msg, shm, or the server's gateway
+        } else if (opt == 'u') {
+            show_usage = 1;
+        } else if (opt == 'f') {
+            // Commands from a file, or from stdin with "-"
+            script = strcmp(optarg, "-") == 0 ? stdin : fopen(optarg, "r");
+            if (!script) {
+                perror(optarg);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-T msg|shm|unix:path|tcp:port] [-f script|-] [-u]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // Set up our reply queue (or ring, or connection) and the thread that
+    // receives replies and SHUTDOWN messages from the server
+    conn = client_connect(transport);
+    if (!conn) {
         exit(1);
     }
+    atexit(close_connection);
+    signal(SIGINT, handle_interrupt);
 
-    // Create a child thread to monitor for SHUTDOWN messages from the server
-    pthread_t shutdown_thread;
-    pthread_create(&shutdown_thread, NULL, monitor_shutdown, &msgid);
-    pthread_detach(shutdown_thread);
+    if (script) {
+        run_script(script);
+        return 0;
+    }
 
+    // Read stdin unbuffered so poll() sees every line that is waiting
+    setvbuf(stdin, NULL, _IONBF, 0);
     while (1) {
-        char command[MAX_CMD_LEN];
+        char command[WIRE_MAX_PAYLOAD];  // Room for a JOB
         printf("Enter command: ");
-        fgets(command, MAX_CMD_LEN, stdin);
+        fflush(stdout);
+        wait_for_input();
+        if (fgets(command, sizeof(command), stdin) == NULL) {
+            break;  // End of input
+        }
 
         // Remove newline character from the input
         command[strcspn(command, "\n")] = '\0';
 
         // Handle user-defined commands
-        handle_user_input(msgid, command);
+        handle_user_input(conn, command);
+        wait_for_replies(0);
 
         if (strcmp(command, "EXIT") == 0) {
             break;  // Exit the client gracefully
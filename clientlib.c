@@ -0,0 +1,675 @@
+/* Client library: reply thread, request window and completion queue.
+
+Each request in flight has a slot in a window indexed by its id (the
+sequence number echoed in every reply chunk), holding its callback and, for
+requests that are not streamed, the output collected so far. The reply
+thread files each chunk under its slot; a finished request (or a streamed
+chunk) becomes an event on a FIFO and the eventfd is bumped when the FIFO
+goes from empty to non-empty. client_dispatch() takes the whole FIFO at
+once and runs the callbacks without holding the lock, so a callback is free
+to submit more requests.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "clientlib.h"
+#include "shmring.h"
+
+#define WINDOW_MASK (CLIENT_WINDOW - 1)
+#define HELLO_TRIES 200         // 10 ms apart
+#define RING_POLL_MS 100        // How often the reply thread checks for client_close
+#define FLUSH_RETRY_MS 10       // client_wait's sleep while a batch cannot be sent
+
+struct slot {
+    int active;
+    int flags;
+    client_reply_fn fn;
+    void *ctx;
+    char *output;        // Collected output, without CLIENT_STREAM
+    size_t len;
+    size_t cap;
+};
+
+// A callback to run: a finished request or a piece of streamed output
+struct event {
+    struct event *next;
+    client_reply_fn fn;
+    void *ctx;
+    struct client_reply reply;
+    struct reply_usage usage;
+    char *data;          // malloc'd
+};
+
+struct client_conn {
+    int pid;
+    int msgid;                   // Request queue
+    int reply_qid;               // -1 with the shared-memory transport
+    struct shm_ring *request_ring;
+    struct shm_ring *reply_ring;
+    int sock;                    // Connection to the gateway, or -1
+    int efd;
+    pthread_t thread;
+    int closing;
+
+    pthread_mutex_t lock;
+    struct slot window[CLIENT_WINDOW];
+    unsigned int last_id;
+    int outstanding;             // Submitted and not yet dispatched as done
+    struct event *head, *tail;
+    int shutdown;                // Server said SHUTDOWN (or the queue went away)
+
+    struct wire_msg batch;       // Requests held back by CLIENT_MORE
+    int batch_count;
+};
+
+// Fill in the header fields every request shares
+static void init_message(struct client_conn *conn, struct wire_msg *message, int opcode) {
+    message->msg_type = opcode_is_control(opcode) ? MSG_TYPE_CONTROL : MSG_TYPE_BULK;
+    message->hdr.magic = WIRE_MAGIC;
+    message->hdr.version = WIRE_VERSION;
+    message->hdr.opcode = opcode;
+    message->hdr.client_pid = conn->pid;
+    message->hdr.seq = 0;
+    message->hdr.len = 0;
+}
+
+// Send one request on the gateway socket. Returns -1 with errno EAGAIN if the
+// socket buffer is full; once part of it is out, waits to send the rest so
+// the stream stays framed.
+static int send_frame(int sock, const void *data, int size) {
+    int sent = 0;
+    while (sent < size) {
+        ssize_t n = send(sock, (const char *)data + sent, size - sent, MSG_NOSIGNAL | (sent == 0 ? MSG_DONTWAIT : 0));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// Send one request without waiting. Returns -1 with errno EAGAIN if the
+// transport is full.
+static int send_message(struct client_conn *conn, struct wire_msg *message) {
+    if (conn->sock != -1) {
+        return send_frame(conn->sock, &message->hdr, WIRE_SIZE(message->hdr.len));
+    }
+    if (conn->request_ring) {
+        return ring_push(conn->request_ring, &message->hdr, WIRE_SIZE(message->hdr.len), 0);
+    }
+    return msgsnd(conn->msgid, message, WIRE_SIZE(message->hdr.len), IPC_NOWAIT);
+}
+
+// Ask the server which request queue to use: send OP_HELLO to the rendezvous
+// queue and pick our shard from the ids in the reply. Falls back to the
+// rendezvous queue if no answer comes (older servers ignore OP_HELLO).
+static int discover_queue(struct client_conn *conn) {
+    struct wire_msg message;
+    struct reply_buffer reply;
+    int qids[MAX_SHARDS];
+    int len = 0;
+
+    init_message(conn, &message, OP_HELLO);
+    if (msgsnd(conn->msgid, &message, WIRE_SIZE(0), 0) == -1) {
+        perror("msgsnd failed");
+        return conn->msgid;
+    }
+    for (int tries = 0; tries < HELLO_TRIES; tries++) {
+        if (msgrcv(conn->reply_qid, &reply, sizeof(reply) - sizeof(long), conn->pid, IPC_NOWAIT) == -1) {
+            usleep(10000);
+            continue;
+        }
+        if (reply.len <= (int)sizeof(qids) - len) {
+            memcpy((char *)qids + len, reply.data, reply.len);
+            len += reply.len;
+        }
+        if (reply.flags & REPLY_END) {
+            int count = len / sizeof(int);
+            return count > 0 ? qids[shard_for_pid(conn->pid, count)] : conn->msgid;
+        }
+    }
+    fprintf(stderr, "No answer to OP_HELLO; using the main request queue\n");
+    return conn->msgid;
+}
+
+// Create the reply queue the server looks up by our PID. A queue left behind
+// by an earlier process with the same PID is replaced.
+static int create_reply_queue(int pid) {
+    int key = REPLY_QUEUE_KEY(pid);
+    int qid = msgget(key, 0666 | IPC_CREAT | IPC_EXCL);
+    if (qid == -1) {
+        msgctl(msgget(key, 0666), IPC_RMID, NULL);
+        qid = msgget(key, 0666 | IPC_CREAT | IPC_EXCL);
+    }
+    return qid;
+}
+
+// Queue an event for client_dispatch. Caller holds conn->lock. Returns 1 if
+// the FIFO was empty, i.e. the eventfd needs a poke.
+static int push_event(struct client_conn *conn, struct slot *s, unsigned int id, int done, int status,
+                      char *data, size_t len, const struct reply_usage *usage) {
+    struct event *ev = malloc(sizeof(struct event));
+    if (!ev) {
+        perror("malloc failed");
+        free(data);
+        return 0;
+    }
+    ev->next = NULL;
+    ev->fn = s->fn;
+    ev->ctx = s->ctx;
+    ev->data = data;
+    ev->reply.id = id;
+    ev->reply.done = done;
+    ev->reply.status = status;
+    ev->reply.data = data ? data : "";
+    ev->reply.len = len;
+    ev->reply.usage = NULL;
+    if (usage) {
+        ev->usage = *usage;
+        ev->reply.usage = &ev->usage;
+    }
+    int was_empty = conn->head == NULL;
+    if (conn->tail) {
+        conn->tail->next = ev;
+    } else {
+        conn->head = ev;
+    }
+    conn->tail = ev;
+    return was_empty;
+}
+
+static void wake(struct client_conn *conn) {
+    uint64_t one = 1;
+    if (write(conn->efd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write eventfd failed");
+    }
+}
+
+// File one reply chunk under its request. Caller holds conn->lock.
+static int file_chunk(struct client_conn *conn, struct reply_buffer *reply) {
+    struct reply_usage usage;
+    int has_usage = reply_take_usage(reply, &usage);
+    struct slot *s = &conn->window[reply->seq & WINDOW_MASK];
+    int end = (reply->flags & REPLY_END) != 0;
+    if (!s->active) {
+        return 0;  // Not ours (e.g. the OP_HELLO answer arriving late)
+    }
+
+    if (s->flags & CLIENT_STREAM) {
+        char *data = NULL;
+        if (reply->len > 0 && (data = malloc(reply->len)) != NULL) {
+            memcpy(data, reply->data, reply->len);
+        }
+        s->active = !end;
+        return push_event(conn, s, reply->seq, end, reply->status, data, data ? reply->len : 0,
+                          has_usage ? &usage : NULL);
+    }
+
+    if (s->len + reply->len > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : REPLY_CHUNK;
+        while (cap < s->len + reply->len) {
+            cap *= 2;
+        }
+        char *grown = realloc(s->output, cap);
+        if (!grown) {
+            perror("realloc failed");
+            return 0;
+        }
+        s->output = grown;
+        s->cap = cap;
+    }
+    memcpy(s->output + s->len, reply->data, reply->len);
+    s->len += reply->len;
+    if (!end) {
+        return 0;
+    }
+    char *output = s->output;
+    size_t len = s->len;
+    s->output = NULL;
+    s->len = s->cap = 0;
+    s->active = 0;
+    return push_event(conn, s, reply->seq, 1, reply->status, output, len, has_usage ? &usage : NULL);
+}
+
+// The server is gone: finish every request still in flight. Caller holds
+// conn->lock. Always returns 1: client_dispatch has news even with nothing
+// in flight.
+static int fail_all(struct client_conn *conn) {
+    conn->shutdown = 1;
+    for (int i = 0; i < CLIENT_WINDOW; i++) {
+        struct slot *s = &conn->window[i];
+        if (!s->active) {
+            continue;
+        }
+        char *output = s->output;
+        size_t len = s->len;
+        s->output = NULL;
+        s->len = s->cap = 0;
+        s->active = 0;
+        unsigned int id = conn->last_id - ((conn->last_id - i) & WINDOW_MASK);
+        push_event(conn, s, id, 1, CLIENT_STATUS_SHUTDOWN, output, len, NULL);
+    }
+    return 1;
+}
+
+static int read_full(int fd, void *buf, int size) {
+    int got = 0;
+    while (got < size) {
+        ssize_t n = recv(fd, (char *)buf + got, size - got, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+// Read one reply chunk off the gateway socket: its header, then len bytes.
+// Returns -1 once the connection is closed (or garbled).
+static int read_reply(int sock, struct reply_buffer *reply) {
+    if (read_full(sock, &reply->flags, REPLY_SIZE(0)) == -1 ||
+        reply->len < 0 || reply->len > (int)sizeof(reply->data)) {
+        return -1;
+    }
+    return read_full(sock, reply->data, reply->len);
+}
+
+// Receive replies (command output and the SHUTDOWN broadcast), addressed to
+// our PID, until client_close or the server goes away
+static void *reply_thread(void *arg) {
+    struct client_conn *conn = arg;
+    struct reply_buffer reply;
+    while (!__atomic_load_n(&conn->closing, __ATOMIC_ACQUIRE)) {
+        if (conn->sock != -1) {
+            if (read_reply(conn->sock, &reply) == -1) {
+                if (!__atomic_load_n(&conn->closing, __ATOMIC_ACQUIRE)) {
+                    pthread_mutex_lock(&conn->lock);  // The server closed the connection
+                    fail_all(conn);
+                    pthread_mutex_unlock(&conn->lock);
+                    wake(conn);
+                }
+                return NULL;
+            }
+        } else if (conn->reply_ring) {
+            if (ring_pop(conn->reply_ring, &reply.flags, RING_POLL_MS) == -1) {
+                continue;
+            }
+        } else if (msgrcv(conn->reply_qid, &reply, sizeof(reply) - sizeof(long), conn->pid, 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EIDRM || !__atomic_load_n(&conn->closing, __ATOMIC_ACQUIRE)) {
+                perror("msgrcv failed");
+                pthread_mutex_lock(&conn->lock);
+                fail_all(conn);
+                pthread_mutex_unlock(&conn->lock);
+                wake(conn);
+            }
+            return NULL;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        int poke = (reply.flags & REPLY_SHUTDOWN) ? fail_all(conn) : file_chunk(conn, &reply);
+        pthread_mutex_unlock(&conn->lock);
+        if (poke) {
+            wake(conn);
+        }
+        if (reply.flags & REPLY_SHUTDOWN) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Open a stream connection to the server's gateway at "unix:PATH" or
+// "tcp:PORT" (on 127.0.0.1). Returns the socket, or -1 with errno set.
+int client_dial(const char *address) {
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, address + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+    } else if (strncmp(address, "tcp:", 4) == 0 && atoi(address + 4) > 0 && atoi(address + 4) < 65536) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(atoi(address + 4));
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (fd != -1 && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0 &&
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    int saved = errno;
+    if (fd != -1) {
+        close(fd);
+    }
+    errno = saved;
+    return -1;
+}
+
+// Connect to a running server. transport is "msg" (or NULL) for message
+// queues, "shm" for shared-memory rings, or a gateway address for
+// client_dial. Returns NULL (after printing why) on failure.
+struct client_conn *client_connect(const char *transport) {
+    struct client_conn *conn = calloc(1, sizeof(struct client_conn));
+    if (!conn) {
+        perror("calloc failed");
+        return NULL;
+    }
+    conn->pid = getpid();
+    conn->msgid = -1;
+    conn->reply_qid = -1;
+    conn->sock = -1;
+    conn->efd = -1;
+    pthread_mutex_init(&conn->lock, NULL);
+    int use_shm = transport && strcmp(transport, "shm") == 0;
+
+    // A gateway connection needs no queues: the server knows it by the
+    // connection. Otherwise start from the rendezvous queue; discover_queue
+    // picks our shard.
+    if (transport && !use_shm && strcmp(transport, "msg") != 0) {
+        conn->sock = client_dial(transport);
+        if (conn->sock == -1) {
+            perror(transport);
+            goto fail;
+        }
+    } else if ((conn->msgid = msgget(MSG_QUEUE_KEY, 0666)) == -1) {
+        perror("msgget failed");
+        goto fail;
+    } else if (use_shm) {
+        // The server must be running with -T shm
+        conn->request_ring = ring_attach(SHM_REQUEST_KEY, REQUEST_RING_SLOT_SIZE);
+        if (!conn->request_ring) {
+            fprintf(stderr, "Server has no shared-memory transport (start it with -T shm)\n");
+            goto fail;
+        }
+        conn->reply_ring = ring_create(REPLY_RING_KEY(conn->pid), REPLY_RING_SLOTS, REPLY_RING_SLOT_SIZE);
+        if (!conn->reply_ring) {
+            goto fail;
+        }
+    } else {
+        conn->reply_qid = create_reply_queue(conn->pid);
+        if (conn->reply_qid == -1) {
+            perror("msgget (reply queue) failed");
+            goto fail;
+        }
+        conn->msgid = discover_queue(conn);
+    }
+
+    conn->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (conn->efd == -1) {
+        perror("eventfd failed");
+        goto fail;
+    }
+    if (pthread_create(&conn->thread, NULL, reply_thread, conn) != 0) {
+        perror("pthread_create failed");
+        goto fail;
+    }
+    return conn;
+
+fail:
+    if (conn->reply_qid != -1) {
+        msgctl(conn->reply_qid, IPC_RMID, NULL);
+    }
+    if (conn->reply_ring) {
+        ring_remove(conn->reply_ring);
+        ring_detach(conn->reply_ring);
+    }
+    if (conn->request_ring) {
+        ring_detach(conn->request_ring);
+    }
+    if (conn->sock != -1) {
+        close(conn->sock);
+    }
+    if (conn->efd != -1) {
+        close(conn->efd);
+    }
+    free(conn);
+    return NULL;
+}
+
+// Readable whenever client_dispatch has callbacks to run
+int client_fd(struct client_conn *conn) {
+    return conn->efd;
+}
+
+// Send the requests held back by CLIENT_MORE. Caller holds conn->lock.
+// A lone request goes as itself rather than as a batch of one.
+static int flush_locked(struct client_conn *conn) {
+    if (conn->batch_count == 0) {
+        return 0;
+    }
+    struct wire_msg *message = &conn->batch;
+    int result;
+    if (conn->batch_count == 1) {
+        struct wire_msg single;
+        struct batch_entry entry;
+        memcpy(&entry, message->payload, sizeof(entry));
+        init_message(conn, &single, entry.opcode);
+        single.hdr.seq = message->hdr.seq;
+        single.hdr.len = entry.len;
+        memcpy(single.payload, message->payload + sizeof(entry), entry.len);
+        result = send_message(conn, &single);
+    } else {
+        result = send_message(conn, message);
+    }
+    if (result == 0) {
+        conn->batch_count = 0;
+    }
+    return result;
+}
+
+// Queue a command (a shell command or a built-in such as LIST or CHPT) and,
+// unless flags has CLIENT_MORE, send it. fn is called from client_dispatch
+// with its output. Returns the request's id, or 0 with errno EAGAIN (window
+// or transport full; dispatch some replies and try again) or EPIPE (the
+// server has shut down).
+unsigned int client_submit(struct client_conn *conn, const char *command, int flags,
+                           client_reply_fn fn, void *ctx) {
+    struct batch_entry entry;
+    const char *payload;
+    entry.opcode = opcode_for_name(command, &payload);
+    entry.reserved = 0;
+    entry.len = strnlen(payload, entry.opcode == OP_JOB ? MAX_JOB_LEN : MAX_CMD_LEN - 1);
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->shutdown) {
+        pthread_mutex_unlock(&conn->lock);
+        errno = EPIPE;
+        return 0;
+    }
+    unsigned int id = conn->last_id + 1;
+    if (id == 0) {
+        id = 1;  // 0 means failure
+    }
+    struct slot *s = &conn->window[id & WINDOW_MASK];
+    if (s->active || conn->outstanding >= CLIENT_WINDOW) {
+        pthread_mutex_unlock(&conn->lock);
+        errno = EAGAIN;
+        return 0;
+    }
+    struct wire_msg *message = &conn->batch;
+    if (conn->batch_count == BATCH_MAX ||
+        message->hdr.len + sizeof(entry) + entry.len > WIRE_MAX_PAYLOAD) {
+        if (flush_locked(conn) == -1) {
+            pthread_mutex_unlock(&conn->lock);
+            return 0;
+        }
+    }
+
+    if (conn->batch_count == 0) {
+        init_message(conn, message, OP_BATCH);
+        message->msg_type = MSG_TYPE_CONTROL;  // Until a shell command joins the batch
+        message->hdr.seq = id;
+    }
+    if (!opcode_is_control(entry.opcode)) {
+        message->msg_type = MSG_TYPE_BULK;
+    }
+    memcpy(message->payload + message->hdr.len, &entry, sizeof(entry));
+    memcpy(message->payload + message->hdr.len + sizeof(entry), payload, entry.len);
+    message->hdr.len += sizeof(entry) + entry.len;
+    conn->batch_count++;
+
+    s->active = 1;
+    s->flags = flags;
+    s->fn = fn;
+    s->ctx = ctx;
+    conn->last_id = id;
+    conn->outstanding++;
+    if (!(flags & CLIENT_MORE)) {
+        flush_locked(conn);  // Left for client_flush if the transport is full
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return id;
+}
+
+// Send what CLIENT_MORE held back. Returns -1 with errno EAGAIN if the
+// transport is full; client_wait and client_dispatch retry it.
+int client_flush(struct client_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    int result = flush_locked(conn);
+    pthread_mutex_unlock(&conn->lock);
+    return result;
+}
+
+// Run the callbacks of everything that has arrived. Returns the number of
+// callbacks run, or -1 once the server has shut down (after finishing off
+// every request still in flight).
+int client_dispatch(struct client_conn *conn) {
+    uint64_t value;
+    if (read(conn->efd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+        perror("read eventfd failed");
+    }
+    pthread_mutex_lock(&conn->lock);
+    flush_locked(conn);
+    struct event *ev = conn->head;
+    conn->head = conn->tail = NULL;
+    pthread_mutex_unlock(&conn->lock);
+
+    int count = 0;
+    while (ev) {
+        struct event *next = ev->next;
+        if (ev->reply.done) {
+            pthread_mutex_lock(&conn->lock);
+            conn->outstanding--;
+            pthread_mutex_unlock(&conn->lock);
+        }
+        if (ev->fn) {
+            ev->fn(conn, &ev->reply, ev->ctx);
+        }
+        free(ev->data);
+        free(ev);
+        ev = next;
+        count++;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    int gone = conn->shutdown && conn->head == NULL;
+    pthread_mutex_unlock(&conn->lock);
+    return gone ? -1 : count;
+}
+
+// For callers without an event loop: wait up to timeout_ms (-1 = forever)
+// for replies and dispatch them. Returns what client_dispatch returns, or 0
+// on timeout.
+int client_wait(struct client_conn *conn, int timeout_ms) {
+    pthread_mutex_lock(&conn->lock);
+    int unsent = conn->batch_count > 0 && flush_locked(conn) == -1;
+    pthread_mutex_unlock(&conn->lock);
+    if (unsent && (timeout_ms < 0 || timeout_ms > FLUSH_RETRY_MS)) {
+        timeout_ms = FLUSH_RETRY_MS;  // Come back soon to send the rest
+    }
+
+    struct pollfd pfd = { .fd = conn->efd, .events = POLLIN };
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n == -1 && errno != EINTR) {
+        perror("poll failed");
+    }
+    if (n <= 0) {
+        pthread_mutex_lock(&conn->lock);
+        int gone = conn->shutdown && conn->head == NULL;
+        pthread_mutex_unlock(&conn->lock);
+        return gone ? -1 : 0;
+    }
+    return client_dispatch(conn);
+}
+
+// Requests whose final callback has not run yet
+int client_pending(struct client_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    int n = conn->outstanding;
+    pthread_mutex_unlock(&conn->lock);
+    return n;
+}
+
+// Stop the reply thread and remove the reply queue (or ring). Callbacks that
+// have not run are dropped. Does not send EXIT.
+void client_close(struct client_conn *conn) {
+    __atomic_store_n(&conn->closing, 1, __ATOMIC_RELEASE);
+    if (conn->reply_qid != -1) {
+        msgctl(conn->reply_qid, IPC_RMID, NULL);  // Wakes the thread with EIDRM
+    }
+    if (conn->sock != -1) {
+        shutdown(conn->sock, SHUT_RDWR);  // Wakes the thread with end of stream
+    }
+    pthread_join(conn->thread, NULL);
+    if (conn->sock != -1) {
+        close(conn->sock);
+    }
+    if (conn->reply_ring) {
+        ring_remove(conn->reply_ring);  // Freed once the server detaches as well
+        ring_detach(conn->reply_ring);
+    }
+    if (conn->request_ring) {
+        ring_detach(conn->request_ring);
+    }
+    close(conn->efd);
+
+    struct event *ev = conn->head;
+    while (ev) {
+        struct event *next = ev->next;
+        free(ev->data);
+        free(ev);
+        ev = next;
+    }
+    for (int i = 0; i < CLIENT_WINDOW; i++) {
+        free(conn->window[i].output);
+    }
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
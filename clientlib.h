@@ -0,0 +1,58 @@
+/* Client library: send commands to the server from inside an event loop.
+
+client_connect() sets up the reply queue (or ring, or connects to the
+server's socket gateway), finds the request queue to use and starts a thread
+that receives replies. client_submit() never
+blocks: it returns the request's id, or 0 with errno EAGAIN when the
+transport or the in-flight window is full. Requests submitted with
+CLIENT_MORE are held back and packed into one OP_BATCH request, which goes
+out with the next submit without it or with client_flush().
+
+Replies are handed over through an eventfd, so client_fd() can sit in an
+epoll or poll set next to the caller's other descriptors. When it is
+readable, client_dispatch() runs the callback of every reply that has
+arrived, on the caller's thread. A request submitted with CLIENT_STREAM gets
+a call for each piece of output as the command produces it; otherwise one
+call with the whole output once it has finished. Up to CLIENT_WINDOW
+requests may be in flight.
+*/
+
+#ifndef CLIENTLIB_H
+#define CLIENTLIB_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+#define CLIENT_WINDOW 1024         // Requests in flight, power of two
+#define CLIENT_STATUS_SHUTDOWN -1  // Server went away before answering
+
+// client_submit flags
+#define CLIENT_STREAM 0x1   // Deliver output as it arrives
+#define CLIENT_MORE   0x2   // More requests follow; hold this one for a batch
+
+struct client_conn;
+
+struct client_reply {
+    unsigned int id;      // As returned by client_submit
+    int done;             // Last call for this request; status is valid
+    int status;           // Exit status, or CLIENT_STATUS_SHUTDOWN
+    const char *data;     // This piece of output, or all of it
+    size_t len;
+    const struct reply_usage *usage;  // With done, for shell commands; else NULL
+};
+
+typedef void (*client_reply_fn)(struct client_conn *conn, const struct client_reply *reply, void *ctx);
+
+struct client_conn *client_connect(const char *transport);
+int client_dial(const char *address);
+int client_fd(struct client_conn *conn);
+unsigned int client_submit(struct client_conn *conn, const char *command, int flags,
+                           client_reply_fn fn, void *ctx);
+int client_flush(struct client_conn *conn);
+int client_dispatch(struct client_conn *conn);
+int client_wait(struct client_conn *conn, int timeout_ms);
+int client_pending(struct client_conn *conn);
+void client_close(struct client_conn *conn);
+
+#endif
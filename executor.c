@@ -0,0 +1,171 @@
+/* Spawning commands without fork() or, where possible, bash.
+
+The child gets /dev/null on stdin, the output pipe on stdout and stderr, and
+an empty signal mask (the server blocks SIGINT in every thread). Everything
+else the server has open is close-on-exec.
+
+The child is cloned the way posix_spawn() does it (CLONE_VM | CLONE_VFORK,
+on a stack of its own) but runs our own code up to exec, so the caller's
+setup hook can put it under limits before the command gets control. Until
+it execs it shares the server's memory, with the spawning thread suspended:
+it makes only system calls.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "protocol.h"
+#include "executor.h"
+#include "metrics.h"
+
+#define CHILD_STACK 65536   // The child's until it execs (execvp searches PATH on it)
+
+// Shared with the child until it execs
+struct spawn_child {
+    char **argv;
+    int use_shell;
+    int outfd;
+    executor_setup_fn setup;
+    void *ctx;
+    int err;             // Set by the child if the program could not be started
+};
+
+// Anything bash would treat specially
+static const char shell_chars[] = "|&;<>()$`\\\"'*?[]#~=%{}!\n\t";
+
+// Words bash runs itself rather than exec'ing (a direct exec would fail or
+// do something different)
+static const char *const shell_words[] = {
+    "cd", "exit", "export", "unset", "set", "source", ".", "alias", "unalias",
+    "exec", "eval", "read", "ulimit", "umask", "type", "hash", "shift", "trap",
+    "wait", "jobs", "fg", "bg", "history", "declare", "local", "let", "builtin",
+    "command", "if", "for", "while", "until", "case", "function", "time", "[[",
+    "pwd", NULL
+};
+
+// Programs whose only effect is their output
+static const char *const read_only[] = { "cat", "ls", "grep", "head", "tail", "wc", NULL };
+
+// Returns 1 if cmd needs bash to run
+int executor_needs_shell(const char *cmd) {
+    if (strpbrk(cmd, shell_chars) != NULL) {
+        return 1;
+    }
+    size_t len = strcspn(cmd, " ");
+    for (int i = 0; shell_words[i]; i++) {
+        if (strlen(shell_words[i]) == len && strncmp(cmd, shell_words[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Split cmd into argv (the words live in words, MAX_CMD_LEN bytes) if all
+// it does is read files: plain cat, ls, grep, head, tail or wc, with no
+// recursive option and no tail -f. Returns argc, or 0 for anything else.
+int executor_read_only(const char *cmd, char *words, char **argv) {
+    int argc = 0;
+    if (executor_needs_shell(cmd)) {
+        return 0;
+    }
+    strncpy(words, cmd, MAX_CMD_LEN - 1);
+    words[MAX_CMD_LEN - 1] = '\0';
+    for (char *save, *w = strtok_r(words, " ", &save); w; w = strtok_r(NULL, " ", &save)) {
+        if (argc == MAX_ARGS) {
+            return 0;
+        }
+        argv[argc++] = w;
+    }
+    argv[argc] = NULL;
+    int ok = 0;
+    for (int i = 0; argc > 0 && read_only[i]; i++) {
+        ok |= strcmp(argv[0], read_only[i]) == 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        // Recursive listings and searches read more than they name; tail -f never ends
+        if (argv[i][0] == '-' && strpbrk(argv[i] + 1, "rRf")) {
+            ok = 0;
+        }
+    }
+    return ok ? argc : 0;
+}
+
+// The child, from clone to exec
+static int child_main(void *arg) {
+    struct spawn_child *sc = arg;
+    if (sc->setup) {
+        sc->setup(sc->ctx);
+    }
+    int null = open("/dev/null", O_RDONLY);
+    if (null == -1 || dup2(null, STDIN_FILENO) == -1 ||
+        dup2(sc->outfd, STDOUT_FILENO) == -1 || dup2(sc->outfd, STDERR_FILENO) == -1) {
+        sc->err = errno;
+        _exit(127);
+    }
+    if (null != STDIN_FILENO) {
+        close(null);
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);  // Let Ctrl+C reach the command again
+    if (sc->use_shell) {
+        execv("/bin/bash", sc->argv);
+    } else {
+        execvp(sc->argv[0], sc->argv);  // Searches PATH unless the name has a '/'
+    }
+    sc->err = errno;
+    _exit(127);
+}
+
+// Start cmd with its output on outfd, calling setup(ctx) in the child before
+// it execs (see executor_setup_fn). Returns 0 and sets *pid, or the errno
+// value if the program could not be started.
+int executor_spawn(const char *cmd, int outfd, executor_setup_fn setup, void *ctx, pid_t *pid) {
+    static const char *bash_argv[] = { "bash", "-c", NULL, NULL };
+    char words[MAX_CMD_LEN];
+    char *argv[MAX_ARGS + 1];
+    int argc = 0;
+    int use_shell = executor_needs_shell(cmd);
+
+    if (!use_shell) {
+        // Plain words: split on spaces and exec the program ourselves
+        strncpy(words, cmd, sizeof(words) - 1);
+        words[sizeof(words) - 1] = '\0';
+        for (char *save, *w = strtok_r(words, " ", &save); w; w = strtok_r(NULL, " ", &save)) {
+            if (argc == MAX_ARGS) {
+                use_shell = 1;  // Too many to bother with
+                break;
+            }
+            argv[argc++] = w;
+        }
+        argv[argc] = NULL;
+    }
+    if (use_shell || argc == 0) {
+        memcpy(argv, bash_argv, sizeof(bash_argv));
+        argv[2] = (char *)cmd;
+        use_shell = 1;
+    }
+
+    // We are suspended until the child execs or exits, so its stack can be on ours
+    char stack[CHILD_STACK] __attribute__((aligned(16)));
+    struct spawn_child sc = { argv, use_shell, outfd, setup, ctx, 0 };
+    pid_t child = clone(child_main, stack + sizeof(stack), CLONE_VM | CLONE_VFORK | SIGCHLD, &sc);
+    if (child == -1) {
+        return errno;
+    }
+    if (sc.err != 0) {
+        waitpid(child, NULL, 0);  // It never became the command
+        return sc.err;
+    }
+    *pid = child;
+    metrics_count(use_shell ? CTR_SPAWN_SHELL : CTR_SPAWN_DIRECT, 1);
+    return 0;
+}
@@ -0,0 +1,29 @@
+/* Command launcher.
+
+Commands are started with a vfork-style clone, as posix_spawn() would: the
+child shares the server's memory until it execs, so no page tables are
+copied however large the server gets. Unlike posix_spawn(), the caller gets
+a hook that runs in the child just before exec. Commands made of
+plain words are exec'd directly; bash is only started when the command uses
+shell syntax (quotes, pipes, redirection, globs, variables, builtins, ...).
+Children stay children of the server, so the supervisor reaps and times them
+out exactly as before.
+*/
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <sys/types.h>
+
+#define MAX_ARGS 32
+
+// Runs in the child before it execs. It shares the server's memory while the
+// spawning thread waits, so it may only make system calls: no locks, no
+// malloc, no stdio.
+typedef void (*executor_setup_fn)(void *ctx);
+
+int executor_needs_shell(const char *cmd);
+int executor_read_only(const char *cmd, char *words, char **argv);
+int executor_spawn(const char *cmd, int outfd, executor_setup_fn setup, void *ctx, pid_t *pid);
+
+#endif
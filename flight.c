@@ -0,0 +1,323 @@
+/* Single-flight table.
+
+Running commands that others may join are kept in a chained hash table
+keyed on opcode and text, guarded by one mutex. The first arrival (the
+leader) runs the command as usual with r->flight set; reply_flush() copies
+everything it sends into the flight and calls flight_finish() with the END
+chunk, which takes the flight out of the table and sends each waiter its own
+reply. Waiters are queued on the flight with their own copy of the command,
+so if the leader's output turns out too big to share (or is dropped for a
+slow client) they are simply put back in the queue to run on their own.
+
+Before joining, a fingerprint of what the command depends on is compared
+with the one the leader took when it started; a client that changed a file
+or the registry and then asks again never gets an answer from before.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "flight.h"
+#include "registry.h"
+#include "executor.h"
+#include "pool.h"
+#include "sched.h"
+#include "metrics.h"
+
+#define FLIGHT_BUCKETS 64   // Power of two
+
+struct flight_waiter {
+    struct command_args args;
+    struct flight_waiter *next;
+};
+
+struct flight {
+    int opcode;
+    char command[MAX_CMD_LEN];
+    unsigned long long fingerprint;
+    int joinable;       // Still in the table
+    int broken;         // Output not kept; waiters must run on their own. Set under flight_lock.
+    char *data;
+    int len;
+    int cap;
+    struct flight_waiter *waiters;
+    struct flight *next;
+};
+
+// Fingerprint of the state a command's output depends on. Returns -1 if the
+// command cannot be coalesced at all.
+typedef int (*fingerprint_fn)(const struct command_args *args, unsigned long long *out);
+
+struct flight_class {
+    const char *name;
+    int opcode;
+    fingerprint_fn fingerprint;
+};
+
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flight *buckets[FLIGHT_BUCKETS];
+static int enabled[OP_COUNT];   // Class index + 1 per opcode, 0 = never coalesced
+
+static unsigned long long mix(unsigned long long h, unsigned long long v) {
+    return (h ^ v) * 1099511628211ull;   // FNV-1a, a word at a time
+}
+
+static int fingerprint_none(const struct command_args *args, unsigned long long *out) {
+    (void)args;
+    *out = 0;
+    return 0;
+}
+
+static int fingerprint_registry(const struct command_args *args, unsigned long long *out) {
+    (void)args;
+    *out = registry_version();
+    return 0;
+}
+
+// Identity and change times of every file the command names (the working
+// directory for a bare ls)
+static int fingerprint_files(const struct command_args *args, unsigned long long *out) {
+    char words[MAX_CMD_LEN];
+    char *argv[MAX_ARGS + 1];
+    int argc = executor_read_only(args->command, words, argv);
+    if (argc == 0) {
+        return -1;
+    }
+    unsigned long long h = 14695981039346656037ull;
+    int files = 0;
+    for (int i = 1; i <= argc; i++) {
+        const char *path = argv[i];
+        if (i == argc) {
+            if (files > 0 || strcmp(argv[0], "ls") != 0) {
+                break;
+            }
+            path = ".";
+        } else if (path[0] == '-') {
+            continue;
+        }
+        struct stat st;
+        if (stat(path, &st) == -1) {
+            h = mix(h, 0);  // A name that is not there must stay not there
+        } else {
+            h = mix(h, st.st_dev);
+            h = mix(h, st.st_ino);
+            h = mix(h, st.st_size);
+            h = mix(h, st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec);
+            h = mix(h, st.st_ctim.tv_sec * 1000000000ull + st.st_ctim.tv_nsec);
+        }
+        files++;
+    }
+    *out = h;
+    return 0;
+}
+
+static const struct flight_class classes[] = {
+    { "list", OP_LIST, fingerprint_registry },
+    { "status", OP_STATUS, fingerprint_none },
+    { "stats", OP_STATS, fingerprint_none },
+    { "read", OP_SHELL, fingerprint_files },
+};
+#define CLASS_COUNT (int)(sizeof(classes) / sizeof(classes[0]))
+
+// Enable the comma-separated classes ("none" for no coalescing). Returns -1
+// for an unknown class, or one whose commands have side effects.
+int flight_init(const char *list) {
+    char copy[128];
+    strncpy(copy, list, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    memset(enabled, 0, sizeof(enabled));
+
+    for (char *save, *name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (strcmp(name, "none") == 0) {
+            continue;
+        }
+        int found = 0;
+        for (int i = 0; i < CLASS_COUNT; i++) {
+            if (strcmp(name, classes[i].name) == 0) {
+                enabled[classes[i].opcode] = i + 1;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Cannot coalesce '%s': not a read-only command class\n", name);
+            return -1;
+        }
+    }
+    printf("Coalescing: %s\n", list);
+    return 0;
+}
+
+static unsigned int bucket_for(int opcode, const char *command) {
+    unsigned int h = 2166136261u ^ (unsigned int)opcode;
+    for (const char *p = command; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h & (FLIGHT_BUCKETS - 1);
+}
+
+// Join an identical command already running, or become the one others may
+// join. Returns 1 if args was attached as a waiter: its reply will be sent
+// when the running command finishes, and the caller must not touch r.
+// Otherwise returns 0, with r->flight set if others may now join r.
+int flight_begin(const struct command_args *args, struct reply *r) {
+    int class = enabled[args->opcode];
+    unsigned long long fingerprint;
+    if (class == 0 || args->solo || classes[class - 1].fingerprint(args, &fingerprint) == -1) {
+        return 0;
+    }
+    unsigned int b = bucket_for(args->opcode, args->command);
+
+    pthread_mutex_lock(&flight_lock);
+    for (struct flight *f = buckets[b]; f; f = f->next) {
+        if (f->opcode != args->opcode || strcmp(f->command, args->command) != 0) {
+            continue;
+        }
+        if (f->broken || f->fingerprint != fingerprint) {
+            break;  // Run it again, as a new flight others can join
+        }
+        struct flight_waiter *w = malloc(sizeof(struct flight_waiter));
+        if (!w) {
+            break;
+        }
+        w->args = *args;
+        w->next = f->waiters;
+        f->waiters = w;
+        pthread_mutex_unlock(&flight_lock);
+        metrics_count(CTR_COALESCED, 1);
+        return 1;
+    }
+    struct flight *f = calloc(1, sizeof(struct flight));
+    if (f) {
+        f->opcode = args->opcode;
+        memcpy(f->command, args->command, MAX_CMD_LEN);
+        f->fingerprint = fingerprint;
+        f->joinable = 1;
+        f->next = buckets[b];
+        buckets[b] = f;
+        r->flight = f;
+    }
+    pthread_mutex_unlock(&flight_lock);
+    return 0;
+}
+
+// Take f out of the table so no one else joins. Returns its waiters.
+static struct flight_waiter *close_flight(struct flight *f) {
+    pthread_mutex_lock(&flight_lock);
+    if (f->joinable) {
+        struct flight **p = &buckets[bucket_for(f->opcode, f->command)];
+        while (*p != f) {
+            p = &(*p)->next;
+        }
+        *p = f->next;
+        f->joinable = 0;
+    }
+    struct flight_waiter *waiters = f->waiters;
+    f->waiters = NULL;
+    pthread_mutex_unlock(&flight_lock);
+    return waiters;
+}
+
+static void mark_broken(struct flight *f) {
+    pthread_mutex_lock(&flight_lock);
+    f->broken = 1;
+    pthread_mutex_unlock(&flight_lock);
+    free(f->data);
+    f->data = NULL;
+}
+
+// Keep a copy of output the leader just sent
+void flight_capture(struct flight *f, const char *data, int len) {
+    if (f->broken) {
+        return;
+    }
+    if (f->opcode == OP_SHELL && f->len + len > FLIGHT_MAX_OUTPUT) {
+        // Registry commands print a bounded amount; a shell command may not
+        mark_broken(f);
+        return;
+    }
+    if (f->len + len > f->cap) {
+        int cap = f->cap ? f->cap : 4096;
+        while (cap < f->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(f->data, cap);
+        if (!grown) {
+            mark_broken(f);
+            return;
+        }
+        f->data = grown;
+        f->cap = cap;
+    }
+    memcpy(f->data + f->len, data, len);
+    f->len += len;
+}
+
+// Send one waiter its copy of the output
+static void send_copy(struct flight_waiter *w, const char *data, int len, int status, int nowait) {
+    struct reply r;
+    reply_init(&r, w->args.client_pid);
+    r.seq = w->args.seq;
+    r.command = w->args.command;
+    r.opcode = w->args.opcode;
+    r.started_ns = w->args.queued_ns;
+    r.status = status;
+    if (reply_write(&r, data, len, nowait) == -1) {
+        log_printf("Client %d is not reading replies, dropping shared output\n", r.client_pid);
+        reply_purge(&r);
+        r.len = 0;
+    }
+    if (reply_finish(&r, nowait) == -1) {
+        log_printf("Client %d is not reading replies, dropping END\n", r.client_pid);
+    }
+    reply_release(&r);
+    if (!opcode_is_control(w->args.opcode)) {
+        sched_done(w->args.client_pid);
+    }
+}
+
+// Put a waiter back to run by itself
+static void run_alone(struct flight_waiter *w) {
+    w->args.solo = 1;
+    if (opcode_is_control(w->args.opcode)) {
+        w->args.queued_ns = metrics_now();
+        pool_submit_control(&w->args);
+    } else if (sched_requeue(&w->args) == -1) {
+        struct reply r;
+        reply_init(&r, w->args.client_pid);
+        r.seq = w->args.seq;
+        reply_printf(&r, "Server busy: dropping command from client %d\n", r.client_pid);
+        r.status = 1;
+        reply_finish(&r, 0);
+        reply_release(&r);
+    }
+}
+
+// The leader's reply is complete: hand every waiter the same output and
+// status, then free f
+void flight_finish(struct flight *f, int status, int nowait) {
+    struct flight_waiter *w = close_flight(f);
+    while (w) {
+        struct flight_waiter *next = w->next;
+        if (f->broken) {
+            run_alone(w);
+        } else {
+            send_copy(w, f->data, f->len, status, nowait);
+        }
+        free(w);
+        w = next;
+    }
+    free(f->data);
+    free(f);
+}
+
+// The leader's output will not be complete; its waiters run on their own
+void flight_abandon(struct flight *f, int nowait) {
+    if (!f->broken) {
+        mark_broken(f);
+    }
+    flight_finish(f, 0, nowait);
+}
@@ -0,0 +1,32 @@
+/* Single-flight coalescing of identical commands.
+
+When a command arrives while an identical one (same opcode and text) is
+still executing, it does not run again: it waits for the running one and
+gets a copy of its output and exit status. Only command classes without
+side effects can be coalesced, and each is enabled separately:
+
+  list    LIST, joined only while the registry is unchanged since it started
+  status  the status command
+  stats   STATS
+  read    plain cat, ls, grep, head, tail and wc, joined only while every
+          file they name looks the same (inode, size, mtime, ctime)
+
+A waiting command keeps its place in the scheduler's in-flight count until
+its copy is sent.
+*/
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include "server.h"
+
+#define FLIGHT_DEFAULT_CLASSES "list,status,stats"
+#define FLIGHT_MAX_OUTPUT (1024 * 1024)   // Read commands with more output run on their own
+
+int flight_init(const char *classes);
+int flight_begin(const struct command_args *args, struct reply *r);
+void flight_capture(struct flight *f, const char *data, int len);
+void flight_finish(struct flight *f, int status, int nowait);
+void flight_abandon(struct flight *f, int nowait);
+
+#endif
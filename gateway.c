@@ -0,0 +1,608 @@
+/* Accept loop, connection table and buffered reply output.
+
+The epoll thread owns every connection's input and lifetime; workers only
+send. A worker finds a connection by client id in conn_table under
+table_lock and takes the connection's own lock before letting go of the
+table. Closing takes the connection out of the table first and then takes
+its lock once, so a send that already found it finishes before it is freed.
+*/
+
+#define _GNU_SOURCE  // accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "gateway.h"
+#include "metrics.h"
+
+#define MAX_EVENTS 256
+#define READ_BUFFER 65536         // Requests taken in by one read
+#define STALL_RETRY_MS 10         // How soon requests turned away are offered again, and
+                                  // hung-up connections checked for their last reply
+#define OUTPUT_START 4096         // First size of a connection's output buffer
+
+struct conn {
+    int fd;
+    int id;
+    int registered;          // Has sent a request, so on_closed is owed
+    int stalled;             // On stalled_list; not read until its requests are taken
+    int broken;              // A send failed; the read side will close it
+    int hungup;              // Sent EOF: on draining_list, not read, closed once answered
+    int owed;                // Replies (REPLY_END chunks) its requests still have coming
+    char *in;                // Input not yet taken, NULL when there is none
+    int in_len;
+    pthread_mutex_t lock;    // The output buffer and the socket's write side
+    char *out;               // Reply bytes the socket would not take yet
+    int out_len;
+    int out_cap;
+    struct conn *next_stalled;
+    struct conn *next_draining;
+};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn **conn_table = NULL;   // Open addressing by id; NULL slots are empty
+static int table_capacity = 0;            // Power of two
+static int table_used = 0;
+static int next_id = GATEWAY_ID_BASE;
+
+static int epfd = -1;
+static int listeners[2] = { -1, -1 };     // Unix-domain, TCP
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static gateway_request_fn on_request;
+static gateway_closed_fn on_closed;
+static struct conn *stalled_list = NULL;  // Epoll thread only, as are draining_list and read_buf
+static struct conn *draining_list = NULL;
+static char read_buf[READ_BUFFER];
+
+static unsigned int slot_for(int id) {
+    return ((unsigned int)id * 2654435761u) & (table_capacity - 1);
+}
+
+// Caller holds table_lock
+static struct conn *table_find(int id) {
+    if (table_capacity == 0) {
+        return NULL;
+    }
+    for (unsigned int i = slot_for(id); conn_table[i]; i = (i + 1) & (table_capacity - 1)) {
+        if (conn_table[i]->id == id) {
+            return conn_table[i];
+        }
+    }
+    return NULL;
+}
+
+static void table_place(struct conn *c) {
+    unsigned int i = slot_for(c->id);
+    while (conn_table[i]) {
+        i = (i + 1) & (table_capacity - 1);
+    }
+    conn_table[i] = c;
+}
+
+// Caller holds table_lock. The table is kept at most half full.
+static int table_insert(struct conn *c) {
+    if ((table_used + 1) * 2 > table_capacity) {
+        int old_capacity = table_capacity;
+        struct conn **old = conn_table;
+        int capacity = old_capacity ? old_capacity * 2 : 1024;
+        struct conn **grown = calloc(capacity, sizeof(struct conn *));
+        if (!grown) {
+            perror("calloc failed");
+            return -1;
+        }
+        conn_table = grown;
+        table_capacity = capacity;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i]) {
+                table_place(old[i]);
+            }
+        }
+        free(old);
+    }
+    table_place(c);
+    table_used++;
+    return 0;
+}
+
+// Caller holds table_lock. Entries after the hole move back into it where
+// their probe run allows, so lookups never need tombstones.
+static void table_remove(struct conn *c) {
+    unsigned int mask = table_capacity - 1;
+    unsigned int hole = slot_for(c->id);
+    while (conn_table[hole] != c) {
+        hole = (hole + 1) & mask;
+    }
+    conn_table[hole] = NULL;
+    table_used--;
+    for (unsigned int j = (hole + 1) & mask; conn_table[j]; j = (j + 1) & mask) {
+        unsigned int home = slot_for(conn_table[j]->id);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            conn_table[hole] = conn_table[j];
+            conn_table[j] = NULL;
+            hole = j;
+        }
+    }
+}
+
+static void close_conn(struct conn *c) {
+    pthread_mutex_lock(&table_lock);
+    table_remove(c);
+    pthread_mutex_unlock(&table_lock);
+    pthread_mutex_lock(&c->lock);  // Let a send that found it finish
+    pthread_mutex_unlock(&c->lock);
+
+    // Explicitly, since a child being spawned may briefly share the socket
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->stalled) {
+        struct conn **p = &stalled_list;
+        while (*p != c) {
+            p = &(*p)->next_stalled;
+        }
+        *p = c->next_stalled;
+    }
+    if (c->hungup) {
+        struct conn **p = &draining_list;
+        while (*p != c) {
+            p = &(*p)->next_draining;
+        }
+        *p = c->next_draining;
+    }
+    metrics_count(CTR_GATEWAY_CLOSED, 1);
+    if (c->registered) {
+        on_closed(c->id);
+    }
+    free(c->in);
+    free(c->out);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+// Offer each complete request in buf. Returns the bytes taken (stopping
+// early if one is turned away), or -1 if buf does not hold requests at all.
+static int take_requests(struct conn *c, const char *buf, int len) {
+    static struct wire_msg message;  // Epoll thread only
+    int taken = 0;
+    while (len - taken >= (int)sizeof(struct wire_header)) {
+        memcpy(&message.hdr, buf + taken, sizeof(message.hdr));
+        if (message.hdr.magic != WIRE_MAGIC || message.hdr.len > WIRE_MAX_PAYLOAD) {
+            return -1;
+        }
+        int size = WIRE_SIZE(message.hdr.len);
+        if (len - taken < size) {
+            break;
+        }
+        memcpy(message.payload, buf + taken + sizeof(message.hdr), message.hdr.len);
+        message.msg_type = 0;
+        int replies = 0;
+        if (!on_request(c->id, &message, size, &replies)) {
+            c->stalled = 1;
+            c->next_stalled = stalled_list;
+            stalled_list = c;
+            break;
+        }
+        pthread_mutex_lock(&c->lock);
+        c->owed += replies;  // May already have been sent, taking owed below zero meanwhile
+        pthread_mutex_unlock(&c->lock);
+        c->registered = 1;
+        taken += size;
+    }
+    return taken;
+}
+
+// Hold on to input that could not be taken yet. Returns -1 if out of memory.
+static int keep_input(struct conn *c, const char *data, int len) {
+    free(c->in);
+    c->in = NULL;
+    c->in_len = 0;
+    if (len == 0) {
+        return 0;
+    }
+    c->in = malloc(len);
+    if (!c->in) {
+        perror("malloc failed");
+        return -1;
+    }
+    memcpy(c->in, data, len);
+    c->in_len = len;
+    return 0;
+}
+
+// The client shut down its write side (or closed). Stop reading, but keep the
+// connection until what it asked for has been answered: input still held
+// back is offered as usual, a half-read request at the end is dropped.
+static void hang_up(struct conn *c) {
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLET, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->hungup = 1;
+    c->next_draining = draining_list;
+    draining_list = c;
+}
+
+// Read and offer requests until the socket has no more, a request is turned
+// away, or the client has hung up. A connection that is no use any more is
+// closed.
+static void read_conn(struct conn *c) {
+    while (!c->stalled && !c->hungup) {
+        int have = c->in_len;
+        memcpy(read_buf, c->in, have);
+        ssize_t n = recv(c->fd, read_buf + have, sizeof(read_buf) - have, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n == 0) {
+            hang_up(c);
+            return;
+        }
+        if (n == -1) {
+            close_conn(c);  // Reset
+            return;
+        }
+        int taken = take_requests(c, read_buf, have + n);
+        if (taken == -1) {
+            log_printf("Gateway: client %d sent something that is not a request, closing it\n", c->id);
+            close_conn(c);
+            return;
+        }
+        if (keep_input(c, read_buf + taken, have + n - taken) == -1) {
+            close_conn(c);
+            return;
+        }
+    }
+}
+
+// Offer the turned-away requests again, and read on from connections whose
+// requests have all been taken
+static void offer_stalled(void) {
+    struct conn *list = stalled_list;
+    stalled_list = NULL;
+    while (list) {
+        struct conn *c = list;
+        list = c->next_stalled;
+        c->stalled = 0;
+        c->next_stalled = NULL;
+        int len = c->in_len;
+        memcpy(read_buf, c->in, len);
+        int taken = take_requests(c, read_buf, len);
+        if (taken == -1 || keep_input(c, read_buf + taken, len - taken) == -1) {
+            close_conn(c);
+            continue;
+        }
+        read_conn(c);  // Returns at once if it stalled again or has hung up
+    }
+}
+
+// Close hung-up connections once every request has been answered and the
+// output has gone, or as soon as a send fails
+static void close_drained(void) {
+    struct conn *c = draining_list;
+    while (c) {
+        struct conn *next = c->next_draining;
+        pthread_mutex_lock(&c->lock);
+        int done = c->broken || (!c->stalled && c->owed <= 0 && c->out_len == 0);
+        pthread_mutex_unlock(&c->lock);
+        if (done) {
+            close_conn(c);
+        }
+        c = next;
+    }
+}
+
+// Send buffered output. Caller holds c->lock. An idle connection keeps no buffer.
+static void flush_output(struct conn *c) {
+    int sent = 0;
+    while (sent < c->out_len && !c->broken) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == -1) {
+            c->broken = 1;
+            break;
+        }
+        sent += n;
+    }
+    if (c->broken || sent == c->out_len) {
+        free(c->out);
+        c->out = NULL;
+        c->out_len = c->out_cap = 0;
+        return;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+}
+
+// Send one reply chunk. Whatever the socket does not take at once is
+// buffered and sent by the epoll thread. Returns -1 with errno EAGAIN if
+// GATEWAY_MAX_OUTPUT bytes are waiting already, or EPIPE if the connection is gone.
+int gateway_send(int client_id, const void *data, int len) {
+    pthread_mutex_lock(&table_lock);
+    struct conn *c = table_find(client_id);
+    if (!c) {
+        pthread_mutex_unlock(&table_lock);
+        errno = EPIPE;
+        return -1;
+    }
+    pthread_mutex_lock(&c->lock);
+    pthread_mutex_unlock(&table_lock);
+
+    if (c->broken) {
+        pthread_mutex_unlock(&c->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    if (c->out_len > 0 && c->out_len + len > GATEWAY_MAX_OUTPUT) {
+        pthread_mutex_unlock(&c->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    int flags;
+    memcpy(&flags, data, sizeof(flags));  // A reply_buffer from flags on
+    if (flags & REPLY_END) {
+        c->owed--;
+    }
+    int sent = 0;
+    while (c->out_len == 0 && sent < len) {
+        ssize_t n = send(c->fd, (const char *)data + sent, len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == -1) {
+            c->broken = 1;
+            pthread_mutex_unlock(&c->lock);
+            errno = EPIPE;
+            return -1;
+        }
+        sent += n;
+    }
+
+    // Once part of a chunk is out, the rest has to follow whatever the limit
+    if (sent < len) {
+        int need = c->out_len + len - sent;
+        if (need > c->out_cap) {
+            int cap = c->out_cap ? c->out_cap : OUTPUT_START;
+            while (cap < need) {
+                cap *= 2;
+            }
+            char *grown = realloc(c->out, cap);
+            if (!grown) {
+                perror("realloc failed");
+                c->broken = 1;
+                pthread_mutex_unlock(&c->lock);
+                errno = EPIPE;
+                return -1;
+            }
+            c->out = grown;
+            c->out_cap = cap;
+        }
+        memcpy(c->out + c->out_len, (const char *)data + sent, len - sent);
+        c->out_len += len - sent;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+// Whether a connection with this client id is open
+int gateway_connected(int client_id) {
+    pthread_mutex_lock(&table_lock);
+    int open = table_find(client_id) != NULL;
+    pthread_mutex_unlock(&table_lock);
+    return open;
+}
+
+// The next free client id, wrapping round long after the first ones are gone.
+// Caller holds table_lock.
+static int take_id(void) {
+    int id;
+    do {
+        id = next_id;
+        next_id = next_id == INT_MAX ? GATEWAY_ID_BASE : next_id + 1;
+    } while (table_find(id));
+    return id;
+}
+
+static void accept_all(int listener) {
+    while (1) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept failed");  // Out of descriptors: the rest wait for the next one
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  // Fails harmlessly on Unix sockets
+
+        struct conn *c = calloc(1, sizeof(struct conn));
+        if (!c) {
+            perror("calloc failed");
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_mutex_lock(&table_lock);
+        c->id = take_id();
+        int result = table_insert(c);
+        pthread_mutex_unlock(&table_lock);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (result == 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl failed");
+            pthread_mutex_lock(&table_lock);
+            table_remove(c);
+            pthread_mutex_unlock(&table_lock);
+            result = -1;
+        }
+        if (result == -1) {
+            close(fd);
+            pthread_mutex_destroy(&c->lock);
+            free(c);
+            continue;
+        }
+        metrics_count(CTR_GATEWAY_ACCEPTED, 1);
+    }
+}
+
+static void *gateway_main(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, stalled_list || draining_list ? STALL_RETRY_MS : -1);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait failed");
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listeners[0] || ptr == &listeners[1]) {
+                accept_all(*(int *)ptr);
+                continue;
+            }
+            struct conn *c = ptr;
+            uint32_t ev = events[i].events;
+            if (ev & EPOLLERR) {
+                close_conn(c);
+                continue;
+            }
+            if (ev & EPOLLOUT) {
+                pthread_mutex_lock(&c->lock);
+                flush_output(c);
+                pthread_mutex_unlock(&c->lock);
+            }
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                read_conn(c);  // Takes what was sent before a hangup
+            }
+        }
+        if (stalled_list) {
+            offer_stalled();
+        }
+        if (draining_list) {
+            close_drained();
+        }
+    }
+    return NULL;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket failed");
+        return -1;
+    }
+    unlink(path);  // Left behind by a server that did not shut down cleanly
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    strcpy(socket_path, path);
+    return fd;
+}
+
+// Loopback only: the gateway has no authentication
+static int listen_tcp(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket failed");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror("Could not listen on the TCP port");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Start accepting on unix_path and/or 127.0.0.1:tcp_port. With neither the
+// gateway is off.
+int gateway_init(const char *unix_path, int tcp_port, gateway_request_fn request, gateway_closed_fn closed) {
+    if (!unix_path && tcp_port == 0) {
+        return 0;
+    }
+    on_request = request;
+    on_closed = closed;
+
+    // Tens of thousands of connections need more than the usual soft limit
+    struct rlimit rl = { 0, 0 };
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+    if ((unix_path && (listeners[0] = listen_unix(unix_path)) == -1) ||
+        (tcp_port && (listeners[1] = listen_tcp(tcp_port)) == -1)) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = &listeners[i] };
+        if (listeners[i] != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[i], &ev) == -1) {
+            perror("epoll_ctl failed");
+            return -1;
+        }
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, gateway_main, NULL) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    if (unix_path) {
+        printf("Gateway listening on unix:%s\n", unix_path);
+    }
+    if (tcp_port) {
+        printf("Gateway listening on tcp:127.0.0.1:%d\n", tcp_port);
+    }
+    printf("Gateway: up to %ld connections\n", (long)rl.rlim_cur);
+    return 0;
+}
+
+// Remove the socket file on the way out
+void gateway_close(void) {
+    if (socket_path[0]) {
+        unlink(socket_path);
+    }
+}
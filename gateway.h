@@ -0,0 +1,44 @@
+/* Socket gateway: clients on Unix-domain and loopback TCP connections.
+
+SysV queues cannot sit in an epoll set and only reach processes that share
+MSG_QUEUE_KEY, so the gateway accepts stream connections as well, on a
+Unix-domain socket and/or a TCP port bound to 127.0.0.1. One thread runs an
+edge-triggered epoll loop over the listeners and every connection.
+
+A connection speaks the same framing as the other transports, minus the
+msg_type: a request is a struct wire_header followed by hdr.len bytes of
+payload (OP_BATCH included), and each reply chunk is a reply_buffer from
+flags on, REPLY_SIZE(len) bytes. The client_pid a connection sends is
+ignored: each connection is given a client id of its own, GATEWAY_ID_BASE
+and up, which the registry, scheduler and leases use like a PID. The client
+is registered with its first request, and closing the connection is its
+EXIT-less goodbye: its queued commands are dropped and it is reclaimed once
+its running ones finish. A client that only shuts down its write side is
+still answered: the connection is closed once every request it sent has had
+its REPLY_END chunk and the output has been flushed, or when a send fails.
+
+An idle connection costs a small record and its socket; input is buffered
+only while a request is half read, and output only while the socket is full.
+*/
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include "protocol.h"
+
+#define GATEWAY_ID_BASE (1 << 30)      // Connection client ids; above any PID
+#define GATEWAY_MAX_OUTPUT (1 << 20)   // Unsent reply bytes per connection before senders wait
+
+// Offered each complete request. Returns 1 once it is dealt with, setting
+// *replies to how many REPLY_END chunks it will be answered with, or 0 to
+// have it offered again later; the connection is not read meanwhile.
+typedef int (*gateway_request_fn)(int client_id, struct wire_msg *message, int size, int *replies);
+// Called when a connection that sent a request is closed
+typedef void (*gateway_closed_fn)(int client_id);
+
+int gateway_init(const char *unix_path, int tcp_port, gateway_request_fn request, gateway_closed_fn closed);
+int gateway_send(int client_id, const void *data, int len);
+int gateway_connected(int client_id);
+void gateway_close(void);
+
+#endif
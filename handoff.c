@@ -0,0 +1,213 @@
+/* Writing and reading the restart state file. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "handoff.h"
+#include "sched.h"
+#include "lease.h"
+#include "shmring.h"
+#include "metrics.h"
+#include "gateway.h"
+
+#define RECORD_SIZES ((uint32_t)sizeof(struct handoff_client) << 16 | (uint32_t)sizeof(struct handoff_command))
+
+static struct handoff_client *clients_of(const struct handoff_header *h) {
+    return (struct handoff_client *)(h + 1);
+}
+
+static struct handoff_command *commands_of(const struct handoff_header *h) {
+    return (struct handoff_command *)(clients_of(h) + h->client_count);
+}
+
+static int has_pid(const struct client_record *records, int count, int pid) {
+    for (int i = 0; i < count; i++) {
+        if (records[i].pid == pid) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Write the registry and the commands taken out of the scheduler to path.
+// Gateway clients are left out: their connections close with this process.
+// Returns -1 if the file could not be written.
+int handoff_save(const char *path, const int *qids, int shard_count,
+                 const struct command_args *pending, int pending_count, int64_t paused_ns) {
+    struct client_record *records;
+    int exported = registry_export(&records);
+    if (exported == -1) {
+        return -1;
+    }
+    int client_count = 0;
+    for (int i = 0; i < exported; i++) {
+        if (records[i].pid < GATEWAY_ID_BASE) {
+            records[client_count++] = records[i];
+        }
+    }
+    int registered = client_count;
+
+    // Clients that sent EXIT but still have commands waiting keep their ring
+    struct client_record *grown = realloc(records, (client_count + pending_count + 1) * sizeof(*records));
+    if (!grown) {
+        perror("realloc failed");
+        free(records);
+        return -1;
+    }
+    records = grown;
+    int command_count = 0;
+    for (int i = 0; i < pending_count; i++) {
+        int pid = pending[i].client_pid;
+        if (pid >= GATEWAY_ID_BASE) {
+            continue;
+        }
+        command_count++;
+        struct shm_ring *ring;
+        if (has_pid(records, client_count, pid) || (ring = sched_hold_ring(pid)) == NULL) {
+            continue;
+        }
+        ring_detach(ring);
+        memset(&records[client_count], 0, sizeof(*records));
+        records[client_count].pid = pid;
+        records[client_count].ring = ring;  // Only tested against NULL below
+        client_count++;
+    }
+    size_t size = sizeof(struct handoff_header) + client_count * sizeof(struct handoff_client) +
+                  command_count * sizeof(struct handoff_command);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        perror("Could not create the state file");
+        if (fd != -1) {
+            close(fd);
+        }
+        free(records);
+        return -1;
+    }
+    struct handoff_header *h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        perror("Could not map the state file");
+        free(records);
+        return -1;
+    }
+
+    memcpy(h->magic, HANDOFF_MAGIC, sizeof(h->magic));
+    h->size = size;
+    h->record_sizes = RECORD_SIZES;
+    h->shard_count = shard_count;
+    memcpy(h->shard_qids, qids, shard_count * sizeof(int));
+    h->client_count = client_count;
+    h->pending_count = command_count;
+    h->paused_ns = paused_ns;
+    struct handoff_client *c = clients_of(h);
+    for (int i = 0; i < client_count; i++) {
+        c[i].pid = records[i].pid;
+        c[i].hidden = records[i].hidden;
+        c[i].has_ring = records[i].ring != NULL;
+        c[i].leaving = i >= registered;
+        memcpy(c[i].prompt, records[i].prompt, PROMPT_LEN);
+    }
+    struct handoff_command *cmd = commands_of(h);
+    for (int i = 0; i < pending_count; i++) {
+        if (pending[i].client_pid >= GATEWAY_ID_BASE) {
+            continue;
+        }
+        cmd->client_pid = pending[i].client_pid;
+        cmd->opcode = pending[i].opcode;
+        cmd->seq = pending[i].seq;
+        cmd->solo = pending[i].solo;
+        memcpy(cmd->command, pending[i].command, MAX_CMD_LEN);
+        cmd++;
+    }
+    h->saved_ns = metrics_now();
+    free(records);
+
+    // No msync: the next server reads it back through the same page cache
+    munmap(h, size);
+    return 0;
+}
+
+// Map the state file left by the previous server and remove it, so a server
+// that fails to start cannot pick up stale state later. Returns NULL if there
+// is no valid state.
+const struct handoff_header *handoff_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Could not open the state file");
+        return NULL;
+    }
+    unlink(path);
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct handoff_header)) {
+        fprintf(stderr, "State file %s is truncated\n", path);
+        close(fd);
+        return NULL;
+    }
+    struct handoff_header *h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        perror("Could not map the state file");
+        return NULL;
+    }
+    if (memcmp(h->magic, HANDOFF_MAGIC, sizeof(h->magic)) != 0 || h->size != st.st_size ||
+        h->record_sizes != RECORD_SIZES || h->shard_count < 1 || h->shard_count > MAX_SHARDS ||
+        h->client_count < 0 || h->pending_count < 0 ||
+        sizeof(struct handoff_header) + h->client_count * sizeof(struct handoff_client) +
+            h->pending_count * sizeof(struct handoff_command) != h->size) {
+        fprintf(stderr, "State file %s is not from this server\n", path);
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    return h;
+}
+
+// Register the clients again and queue their waiting commands. Call once the
+// registry, scheduler, pool and leases are up, before any receiver starts.
+// Unmaps state. Returns the number of commands queued.
+int handoff_restore(const struct handoff_header *state) {
+    const struct handoff_client *c = clients_of(state);
+    for (int i = 0; i < state->client_count; i++) {
+        if (c[i].leaving || registry_add(c[i].pid) == REG_FULL) {
+            continue;
+        }
+        registry_set_hidden(c[i].pid, c[i].hidden);
+        registry_set_prompt(c[i].pid, c[i].prompt);
+        if (c[i].has_ring) {
+            struct shm_ring *ring = ring_attach(REPLY_RING_KEY(c[i].pid), REPLY_RING_SLOT_SIZE);
+            if (ring) {
+                registry_set_ring(c[i].pid, ring);
+            }
+        }
+        lease_renew(c[i].pid);
+    }
+
+    int queued = 0;
+    const struct handoff_command *cmd = commands_of(state);
+    for (int i = 0; i < state->pending_count; i++) {
+        struct command_args args;
+        memset(&args, 0, sizeof(args));
+        args.client_pid = cmd[i].client_pid;
+        args.opcode = cmd[i].opcode;
+        args.seq = cmd[i].seq;
+        args.solo = cmd[i].solo;
+        args.step = -1;
+        memcpy(args.command, cmd[i].command, MAX_CMD_LEN);
+        args.command[MAX_CMD_LEN - 1] = '\0';
+        if (sched_push(&args) == 0) {
+            queued++;
+        }
+    }
+    for (int i = 0; i < state->client_count; i++) {
+        if (c[i].leaving) {
+            sched_forget(c[i].pid, ring_attach(REPLY_RING_KEY(c[i].pid), REPLY_RING_SLOT_SIZE));
+        }
+    }
+    munmap((void *)state, state->size);
+    return queued;
+}
@@ -0,0 +1,67 @@
+/* Restarting the server without dropping its clients.
+
+On SIGUSR2 the server hands over to a fresh copy of its binary, whatever is
+now at the path it was started from, so a deploy only has to replace the
+file and send the signal. The receivers stop taking requests; the queues and
+the request ring stay as they are and keep whatever clients send meanwhile.
+Commands still waiting in the scheduler are taken out, commands already
+running are allowed to finish, and the registry (PIDs, hidden flags, prompts,
+which clients have a reply ring) and the waiting commands are written to a
+memory-mapped state file. A client that sent EXIT with commands still waiting
+is saved as leaving: it is not registered again, but its reply ring is. The server then execs the new binary with
+HANDOFF_ENV naming that file.
+
+The new server takes over the same message queues and request ring instead
+of creating them, restores the registry and queues the waiting commands
+again before its receivers start. Clients see a pause, not a reconnect.
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#include "server.h"
+#include "registry.h"
+
+#define HANDOFF_ENV "SERVER_HANDOFF"          // State file for the exec'd server
+#define HANDOFF_DEFAULT_PATH "server.state"
+#define HANDOFF_MAGIC "A2HANDF1"
+
+// The state file: this header, client_count clients, then pending_count
+// commands. Only the same build of the server reads it back, but the sizes
+// are checked anyway.
+struct handoff_header {
+    char magic[8];
+    uint32_t size;            // Whole file
+    uint32_t record_sizes;    // sizeof client << 16 | sizeof command
+    int32_t shard_count;
+    int32_t shard_qids[MAX_SHARDS];
+    int32_t client_count;
+    int32_t pending_count;
+    int64_t paused_ns;        // CLOCK_MONOTONIC when the receivers stopped
+    int64_t saved_ns;         // and when the file was written
+};
+
+struct handoff_client {
+    int32_t pid;
+    int32_t hidden;
+    int32_t has_ring;         // Attach REPLY_RING_KEY(pid) again
+    int32_t leaving;          // Sent EXIT; only its waiting commands need the ring
+    char prompt[PROMPT_LEN];
+};
+
+struct handoff_command {
+    int32_t client_pid;
+    int32_t opcode;
+    uint32_t seq;
+    int32_t solo;
+    char command[MAX_CMD_LEN];
+};
+
+int handoff_save(const char *path, const int *qids, int shard_count,
+                 const struct command_args *pending, int pending_count, int64_t paused_ns);
+const struct handoff_header *handoff_load(const char *path);
+int handoff_restore(const struct handoff_header *state);
+
+#endif
@@ -0,0 +1,285 @@
+/* Per-command rlimits and per-client cgroups.
+
+A limit spec is a comma-separated list of name=value pairs; 0 (or leaving a
+name out) means no limit. Per command: cpu (seconds of CPU time), mem (MB of
+data segment, i.e. heap and private mappings) and files (open descriptors).
+Per client, with a cgroup: cpu (percent of one core), mem (MB) and procs.
+
+Client cgroups are named client-<pid> and created on the client's first
+command. Their cgroup.procs file stays open so starting a command costs one
+write; the cgroup is removed when the client leaves, or left for the
+administrator if processes are still in it.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "isolate.h"
+#include "metrics.h"
+
+#define CLIENT_BUCKETS 256   // Power of two
+
+struct limit_spec {
+    long cpu;
+    long mem;
+    long files;
+    long procs;
+};
+
+struct client_cgroup {
+    int pid;
+    int procs_fd;    // Open cgroup.procs, or -1 if the cgroup could not be made
+    struct client_cgroup *next;
+};
+
+static struct limit_spec command_limits;
+static struct limit_spec client_limits;
+static const char *cgroup_root = NULL;
+static pthread_mutex_t cgroup_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client_cgroup *cgroups[CLIENT_BUCKETS];
+
+static unsigned int bucket_for(int pid) {
+    unsigned int h = (unsigned int)pid * 2654435761u;
+    return (h ^ (h >> 16)) & (CLIENT_BUCKETS - 1);
+}
+
+// Parse spec into out, allowing only the names in allowed. Returns -1 on error.
+static int parse_spec(const char *spec, const char *allowed, struct limit_spec *out) {
+    char copy[128];
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    memset(out, 0, sizeof(*out));
+
+    for (char *save, *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        char *end;
+        if (!eq) {
+            return -1;
+        }
+        *eq = '\0';
+        long value = strtol(eq + 1, &end, 10);
+        if (*end != '\0' || value < 0 || !strstr(allowed, item)) {
+            return -1;
+        }
+        if (strcmp(item, "cpu") == 0) {
+            out->cpu = value;
+        } else if (strcmp(item, "mem") == 0) {
+            out->mem = value;
+        } else if (strcmp(item, "files") == 0) {
+            out->files = value;
+        } else if (strcmp(item, "procs") == 0) {
+            out->procs = value;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write value to one of a cgroup's control files
+static int write_control(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = write(fd, value, strlen(value)) == -1 ? -1 : 0;
+    close(fd);
+    return result;
+}
+
+// Make the cgroup for a new client. Returns its cgroup.procs fd, or -1.
+static int make_cgroup(int client_pid) {
+    char dir[PATH_MAX];
+    char value[64];
+    snprintf(dir, sizeof(dir), "%s/client-%d", cgroup_root, client_pid);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        log_printf("Could not create cgroup %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if (client_limits.cpu > 0) {
+        snprintf(value, sizeof(value), "%ld 100000", client_limits.cpu * 1000);
+        if (write_control(dir, "cpu.max", value) == -1) {
+            log_printf("Could not limit CPU of %s: %s\n", dir, strerror(errno));
+        }
+    }
+    if (client_limits.mem > 0) {
+        snprintf(value, sizeof(value), "%ld", client_limits.mem << 20);
+        if (write_control(dir, "memory.max", value) == -1) {
+            log_printf("Could not limit memory of %s: %s\n", dir, strerror(errno));
+        }
+    }
+    if (client_limits.procs > 0) {
+        snprintf(value, sizeof(value), "%ld", client_limits.procs);
+        if (write_control(dir, "pids.max", value) == -1) {
+            log_printf("Could not limit processes of %s: %s\n", dir, strerror(errno));
+        }
+    }
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        log_printf("Could not open %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+// command_spec and client_spec are limit specs ("" for none); cgroup_dir is
+// a cgroup v2 directory we may create children in, or NULL
+int isolate_init(const char *command_spec, const char *client_spec, const char *cgroup_dir) {
+    if (parse_spec(command_spec, "cpu,mem,files", &command_limits) == -1) {
+        fprintf(stderr, "Bad command limits '%s' (cpu=seconds,mem=MB,files=N)\n", command_spec);
+        return -1;
+    }
+    if (parse_spec(client_spec, "cpu,mem,procs", &client_limits) == -1) {
+        fprintf(stderr, "Bad client limits '%s' (cpu=percent,mem=MB,procs=N)\n", client_spec);
+        return -1;
+    }
+    if (client_spec[0] != '\0' && !cgroup_dir) {
+        fprintf(stderr, "Client limits need a cgroup v2 directory (-G)\n");
+        return -1;
+    }
+    if (cgroup_dir) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup_dir);
+        if (access(path, W_OK) == -1) {
+            perror(path);
+            return -1;
+        }
+        // Let the client cgroups use each controller; any that is missing is reported per client
+        const char *controllers[] = { "+cpu", "+memory", "+pids" };
+        for (int i = 0; i < 3; i++) {
+            if (write_control(cgroup_dir, "cgroup.subtree_control", controllers[i]) == -1) {
+                fprintf(stderr, "Cannot enable %s controller in %s: %s\n", controllers[i] + 1,
+                        cgroup_dir, strerror(errno));
+            }
+        }
+        cgroup_root = cgroup_dir;
+    }
+    printf("Command limits: cpu %lds, mem %ldMB, files %ld; client cgroups: %s\n",
+           command_limits.cpu, command_limits.mem, command_limits.files,
+           cgroup_root ? cgroup_root : "off");
+    return 0;
+}
+
+static void add_limit(struct isolate_plan *plan, int resource, rlim_t soft, rlim_t hard) {
+    plan->resources[plan->count] = resource;
+    plan->limits[plan->count].rlim_cur = soft;
+    plan->limits[plan->count].rlim_max = hard;
+    plan->count++;
+}
+
+// Work out the limits of a command about to be spawned for client_pid,
+// making the client's cgroup on its first command
+void isolate_plan(int client_pid, struct isolate_plan *plan) {
+    plan->count = 0;
+    plan->procs_fd = -1;
+    plan->failed = NULL;
+    plan->error = 0;
+    if (command_limits.cpu > 0) {
+        // SIGXCPU at the soft limit, SIGKILL a second later
+        add_limit(plan, RLIMIT_CPU, command_limits.cpu, command_limits.cpu + 1);
+    }
+    if (command_limits.mem > 0) {
+        rlim_t bytes = (rlim_t)command_limits.mem << 20;
+        add_limit(plan, RLIMIT_DATA, bytes, bytes);
+    }
+    if (command_limits.files > 0) {
+        add_limit(plan, RLIMIT_NOFILE, command_limits.files, command_limits.files);
+    }
+    if (!cgroup_root) {
+        return;
+    }
+
+    unsigned int b = bucket_for(client_pid);
+    pthread_mutex_lock(&cgroup_lock);
+    struct client_cgroup *cg = cgroups[b];
+    while (cg && cg->pid != client_pid) {
+        cg = cg->next;
+    }
+    if (!cg && (cg = malloc(sizeof(struct client_cgroup))) != NULL) {
+        cg->pid = client_pid;
+        cg->procs_fd = make_cgroup(client_pid);
+        cg->next = cgroups[b];
+        cgroups[b] = cg;
+    }
+    if (cg && cg->procs_fd != -1) {
+        // A copy of our own: isolate_forget() may close the cgroup's meanwhile
+        plan->procs_fd = fcntl(cg->procs_fd, F_DUPFD_CLOEXEC, 0);
+        if (plan->procs_fd == -1) {
+            log_printf("Could not put a command into client-%d: %s\n", client_pid, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&cgroup_lock);
+}
+
+// Called by the child between clone and exec, so the command cannot run (or
+// fork) a single instruction outside its limits. It shares the server's
+// memory and must only make system calls; what fails is noted in the plan.
+void isolate_enter(void *arg) {
+    struct isolate_plan *plan = arg;
+    for (int i = 0; i < plan->count; i++) {
+        if (setrlimit(plan->resources[i], &plan->limits[i]) == -1 && !plan->failed) {
+            plan->failed = "set a resource limit";
+            plan->error = errno;
+        }
+    }
+    // Writing 0 moves the writer itself
+    if (plan->procs_fd != -1 && write(plan->procs_fd, "0", 1) == -1 && !plan->failed) {
+        plan->failed = "join its client cgroup";
+        plan->error = errno;
+    }
+}
+
+// The command has been spawned (or failed to be): report what its child
+// could not do and let go of the plan
+void isolate_finish(pid_t pid, int client_pid, struct isolate_plan *plan) {
+    if (pid > 0 && plan->failed) {
+        log_printf("Process %d of client %d could not %s: %s\n", pid, client_pid, plan->failed,
+                   strerror(plan->error));
+    }
+    if (plan->procs_fd != -1) {
+        close(plan->procs_fd);
+        plan->procs_fd = -1;
+    }
+}
+
+// The client has left: remove its cgroup if nothing is still running in it
+void isolate_forget(int client_pid) {
+    if (!cgroup_root) {
+        return;
+    }
+    pthread_mutex_lock(&cgroup_lock);
+    struct client_cgroup **p = &cgroups[bucket_for(client_pid)];
+    while (*p && (*p)->pid != client_pid) {
+        p = &(*p)->next;
+    }
+    struct client_cgroup *cg = *p;
+    if (cg) {
+        *p = cg->next;
+    }
+    pthread_mutex_unlock(&cgroup_lock);
+    if (!cg) {
+        return;
+    }
+
+    if (cg->procs_fd != -1) {
+        close(cg->procs_fd);
+    }
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/client-%d", cgroup_root, client_pid);
+    if (rmdir(dir) == -1 && errno != ENOENT) {
+        log_printf("Could not remove cgroup %s: %s\n", dir, strerror(errno));
+    }
+    free(cg);
+}
@@ -0,0 +1,36 @@
+/* Resource limits for shell commands.
+
+Each command gets its own CPU-time, memory and open-file limits (setrlimit
+values). When the server is given a cgroup v2 directory it may manage, every
+client also gets a child cgroup there with CPU, memory and process limits
+across all of its commands. isolate_plan() works out what a command gets
+before it is spawned; the child puts itself under it with isolate_enter()
+after clone and before exec, so nothing the command runs or forks ever
+escapes the limits or the cgroup's pids.max.
+*/
+
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#define ISOLATE_DEFAULT_LIMITS "cpu=3,mem=512,files=256"
+
+// What one command is put under
+struct isolate_plan {
+    int count;
+    int resources[3];
+    struct rlimit limits[3];
+    int procs_fd;            // The client cgroup's cgroup.procs (a copy), or -1
+    const char *failed;      // Set by the child: what it could not do
+    int error;
+};
+
+int isolate_init(const char *command_spec, const char *client_spec, const char *cgroup_dir);
+void isolate_plan(int client_pid, struct isolate_plan *plan);
+void isolate_enter(void *plan);
+void isolate_finish(pid_t pid, int client_pid, struct isolate_plan *plan);
+void isolate_forget(int client_pid);
+
+#endif
@@ -0,0 +1,426 @@
+/* Job parsing, step scheduling and the consolidated report.
+
+A job is freed by job_report() once every step has finished. Whichever
+thread finishes the last step (a worker for a built-in, the supervisor for
+a spawned command) hands the job back to the control lane as an OP_JOB
+request, so the report is never sent from the supervisor thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "job.h"
+#include "sched.h"
+#include "pool.h"
+#include "registry.h"
+#include "shmring.h"
+#include "metrics.h"
+
+#define SEPARATOR ";;"
+
+enum step_state {
+    STEP_WAITING,   // For its dependencies, or for a parallel slot
+    STEP_QUEUED,    // Queued or running
+    STEP_DONE,
+    STEP_FAILED,
+    STEP_SKIPPED    // A dependency failed
+};
+
+struct step {
+    char name[JOB_NAME_LEN];
+    char command[MAX_CMD_LEN];
+    int deps[JOB_MAX_STEPS];
+    int dep_count;
+    int state;
+    int status;
+    int64_t ready_ns;     // Queued with the scheduler
+    int64_t started_ns;   // Picked up by a worker
+    int64_t done_ns;
+    struct reply_usage usage;
+    int has_usage;        // Spawned, so usage is valid
+    char *output;
+    int len;
+    int cut;              // Output went past JOB_STEP_OUTPUT
+};
+
+struct job {
+    pthread_mutex_t lock;
+    int client_pid;
+    unsigned int seq;
+    int64_t started_ns;
+    char spec[MAX_CMD_LEN];   // As much of the JOB as fits, for the journal
+    int running;          // Steps queued or running
+    int left;             // Steps not finished or skipped yet
+    int cancelled;        // A step was dropped unrun; start no more
+    struct shm_ring *ring;    // Held for the report, in case the client sends EXIT first
+    int count;
+    struct step steps[];
+};
+
+static int parallel_limit = JOB_DEFAULT_PARALLEL;
+static int jobs_running = 0;   // Started and not yet reported
+
+void job_init(int parallel) {
+    parallel_limit = parallel;
+}
+
+static char *trim(char *s) {
+    while (*s == ' ') {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && end[-1] == ' ') {
+        *--end = '\0';
+    }
+    return s;
+}
+
+static int find_step(struct job *job, int before, const char *name) {
+    for (int i = 0; i < before; i++) {
+        if (strcmp(job->steps[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int valid_name(const char *name) {
+    if (*name == '\0' || strlen(name) >= JOB_NAME_LEN) {
+        return 0;
+    }
+    for (; *name; name++) {
+        if (!isalnum((unsigned char)*name) && *name != '_' && *name != '-') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Parse one "name<dep,dep: command" part into step i. Returns -1 on error.
+static int parse_step(struct job *job, int i, char *part, char *error, int error_size) {
+    struct step *s = &job->steps[i];
+    char *colon = strchr(part, ':');
+    if (!colon) {
+        snprintf(error, error_size, "step %d has no ':' before its command", i + 1);
+        return -1;
+    }
+    *colon = '\0';
+    char *deps = strchr(part, '<');
+    if (deps) {
+        *deps++ = '\0';
+    }
+
+    char *name = trim(part);
+    if (!valid_name(name)) {
+        snprintf(error, error_size, "step %d: '%s' is not a valid step name", i + 1, name);
+        return -1;
+    }
+    if (find_step(job, i, name) != -1) {
+        snprintf(error, error_size, "step name '%s' is used twice", name);
+        return -1;
+    }
+    strcpy(s->name, name);
+
+    // Receivers parse concurrently, so strtok's hidden state is off limits.
+    char *save;
+    for (char *dep = deps ? strtok_r(deps, ",", &save) : NULL; dep; dep = strtok_r(NULL, ",", &save)) {
+        int d = find_step(job, i, trim(dep));
+        if (d == -1) {
+            snprintf(error, error_size, "step '%s' depends on '%s', which is not a step before it",
+                     s->name, trim(dep));
+            return -1;
+        }
+        int listed = 0;
+        for (int k = 0; k < s->dep_count; k++) {
+            listed |= s->deps[k] == d;
+        }
+        if (!listed) {
+            s->deps[s->dep_count++] = d;  // at most i distinct deps, so this fits
+        }
+    }
+
+    char *command = trim(colon + 1);
+    if (*command == '\0' || strlen(command) >= MAX_CMD_LEN) {
+        snprintf(error, error_size, "step '%s' has %s command", s->name, *command ? "too long a" : "no");
+        return -1;
+    }
+    strcpy(s->command, command);
+    return 0;
+}
+
+// Parse a job spec of len bytes. Returns NULL with a message in error if it
+// is malformed.
+struct job *job_parse(const char *spec, int len, char *error, int error_size) {
+    char text[WIRE_MAX_PAYLOAD + 1];
+    if (len > WIRE_MAX_PAYLOAD) {
+        len = WIRE_MAX_PAYLOAD;
+    }
+    memcpy(text, spec, len);
+    text[len] = '\0';
+
+    int count = 1;
+    for (char *p = strstr(text, SEPARATOR); p; p = strstr(p + strlen(SEPARATOR), SEPARATOR)) {
+        count++;
+    }
+    if (count > JOB_MAX_STEPS) {
+        snprintf(error, error_size, "more than %d steps", JOB_MAX_STEPS);
+        return NULL;
+    }
+    if (*trim(text) == '\0') {
+        snprintf(error, error_size, "no steps");
+        return NULL;
+    }
+
+    struct job *job = calloc(1, sizeof(struct job) + count * sizeof(struct step));
+    if (!job) {
+        snprintf(error, error_size, "out of memory");
+        return NULL;
+    }
+    job->count = count;
+    char *part = text;
+    for (int i = 0; i < count; i++) {
+        char *next = strstr(part, SEPARATOR);
+        if (next) {
+            *next = '\0';
+            next += strlen(SEPARATOR);
+        }
+        if (parse_step(job, i, part, error, error_size) == -1) {
+            free(job);
+            return NULL;
+        }
+        part = next;
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    job->left = count;
+    return job;
+}
+
+// Skip steps whose dependencies failed and pick the ones that can start now,
+// up to the parallel limit. Definition order is a topological order, so one
+// pass settles everything. Caller holds job->lock.
+static int pick_ready(struct job *job, int *ready) {
+    int n = 0;
+    for (int i = 0; i < job->count; i++) {
+        struct step *s = &job->steps[i];
+        if (s->state != STEP_WAITING) {
+            continue;
+        }
+        int blocked = 0;
+        int skip = job->cancelled;
+        for (int d = 0; d < s->dep_count; d++) {
+            int state = job->steps[s->deps[d]].state;
+            if (state == STEP_FAILED || state == STEP_SKIPPED) {
+                skip = 1;
+            } else if (state != STEP_DONE) {
+                blocked = 1;
+            }
+        }
+        if (skip) {
+            s->state = STEP_SKIPPED;
+            job->left--;
+        } else if (!blocked && job->running < parallel_limit) {
+            s->state = STEP_QUEUED;
+            s->ready_ns = metrics_now();
+            job->running++;
+            ready[n++] = i;
+        }
+    }
+    return n;
+}
+
+// Queue steps with the scheduler, charged to the job's client
+static void queue_steps(struct job *job, const int *ready, int n) {
+    struct command_args args;
+    memset(&args, 0, sizeof(args));
+    args.client_pid = job->client_pid;
+    args.opcode = OP_SHELL;
+    args.seq = job->seq;
+    args.solo = 1;  // Never share a run: the output belongs in this job's report
+    args.job = job;
+    for (int i = 0; i < n; i++) {
+        args.step = ready[i];
+        strcpy(args.command, job->steps[ready[i]].command);
+        if (sched_push(&args) == -1) {
+            job_step_done(job, ready[i], JOB_STATUS_DROPPED, NULL);
+        }
+    }
+}
+
+// Start the job sent by request: queue every step that depends on nothing
+void job_start(struct job *job, const struct command_args *request) {
+    int ready[JOB_MAX_STEPS];
+    job->client_pid = request->client_pid;
+    job->seq = request->seq;
+    job->started_ns = metrics_now();
+    job->ring = registry_hold_ring(request->client_pid);
+    strcpy(job->spec, request->command);
+    __atomic_add_fetch(&jobs_running, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&job->lock);
+    int n = pick_ready(job, ready);
+    pthread_mutex_unlock(&job->lock);
+    queue_steps(job, ready, n);
+}
+
+int job_active(void) {
+    return __atomic_load_n(&jobs_running, __ATOMIC_RELAXED);
+}
+
+int job_finished(struct job *job) {
+    pthread_mutex_lock(&job->lock);
+    int finished = job->left == 0;
+    pthread_mutex_unlock(&job->lock);
+    return finished;
+}
+
+void job_step_started(struct job *job, int step) {
+    pthread_mutex_lock(&job->lock);
+    job->steps[step].started_ns = metrics_now();
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Keep a step's output for the report. Only the thread running the step
+// calls this, so the step's buffer needs no lock.
+void job_capture(struct job *job, int step, const char *data, int len) {
+    struct step *s = &job->steps[step];
+    if (len > JOB_STEP_OUTPUT - s->len) {
+        len = JOB_STEP_OUTPUT - s->len;
+        s->cut = 1;
+    }
+    if (len <= 0) {
+        return;
+    }
+    char *grown = realloc(s->output, s->len + len);
+    if (!grown) {
+        perror("realloc failed");
+        s->cut = 1;
+        return;
+    }
+    s->output = grown;
+    memcpy(s->output + s->len, data, len);
+    s->len += len;
+}
+
+// A step has finished: queue whatever it unblocked, and once the last step is
+// done send the job back to the control lane for its report
+void job_step_done(struct job *job, int step, int status, const struct reply_usage *usage) {
+    int ready[JOB_MAX_STEPS];
+    pthread_mutex_lock(&job->lock);
+    struct step *s = &job->steps[step];
+    s->done_ns = metrics_now();
+    s->status = status;
+    s->state = status == 0 ? STEP_DONE : STEP_FAILED;
+    if (usage) {
+        s->usage = *usage;
+        s->has_usage = 1;
+    }
+    if (status == JOB_STATUS_DROPPED) {
+        job->cancelled = 1;
+    }
+    job->running--;
+    job->left--;
+    int n = pick_ready(job, ready);
+    int finished = job->left == 0;
+    pthread_mutex_unlock(&job->lock);
+
+    queue_steps(job, ready, n);
+    if (finished) {
+        struct command_args report;
+        memset(&report, 0, sizeof(report));
+        report.client_pid = job->client_pid;
+        report.opcode = OP_JOB;
+        report.seq = job->seq;
+        report.job = job;
+        report.step = -1;
+        report.queued_ns = metrics_now();
+        strcpy(report.command, job->spec);
+        pool_submit_control(&report);
+    }
+}
+
+static double ms(int64_t ns) {
+    return ns / 1e6;
+}
+
+void job_free(struct job *job) {
+    for (int i = 0; i < job->count; i++) {
+        free(job->steps[i].output);
+    }
+    if (job->ring) {
+        ring_detach(job->ring);
+    }
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+// Write the report for a finished job into r and free the job. Returns -1,
+// having written nothing, if the client is gone: a step was dropped when its
+// lease expired, or it died while the last steps ran.
+int job_report(struct job *job, struct reply *r) {
+    __atomic_sub_fetch(&jobs_running, 1, __ATOMIC_RELAXED);
+    if (job->cancelled || !client_alive(job->client_pid)) {
+        job_free(job);
+        return -1;
+    }
+    if (!r->ring && job->ring) {
+        r->ring = job->ring;  // The client sent EXIT while the steps ran
+        job->ring = NULL;
+    }
+
+    int64_t path[JOB_MAX_STEPS];
+    int64_t critical = 0, total = 0, last_done = job->started_ns;
+    int ok = 0, failed = 0, skipped = 0;
+    int status = 0;
+    for (int i = 0; i < job->count; i++) {
+        struct step *s = &job->steps[i];
+        path[i] = 0;
+        if (s->state == STEP_SKIPPED) {
+            skipped++;
+            continue;
+        }
+        // Longest chain of run times ending with this step
+        int64_t ran = s->started_ns ? s->done_ns - s->started_ns : 0;
+        for (int d = 0; d < s->dep_count; d++) {
+            if (path[s->deps[d]] > path[i]) {
+                path[i] = path[s->deps[d]];
+            }
+        }
+        path[i] += ran;
+        critical = path[i] > critical ? path[i] : critical;
+        total += ran;
+        last_done = s->done_ns > last_done ? s->done_ns : last_done;
+        if (s->state == STEP_DONE) {
+            ok++;
+        } else if (failed++ == 0) {
+            status = s->status;
+        }
+    }
+
+    reply_printf(r, "Job: %d steps, %d ok, %d failed, %d skipped; wall %.1f ms, critical path %.1f ms, "
+                    "steps total %.1f ms\n", job->count, ok, failed, skipped,
+                 ms(last_done - job->started_ns), ms(critical), ms(total));
+    for (int i = 0; i < job->count; i++) {
+        struct step *s = &job->steps[i];
+        if (s->state == STEP_SKIPPED) {
+            reply_printf(r, "--- [%s] skipped: a step it depends on failed ---\n", s->name);
+            continue;
+        }
+        int64_t started = s->started_ns ? s->started_ns : s->done_ns;
+        char cpu[48] = "";
+        if (s->has_usage) {
+            snprintf(cpu, sizeof(cpu), ", cpu %.1f ms", (s->usage.user_us + s->usage.sys_us) / 1000.0);
+        }
+        reply_printf(r, "--- [%s] status %d, waited %.1f ms, ran %.1f ms%s ---\n", s->name, s->status,
+                     ms(started - s->ready_ns), ms(s->done_ns - started), cpu);
+        reply_write(r, s->output ? s->output : "", s->len, 0);
+        if (s->cut) {
+            reply_printf(r, "[output cut at %d bytes]\n", JOB_STEP_OUTPUT);
+        }
+    }
+    r->status = status;
+    r->started_ns = job->started_ns;  // Journal the job's whole run
+    job_free(job);
+    return 0;
+}
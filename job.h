@@ -0,0 +1,41 @@
+/* Jobs: small dependency graphs of shell commands sent as one request.
+
+A job is written as steps separated by ";;", each "name: command" or
+"name<dep,dep: command". A step may only depend on steps listed before it,
+so the graph can never have a cycle. For example:
+
+    JOB mk: mkdir -p out ;; a<mk: grep -c foo x > out/a ;; b<mk: wc -l y > out/b ;; sum<a,b: cat out/a out/b
+
+Steps go through the client's scheduler queue like any other shell command.
+Up to the parallel limit of a job's steps run at once, and a step is queued
+the moment the last step it depends on succeeds. A step whose dependency
+failed is skipped. When every step is done, the client gets one reply with
+each step's status, timings and output, and the job's wall time next to its
+critical path.
+*/
+
+#ifndef JOB_H
+#define JOB_H
+
+#include "server.h"
+
+#define JOB_MAX_STEPS 32
+#define JOB_NAME_LEN 16
+#define JOB_DEFAULT_PARALLEL 4
+#define JOB_STEP_OUTPUT 65536     // Output kept per step; the rest is cut
+#define JOB_STATUS_DROPPED -1     // The step was thrown away unrun (client gone)
+
+struct job;
+
+void job_init(int parallel);
+struct job *job_parse(const char *spec, int len, char *error, int error_size);
+void job_start(struct job *job, const struct command_args *request);
+int job_finished(struct job *job);
+int job_active(void);
+int job_report(struct job *job, struct reply *r);
+void job_free(struct job *job);
+void job_step_started(struct job *job, int step);
+void job_capture(struct job *job, int step, const char *data, int len);
+void job_step_done(struct job *job, int step, int status, const struct reply_usage *usage);
+
+#endif
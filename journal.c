@@ -0,0 +1,355 @@
+/* Segment files, record appends and the group-commit thread.
+
+journal_lock guards the current segment's append offset and the lists of
+segments handed to the committer. Only the committer unmaps a segment, so it
+can msync a range outside the lock while workers keep appending after it.
+*/
+
+#define _GNU_SOURCE  // O_CLOEXEC, posix_fallocate
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "metrics.h"
+
+#define SPARE_NAME "journal-next.tmp"   // Prepared segment, named when it is used
+
+struct segment {
+    int fd;
+    char *base;
+    long used;       // Bytes of header and records
+    long synced;     // Flushed to disk up to here
+    struct segment *next;   // On the retired list
+};
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_idle = PTHREAD_COND_INITIALIZER;
+static int committing = 0;               // The committer is using segments outside the lock
+static struct segment *current = NULL;
+static struct segment *spare = NULL;     // Opened ahead by the committer
+static struct segment *retired = NULL;   // Full; the committer finishes them
+static int enabled = 0;
+static int failing = 0;                  // Could not open a segment; said so once
+static char journal_dir[PATH_MAX];
+static long segment_size;
+static unsigned int next_number = 0;
+
+static void segment_path(char *path, int size, const char *name) {
+    snprintf(path, size, "%s/%s", journal_dir, name);
+}
+
+// Create and map a segment file of segment_size bytes. Returns NULL on error.
+static struct segment *create_segment(const char *name) {
+    char path[PATH_MAX + 32];
+    segment_path(path, sizeof(path), name);
+    struct segment *s = calloc(1, sizeof(struct segment));
+    if (!s) {
+        perror("calloc failed");
+        return NULL;
+    }
+    s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s->fd == -1) {
+        perror("Could not create journal segment");
+        free(s);
+        return NULL;
+    }
+    int err = posix_fallocate(s->fd, 0, segment_size);
+    if (err == 0) {
+        s->base = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    }
+    if (err != 0 || s->base == MAP_FAILED) {
+        fprintf(stderr, "Could not map journal segment %s: %s\n", path, strerror(err ? err : errno));
+        close(s->fd);
+        unlink(path);
+        free(s);
+        return NULL;
+    }
+    s->used = JOURNAL_HEADER_SIZE;
+    return s;
+}
+
+// Give a segment the next number and write its header. Caller holds
+// journal_lock, so numbers follow the order segments are written in.
+static int number_segment(struct segment *s, const char *from) {
+    char name[32], path[PATH_MAX + 32], old[PATH_MAX + 32];
+    snprintf(name, sizeof(name), "journal-%06u.seg", next_number);
+    segment_path(path, sizeof(path), name);
+    if (from) {
+        segment_path(old, sizeof(old), from);
+        if (rename(old, path) == -1) {
+            perror("Could not rename journal segment");
+            return -1;
+        }
+    }
+    struct journal_segment_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_SEGMENT_MAGIC, sizeof(header.magic));
+    header.number = next_number++;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.created_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    memcpy(s->base, &header, sizeof(header));
+    return 0;
+}
+
+// msync, cut to the used length and close a segment nobody appends to any more
+static void finish_segment(struct segment *s) {
+    if (msync(s->base, s->used, MS_SYNC) == -1) {
+        perror("msync failed");
+    }
+    munmap(s->base, segment_size);
+    if (ftruncate(s->fd, s->used) == -1 || fsync(s->fd) == -1) {
+        perror("Could not trim journal segment");
+    }
+    close(s->fd);
+    free(s);
+}
+
+// Flush [from, to) of a segment; msync wants a page-aligned start
+static void sync_range(struct segment *s, long from, long to) {
+    long page = sysconf(_SC_PAGESIZE);
+    long start = from & ~(page - 1);
+    int64_t started = metrics_now();
+    if (msync(s->base + start, to - start, MS_SYNC) == -1) {
+        perror("msync failed");
+    }
+    metrics_since(HIST_JOURNAL_COMMIT, started);
+    metrics_count(CTR_JOURNAL_COMMITS, 1);
+}
+
+// Throw away a prepared segment that was never used
+static void drop_spare(struct segment *s) {
+    char path[PATH_MAX + 32];
+    segment_path(path, sizeof(path), SPARE_NAME);
+    unlink(path);
+    munmap(s->base, segment_size);
+    close(s->fd);
+    free(s);
+}
+
+// Replace the full current segment with the spare (or a new one if the
+// committer has not made one yet). Caller holds journal_lock.
+static int rotate_locked(void) {
+    if (current) {
+        current->next = retired;
+        retired = current;
+        current = NULL;
+    }
+    struct segment *s = spare;
+    spare = NULL;
+    if (s && number_segment(s, SPARE_NAME) == -1) {
+        drop_spare(s);
+        s = NULL;
+    }
+    if (!s) {
+        char name[32];
+        snprintf(name, sizeof(name), "journal-%06u.seg", next_number);
+        s = create_segment(name);
+        if (s) {
+            number_segment(s, NULL);  // Already has its name; cannot fail
+        }
+    }
+    pthread_cond_signal(&commit_cond);  // Finish the old one, prepare a spare
+    if (!s) {
+        if (!failing) {
+            log_printf("Journal: no segment to write to, dropping records\n");
+        }
+        failing = 1;
+        return -1;
+    }
+    failing = 0;
+    current = s;
+    return 0;
+}
+
+// Group commit: every JOURNAL_COMMIT_MS, or sooner when woken, flush what was
+// appended since last time in one msync, finish retired segments and keep a
+// spare ready
+static void *commit_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&commit_cond, &journal_lock, &deadline);
+
+        struct segment *old = retired;
+        retired = NULL;
+        struct segment *s = current;
+        long from = s ? s->synced : 0;
+        long to = s ? s->used : 0;
+        int need_spare = spare == NULL && enabled;
+        committing = 1;
+        pthread_mutex_unlock(&journal_lock);
+
+        while (old) {
+            struct segment *next = old->next;
+            finish_segment(old);
+            old = next;
+        }
+        if (to > from) {
+            sync_range(s, from, to);
+        }
+        struct segment *made = need_spare ? create_segment(SPARE_NAME) : NULL;
+
+        pthread_mutex_lock(&journal_lock);
+        if (s) {
+            s->synced = to;  // Still mapped even if it was retired meanwhile
+        }
+        committing = 0;
+        pthread_cond_broadcast(&commit_idle);
+        if (made && enabled) {
+            spare = made;
+        } else if (made) {
+            drop_spare(made);  // Closed meanwhile
+        }
+    }
+    return NULL;
+}
+
+// Find the number after the highest existing segment, so a restarted server
+// carries on the sequence
+static unsigned int scan_segments(void) {
+    unsigned int next = 0;
+    DIR *d = opendir(journal_dir);
+    if (!d) {
+        return 0;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned int n;
+        char end;
+        if (sscanf(e->d_name, "journal-%u.se%c", &n, &end) == 2 && n >= next) {
+            next = n + 1;
+        }
+    }
+    closedir(d);
+    return next;
+}
+
+// Start journalling into dir (created if missing) in segments of
+// segment_bytes. With dir NULL the journal is off.
+int journal_init(const char *dir, long segment_bytes) {
+    if (!dir) {
+        return 0;
+    }
+    if (segment_bytes < JOURNAL_HEADER_SIZE + (long)sizeof(struct journal_record) + MAX_CMD_LEN + 8) {
+        fprintf(stderr, "Journal segments of %ld bytes are too small\n", segment_bytes);
+        return -1;
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("Could not create journal directory");
+        return -1;
+    }
+    snprintf(journal_dir, sizeof(journal_dir), "%s", dir);
+    segment_size = segment_bytes;
+    next_number = scan_segments();
+
+    pthread_mutex_lock(&journal_lock);
+    int result = rotate_locked();
+    __atomic_store_n(&enabled, result == 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&journal_lock);
+    if (result == -1) {
+        return -1;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, commit_main, NULL) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("Journal: %s, %ld MB segments starting at %u, committed every %d ms\n",
+           dir, segment_bytes >> 20, next_number - 1, JOURNAL_COMMIT_MS);
+    return 0;
+}
+
+// Record a finished command. r is its reply, which has just sent REPLY_END.
+void journal_append(const struct reply *r) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+    union {
+        struct journal_record rec;
+        char bytes[sizeof(struct journal_record) + MAX_CMD_LEN + 8];
+    } u;
+    struct journal_record *rec = &u.rec;
+    int command_len = strnlen(r->command, MAX_CMD_LEN - 1);
+    int size = (sizeof(struct journal_record) + command_len + 7) & ~7;
+    memset(rec, 0, size);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec->size = size;
+    rec->command_len = command_len;
+    rec->time_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    rec->duration_ns = metrics_now() - r->started_ns;
+    rec->output_bytes = r->output_bytes;
+    rec->client_pid = r->client_pid;
+    rec->seq = r->seq;
+    rec->status = r->status;
+    rec->opcode = r->opcode;
+    rec->flags = r->job ? JOURNAL_STEP : 0;
+    memcpy(rec->command, r->command, command_len);
+
+    pthread_mutex_lock(&journal_lock);
+    if (!enabled || ((!current || current->used + size > segment_size) && rotate_locked() == -1)) {
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    // Everything but the magic first, so a reader never sees half a record
+    char *at = current->base + current->used;
+    memcpy(at + sizeof(rec->magic), u.bytes + sizeof(rec->magic), size - sizeof(rec->magic));
+    __atomic_store_n((uint32_t *)at, JOURNAL_RECORD_MAGIC, __ATOMIC_RELEASE);
+    current->used += size;
+    if (current->used - current->synced >= JOURNAL_COMMIT_BYTES) {
+        pthread_cond_signal(&commit_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    metrics_count(CTR_JOURNAL_RECORDS, 1);
+}
+
+// Flush and trim the journal on the way out (or before a restart hands over
+// to a new server, which starts a segment of its own). Nothing is journalled
+// after this. Returns 1 if the journal was on.
+int journal_close(void) {
+    pthread_mutex_lock(&journal_lock);
+    if (!enabled) {
+        pthread_mutex_unlock(&journal_lock);
+        return 0;
+    }
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+    while (committing) {
+        pthread_cond_wait(&commit_idle, &journal_lock);
+    }
+    while (retired) {
+        struct segment *next = retired->next;
+        finish_segment(retired);
+        retired = next;
+    }
+    if (current) {
+        finish_segment(current);
+        current = NULL;
+    }
+    if (spare) {
+        drop_spare(spare);
+        spare = NULL;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return 1;
+}
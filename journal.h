@@ -0,0 +1,64 @@
+/* Durable journal of every command the server has answered.
+
+Records go into segment files journal-NNNNNN.seg in the journal directory.
+A segment is preallocated and mapped, so appending a record is a memcpy
+under a short lock; nothing on the command path waits for the disk. A
+committer thread msyncs what was appended every JOURNAL_COMMIT_MS (sooner
+once JOURNAL_COMMIT_BYTES are waiting), so one flush covers every command
+that finished since the last one. A crash of the server loses nothing that
+was appended; a crash of the machine loses at most one commit interval.
+
+A segment that fills up is synced, cut to the length it used and closed by
+the committer, which also opens the next one ahead of time. The reader tool
+(journal_read.c) filters segments and turns them back into client scripts.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "server.h"
+
+#define JOURNAL_DEFAULT_SEGMENT_MB 64
+#define JOURNAL_COMMIT_MS 20
+#define JOURNAL_COMMIT_BYTES (1 << 20)
+
+#define JOURNAL_SEGMENT_MAGIC "A2JOURN1"   // First 8 bytes of a segment
+#define JOURNAL_HEADER_SIZE 64             // Segment header; records follow
+#define JOURNAL_RECORD_MAGIC 0x4A524543    // "JREC"; 0 where no record was written
+
+// First JOURNAL_HEADER_SIZE bytes of a segment
+struct journal_segment_header {
+    char magic[8];
+    uint32_t number;        // As in the file name
+    uint32_t reserved;
+    int64_t created_ns;     // Wall clock
+};
+
+// Record flags
+#define JOURNAL_STEP 0x1   // A step of a JOB, which is journalled as well
+
+// One record, padded to 8 bytes. Readers stop at the first record whose
+// magic is not JOURNAL_RECORD_MAGIC; the magic is written last.
+struct journal_record {
+    uint32_t magic;
+    uint16_t size;          // Whole record, with padding
+    uint16_t command_len;
+    int64_t time_ns;        // Wall clock when the last reply chunk went out
+    int64_t duration_ns;    // Worker picking the command up to the last chunk
+    int64_t output_bytes;
+    int32_t client_pid;
+    uint32_t seq;
+    int32_t status;
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t reserved;
+    char command[];         // command_len bytes, no NUL
+};
+
+int journal_init(const char *dir, long segment_bytes);
+void journal_append(const struct reply *r);
+int journal_close(void);
+
+#endif
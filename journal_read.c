@@ -0,0 +1,269 @@
+/* Reader for the server's command journal.
+
+Prints the records in journal segments (files, or directories of them read in
+segment order), optionally filtered by client, command type, exit status,
+age or command text. With -r it prints the matching commands as a client
+script instead, so a session can be replayed against a server with
+./client -f -. Records are checked as they are read; the reader stops at the
+end of what was written, so it can also follow a segment the server still
+has open.
+*/
+
+// COMPILE: gcc -o jread journal_read.c
+// RUN: ./jread [-p pid] [-o op] [-f] [-g text] [-s seconds] [-r] journal_dir|segment...
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "journal.h"
+
+// Typed form of each opcode; OP_SHELL is the command itself
+static const char *op_names[OP_COUNT] = {
+    [OP_SHELL] = "shell", [OP_LIST] = "LIST", [OP_HIDE] = "HIDE", [OP_UNHIDE] = "UNHIDE",
+    [OP_EXIT] = "EXIT", [OP_CHPT] = "CHPT", [OP_STATUS] = "status", [OP_SHUTDOWN] = "shutdown",
+    [OP_BATCH] = "batch", [OP_STATS] = "STATS", [OP_HELLO] = "HELLO", [OP_PING] = "PING",
+    [OP_JOB] = "JOB"
+};
+
+// Filters; -1 or NULL for any
+static int want_pid = -1;
+static int want_op = -1;
+static int failed_only = 0;
+static const char *want_text = NULL;
+static int64_t since_ns = 0;
+static int replay = 0;
+
+static long matched = 0;
+
+static const char *op_name(int opcode) {
+    return opcode < OP_COUNT && op_names[opcode] ? op_names[opcode] : "?";
+}
+
+static int lookup_op(const char *name) {
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (op_names[op] && strcasecmp(op_names[op], name) == 0) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+static int matches(const struct journal_record *rec) {
+    if (want_pid != -1 && rec->client_pid != want_pid) {
+        return 0;
+    }
+    if (want_op != -1 && rec->opcode != want_op) {
+        return 0;
+    }
+    if (failed_only && rec->status == 0) {
+        return 0;
+    }
+    if (rec->time_ns < since_ns) {
+        return 0;
+    }
+    return !want_text || memmem(rec->command, rec->command_len, want_text, strlen(want_text)) != NULL;
+}
+
+// As a line of a client script, or nothing for what should not be sent again
+static void print_replay(const struct journal_record *rec) {
+    int op = rec->opcode;
+    if ((rec->flags & JOURNAL_STEP) || op == OP_EXIT || op == OP_SHUTDOWN || op == OP_HELLO || op == OP_PING) {
+        return;  // Steps come back with their JOB; the rest would end the session
+    }
+    if (op == OP_JOB && rec->command_len == MAX_CMD_LEN - 1) {
+        fprintf(stderr, "Skipping a JOB from client %d: too long to have been journalled whole\n",
+                rec->client_pid);
+        return;
+    }
+    if (op == OP_SHELL) {
+        printf("%.*s\n", rec->command_len, rec->command);
+    } else if (op == OP_CHPT || op == OP_JOB) {
+        printf("%s %.*s\n", op_name(op), rec->command_len, rec->command);
+    } else {
+        printf("%s\n", op_name(op));
+    }
+}
+
+static void print_record(const struct journal_record *rec) {
+    time_t secs = rec->time_ns / 1000000000LL;
+    struct tm tm;
+    char when[32];
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%03d  pid %-7d seq %-6u status %-3d %9.3f ms %8lld B  %-6s%s %.*s\n",
+           when, (int)(rec->time_ns / 1000000 % 1000), rec->client_pid, rec->seq, rec->status,
+           rec->duration_ns / 1e6, (long long)rec->output_bytes, op_name(rec->opcode),
+           rec->flags & JOURNAL_STEP ? " step" : "", rec->command_len, rec->command);
+}
+
+// Read one segment. Returns -1 if it could not be read at all.
+static int read_segment(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < JOURNAL_HEADER_SIZE) {
+        fprintf(stderr, "%s: not a journal segment\n", path);
+        close(fd);
+        return -1;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    if (memcmp(base, JOURNAL_SEGMENT_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a journal segment\n", path);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    long offset = JOURNAL_HEADER_SIZE;
+    while (offset + (long)sizeof(struct journal_record) <= st.st_size) {
+        const struct journal_record *rec = (const struct journal_record *)(base + offset);
+        uint32_t magic = __atomic_load_n(&rec->magic, __ATOMIC_ACQUIRE);
+        if (magic == 0) {
+            break;  // End of what was written
+        }
+        if (magic != JOURNAL_RECORD_MAGIC || rec->size % 8 != 0 ||
+            rec->size < sizeof(struct journal_record) + rec->command_len || offset + rec->size > st.st_size) {
+            fprintf(stderr, "%s: bad record at offset %ld, skipping the rest\n", path, offset);
+            break;
+        }
+        if (matches(rec)) {
+            matched++;
+            if (replay) {
+                print_replay(rec);
+            } else {
+                print_record(rec);
+            }
+        }
+        offset += rec->size;
+    }
+    munmap(base, st.st_size);
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Read every segment in a directory, oldest first (the numbers are zero-padded)
+static int read_directory(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return -1;
+    }
+    char **names = NULL;
+    int count = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned int n;
+        char end;
+        if (sscanf(e->d_name, "journal-%u.se%c", &n, &end) != 2) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(names, cap * sizeof(char *));
+            if (!grown) {
+                perror("realloc failed");
+                break;
+            }
+            names = grown;
+        }
+        names[count++] = strdup(e->d_name);
+    }
+    closedir(d);
+
+    qsort(names, count, sizeof(char *), compare_names);
+    for (int i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        read_segment(path);
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p pid] [-o op] [-f] [-g text] [-s seconds] [-r] journal_dir|segment...\n", prog);
+    fprintf(stderr, "  -p  only this client's commands\n");
+    fprintf(stderr, "  -o  only this kind of command: shell, LIST, HIDE, UNHIDE, EXIT, CHPT, status, STATS, JOB, ...\n");
+    fprintf(stderr, "  -f  only commands that failed (non-zero status)\n");
+    fprintf(stderr, "  -g  only commands containing text\n");
+    fprintf(stderr, "  -s  only commands from the last so many seconds\n");
+    fprintf(stderr, "  -r  print the commands as a script for ./client -f - instead\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:o:fg:s:r")) != -1) {
+        switch (opt) {
+        case 'p':
+            want_pid = atoi(optarg);
+            break;
+        case 'o':
+            want_op = lookup_op(optarg);
+            if (want_op == -1) {
+                fprintf(stderr, "Unknown command kind '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            failed_only = 1;
+            break;
+        case 'g':
+            want_text = optarg;
+            break;
+        case 's': {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            since_ns = (now.tv_sec - atol(optarg)) * 1000000000LL + now.tv_nsec;
+            break;
+        }
+        case 'r':
+            replay = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == -1) {
+            perror(argv[i]);
+            failed = 1;
+        } else if (S_ISDIR(st.st_mode)) {
+            failed |= read_directory(argv[i]) == -1;
+        } else {
+            failed |= read_segment(argv[i]) == -1;
+        }
+    }
+    if (!replay) {
+        fprintf(stderr, "%ld records matched\n", matched);
+    }
+    return failed;
+}
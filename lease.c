@@ -0,0 +1,246 @@
+/* Client leases on a hierarchical timer wheel.
+
+The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots. Level 0 holds leases
+due within WHEEL_SLOTS ticks, one slot per tick; each level above covers
+WHEEL_SLOTS times the span of the one below, and its slots are cascaded
+(re-filed one level down) as the ticks reach them. A tick therefore touches
+only the leases in one level 0 slot, plus once every WHEEL_SLOTS ticks a
+slot of the level above.
+
+Renewing does not move a lease in the wheel: it only records the tick the
+client was last heard from. When the lease's slot comes up it is re-filed at
+last seen + lease if that is still ahead, so a client sending thousands of
+requests costs one hash lookup each and one re-file per lease period.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "lease.h"
+#include "metrics.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+#define MAX_LEASE_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define CLIENT_BUCKETS 256   // Power of two
+
+struct lease {
+    int pid;
+    int expiring;        // Handed to the expiry callback, off the wheel
+    int forgotten;       // lease_forget() ran during the callback
+    uint64_t seen;       // Tick of the client's last request
+    uint64_t due;        // Tick the lease is filed under
+    struct lease **slot;         // Wheel slot it is filed in
+    struct lease *prev, *next;
+    struct lease *hash_next;
+};
+
+static pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lease *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static struct lease *leases[CLIENT_BUCKETS];
+static uint64_t now_tick = 0;
+static uint64_t lease_ticks = 0;   // 0 = leases off
+static lease_expired_fn on_expired;
+
+static unsigned int bucket_for(int pid) {
+    unsigned int h = (unsigned int)pid * 2654435761u;
+    return (h ^ (h >> 16)) & (CLIENT_BUCKETS - 1);
+}
+
+// Caller holds lease_lock
+static struct lease *find_lease(int pid) {
+    struct lease *l = leases[bucket_for(pid)];
+    while (l && l->pid != pid) {
+        l = l->hash_next;
+    }
+    return l;
+}
+
+static void unhash(struct lease *l) {
+    struct lease **p = &leases[bucket_for(l->pid)];
+    while (*p != l) {
+        p = &(*p)->hash_next;
+    }
+    *p = l->hash_next;
+}
+
+// Put a lease in the slot for its due tick: the lowest level whose span
+// reaches that far. Caller holds lease_lock.
+static void file_lease(struct lease *l) {
+    uint64_t delta = l->due > now_tick ? l->due - now_tick : 0;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    l->slot = &wheel[level][(l->due >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    l->prev = NULL;
+    l->next = *l->slot;
+    if (l->next) {
+        l->next->prev = l;
+    }
+    *l->slot = l;
+}
+
+// Take a lease off whichever slot it is in. Caller holds lease_lock.
+static void unfile_lease(struct lease *l) {
+    if (l->prev) {
+        l->prev->next = l->next;
+    } else {
+        *l->slot = l->next;
+    }
+    if (l->next) {
+        l->next->prev = l->prev;
+    }
+}
+
+// Empty one slot and return what was in it
+static struct lease *take_slot(int level, int index) {
+    struct lease *list = wheel[level][index];
+    wheel[level][index] = NULL;
+    return list;
+}
+
+// Advance the wheel by one tick. Leases that ran out are chained through
+// next into *expired, already off the wheel. Caller holds lease_lock.
+static void tick(struct lease **expired) {
+    now_tick++;
+    // Cascade from the top down, so a lease dropping two levels lands in
+    // level 0 before its slot there is read
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        uint64_t below = now_tick & ((1ULL << (WHEEL_BITS * level)) - 1);
+        if (below != 0) {
+            continue;
+        }
+        struct lease *l = take_slot(level, (now_tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        while (l) {
+            struct lease *next = l->next;
+            file_lease(l);
+            l = next;
+        }
+    }
+
+    struct lease *l = take_slot(0, now_tick & WHEEL_MASK);
+    while (l) {
+        struct lease *next = l->next;
+        if (l->seen + lease_ticks > now_tick) {
+            l->due = l->seen + lease_ticks;  // Renewed since it was filed
+            file_lease(l);
+        } else {
+            l->expiring = 1;
+            l->next = *expired;
+            *expired = l;
+        }
+        l = next;
+    }
+}
+
+// Tick every LEASE_TICK_MS and run the expiry callback outside the lock, so
+// it is free to take the registry and scheduler locks
+static void *lease_main(void *arg) {
+    (void)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (1) {
+        next.tv_nsec += LEASE_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+
+        struct lease *expired = NULL;
+        pthread_mutex_lock(&lease_lock);
+        tick(&expired);
+        pthread_mutex_unlock(&lease_lock);
+
+        while (expired) {
+            struct lease *l = expired;
+            expired = l->next;
+            int keep = on_expired(l->pid);
+
+            pthread_mutex_lock(&lease_lock);
+            if (keep && !l->forgotten) {
+                l->expiring = 0;
+                l->seen = now_tick;
+                l->due = now_tick + lease_ticks;
+                file_lease(l);
+            } else {
+                if (!l->forgotten) {
+                    unhash(l);
+                }
+                free(l);
+            }
+            pthread_mutex_unlock(&lease_lock);
+        }
+    }
+    return NULL;
+}
+
+// Start the lease thread. seconds is the lease length, 0 to turn leases off.
+int lease_init(int seconds, lease_expired_fn expired) {
+    if (seconds == 0) {
+        return 0;
+    }
+    uint64_t ticks = (uint64_t)seconds * 1000 / LEASE_TICK_MS;
+    lease_ticks = ticks > MAX_LEASE_TICKS ? MAX_LEASE_TICKS : ticks;
+    on_expired = expired;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, lease_main, NULL) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("Client leases: %d s\n", seconds);
+    return 0;
+}
+
+// The client was heard from: start its lease, or push the current one out
+void lease_renew(int client_pid) {
+    if (lease_ticks == 0) {
+        return;
+    }
+    pthread_mutex_lock(&lease_lock);
+    struct lease *l = find_lease(client_pid);
+    if (l) {
+        l->seen = now_tick;
+    } else if ((l = calloc(1, sizeof(struct lease))) != NULL) {
+        l->pid = client_pid;
+        l->seen = now_tick;
+        l->due = now_tick + lease_ticks;
+        l->hash_next = leases[bucket_for(client_pid)];
+        leases[bucket_for(client_pid)] = l;
+        file_lease(l);
+    } else {
+        perror("calloc failed");
+    }
+    pthread_mutex_unlock(&lease_lock);
+}
+
+// The client left on its own (EXIT): drop its lease
+void lease_forget(int client_pid) {
+    if (lease_ticks == 0) {
+        return;
+    }
+    pthread_mutex_lock(&lease_lock);
+    struct lease *l = find_lease(client_pid);
+    if (l) {
+        unhash(l);
+        if (l->expiring) {
+            l->forgotten = 1;  // The lease thread frees it after the callback
+        } else {
+            unfile_lease(l);
+            free(l);
+        }
+    }
+    pthread_mutex_unlock(&lease_lock);
+}
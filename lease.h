@@ -0,0 +1,25 @@
+/* Client leases.
+
+Every request a client sends renews its lease; OP_PING renews it without
+doing anything else. A client that sends nothing for a whole lease is handed
+to an expiry callback, which decides whether it is really gone (its process
+no longer exists) or just idle, and in that case the lease starts over.
+Leases are kept in a hierarchical timer wheel, so renewing one and expiring
+one are O(1) and each tick only looks at the leases due in it.
+*/
+
+#ifndef LEASE_H
+#define LEASE_H
+
+#define LEASE_DEFAULT_SECONDS 10
+#define LEASE_TICK_MS 100
+
+// Called on the lease thread for a client whose lease ran out. Returns 1 to
+// keep the client (with a fresh lease), 0 once it has been reclaimed.
+typedef int (*lease_expired_fn)(int client_pid);
+
+int lease_init(int seconds, lease_expired_fn expired);
+void lease_renew(int client_pid);
+void lease_forget(int client_pid);
+
+#endif
@@ -0,0 +1,284 @@
+/* Per-thread metrics and the asynchronous log.
+
+A thread's metrics block is allocated the first time it records something and
+is never freed (threads here live as long as the server). Blocks are linked
+into a fixed table that metrics_report() walks without stopping anyone;
+readers may see a histogram a few samples apart from its count, which is fine
+for monitoring.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "shmring.h"
+#include "supervisor.h"
+#include "registry.h"
+
+#define MAX_METRIC_THREADS 256
+#define SUB_BUCKETS 4
+#define BUCKETS (64 * SUB_BUCKETS)
+
+#define LOG_SLOTS 4096
+#define LOG_LINE 256
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[BUCKETS];
+};
+
+struct metrics_block {
+    uint64_t counters[CTR_COUNT];
+    struct hist hists[HIST_COUNT];
+};
+
+static struct metrics_block *blocks[MAX_METRIC_THREADS];
+static int block_count = 0;
+static struct metrics_block overflow;   // Shared by threads past the limit
+static __thread struct metrics_block *my_block;
+static int64_t started_ns;
+
+static const char *counter_names[CTR_COUNT] = {
+    "commands_received", "commands_rejected", "timeouts_killed", "log_lines_dropped",
+    "spawned_direct", "spawned_shell", "builtin_native", "cache_hits", "cache_misses",
+    "coalesced", "limit_killed", "clients_expired", "journal_records", "journal_commits",
+    "gateway_accepted", "gateway_closed"
+};
+static const char *hist_names[HIST_EXEC] = {
+    "dispatch", "queue_wait", "registry_lock", "child_run", "sched_wait",
+    "control_wait", "child_cpu", "journal_commit"
+};
+static const char *op_names[OP_COUNT] = {
+    [OP_SHELL] = "shell", [OP_LIST] = "list", [OP_HIDE] = "hide", [OP_UNHIDE] = "unhide",
+    [OP_EXIT] = "exit", [OP_CHPT] = "chpt", [OP_STATUS] = "status", [OP_SHUTDOWN] = "shutdown",
+    [OP_BATCH] = "batch", [OP_STATS] = "stats", [OP_HELLO] = "hello", [OP_JOB] = "job"
+};
+
+int64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct metrics_block *block(void) {
+    if (my_block) {
+        return my_block;
+    }
+    int index = __atomic_fetch_add(&block_count, 1, __ATOMIC_RELAXED);
+    if (index >= MAX_METRIC_THREADS || !(my_block = calloc(1, sizeof(struct metrics_block)))) {
+        my_block = &overflow;
+        return my_block;
+    }
+    __atomic_store_n(&blocks[index], my_block, __ATOMIC_RELEASE);
+    return my_block;
+}
+
+void metrics_count(enum counter c, int64_t n) {
+    __atomic_add_fetch(&block()->counters[c], n, __ATOMIC_RELAXED);
+}
+
+static int bucket_of(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return msb * SUB_BUCKETS + (int)((ns >> (msb - 2)) & (SUB_BUCKETS - 1));
+}
+
+// Upper edge of a bucket, in ns
+static uint64_t bucket_top(int b) {
+    if (b < SUB_BUCKETS) {
+        return b;
+    }
+    int msb = b / SUB_BUCKETS;
+    uint64_t top = (uint64_t)(SUB_BUCKETS + b % SUB_BUCKETS + 1) << (msb - 2);
+    return top - 1;
+}
+
+void metrics_record(int h, int64_t ns) {
+    if (ns < 0) {
+        ns = 0;
+    }
+    struct hist *hist = &block()->hists[h];
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    if ((uint64_t)ns > __atomic_load_n(&hist->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_since(int h, int64_t start_ns) {
+    metrics_record(h, metrics_now() - start_ns);
+}
+
+static void add_block(struct metrics_block *total, struct metrics_block *b) {
+    for (int c = 0; c < CTR_COUNT; c++) {
+        total->counters[c] += __atomic_load_n(&b->counters[c], __ATOMIC_RELAXED);
+    }
+    for (int h = 0; h < HIST_COUNT; h++) {
+        struct hist *from = &b->hists[h], *to = &total->hists[h];
+        to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+        to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+        if (max > to->max) {
+            to->max = max;
+        }
+        for (int k = 0; k < BUCKETS; k++) {
+            to->buckets[k] += __atomic_load_n(&from->buckets[k], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Sum every thread's block into one
+static void collect(struct metrics_block *total) {
+    int n = __atomic_load_n(&block_count, __ATOMIC_RELAXED);
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < n && i < MAX_METRIC_THREADS; i++) {
+        struct metrics_block *b = __atomic_load_n(&blocks[i], __ATOMIC_ACQUIRE);
+        if (b) {  // NULL while its thread is still setting it up
+            add_block(total, b);
+        }
+    }
+    add_block(total, &overflow);
+}
+
+static uint64_t percentile(const struct hist *h, double p) {
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int report_hist(char *buf, int size, const char *name, const struct hist *h) {
+    if (h->count == 0) {
+        return 0;
+    }
+    return snprintf(buf, size, "%-16s count=%llu mean_us=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+                    name, (unsigned long long)h->count, h->sum / 1000.0 / h->count,
+                    percentile(h, 50) / 1000.0, percentile(h, 99) / 1000.0, h->max / 1000.0);
+}
+
+// Write a plain-text summary into buf. Returns its length.
+int metrics_report(char *buf, int size) {
+    static struct metrics_block total;  // Too big for a worker's stack
+    static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+    int len = 0;
+
+    pthread_mutex_lock(&report_lock);
+    collect(&total);
+    len += snprintf(buf + len, size - len, "uptime_s %.1f\n", (metrics_now() - started_ns) / 1e9);
+    for (int c = 0; c < CTR_COUNT && len < size; c++) {
+        len += snprintf(buf + len, size - len, "%s %llu\n", counter_names[c],
+                        (unsigned long long)total.counters[c]);
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "active_children %d\nregistered_clients %d\n",
+                        supervisor_active(), registry_count());
+    }
+    for (int h = 0; h < HIST_EXEC && len < size; h++) {
+        len += report_hist(buf + len, size - len, hist_names[h], &total.hists[h]);
+    }
+    for (int op = 0; op < OP_COUNT && len < size; op++) {
+        if (!op_names[op]) {
+            continue;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "exec_%s", op_names[op]);
+        len += report_hist(buf + len, size - len, name, &total.hists[HIST_EXEC + op]);
+    }
+    pthread_mutex_unlock(&report_lock);
+    return len < size ? len : size - 1;
+}
+
+static struct shm_ring *log_ring;
+static uint64_t lines_queued = 0;
+static uint64_t lines_written = 0;
+
+// Logger thread: copy lines to stdout, flushing whenever the ring runs dry
+static void *log_main(void *arg) {
+    (void)arg;
+    char line[LOG_LINE];
+    while (1) {
+        int len = ring_pop(log_ring, line, 0);
+        if (len == -1) {
+            fflush(stdout);
+            len = ring_pop(log_ring, line, -1);
+            if (len == -1) {
+                continue;
+            }
+        }
+        fwrite(line, 1, len, stdout);
+        __atomic_add_fetch(&lines_written, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int log_start(void) {
+    pthread_t tid;
+    started_ns = metrics_now();
+    log_ring = ring_alloc(LOG_SLOTS, LOG_LINE);
+    if (!log_ring || pthread_create(&tid, NULL, log_main, NULL) != 0) {
+        fprintf(stderr, "Could not start the logger\n");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Queue text for stdout (cut to LOG_LINE bytes). Falls back to writing
+// directly before log_start().
+void log_write(const char *text, int len) {
+    if (len > LOG_LINE) {
+        len = LOG_LINE;
+    }
+    if (!log_ring) {
+        fwrite(text, 1, len, stdout);
+        return;
+    }
+    if (ring_push(log_ring, text, len, 0) == -1) {
+        metrics_count(CTR_LOG_DROPPED, 1);
+        return;
+    }
+    __atomic_add_fetch(&lines_queued, 1, __ATOMIC_RELAXED);
+}
+
+void log_printf(const char *fmt, ...) {
+    char line[LOG_LINE];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    log_write(line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+}
+
+// Wait (briefly) for the logger to write out everything queued so far;
+// used before exiting so the last lines are not lost
+void log_flush(void) {
+    uint64_t target = __atomic_load_n(&lines_queued, __ATOMIC_RELAXED);
+    for (int tries = 0; tries < 100 && __atomic_load_n(&lines_written, __ATOMIC_ACQUIRE) < target; tries++) {
+        usleep(1000);
+    }
+    fflush(stdout);
+}
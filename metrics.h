@@ -0,0 +1,66 @@
+/* Server metrics and asynchronous logging.
+
+Every thread that records a metric gets its own block of counters and
+histograms, so recording is a few uncontended atomic adds on memory no other
+thread writes. The STATS command sums the blocks on demand. Histograms use
+four buckets per power of two of nanoseconds, which is enough for percentiles
+within 25%.
+
+log_printf() formats a line and drops it into an in-process ring; a logger
+thread writes the lines to stdout. Threads on the command path never block on
+the terminal, and if the ring fills up lines are dropped (and counted)
+rather than waited for.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+enum counter {
+    CTR_RECEIVED,        // Commands taken off a queue or ring
+    CTR_REJECTED,        // Dropped because the client's queue was full
+    CTR_TIMEOUTS,        // Children killed for running past TIMEOUT
+    CTR_LOG_DROPPED,     // Log lines lost to a full log ring
+    CTR_SPAWN_DIRECT,    // Commands exec'd without bash
+    CTR_SPAWN_SHELL,     // Commands that needed bash
+    CTR_BUILTIN,         // Commands run in-process by builtins.c
+    CTR_CACHE_HIT,       // Shell commands answered from the result cache
+    CTR_CACHE_MISS,      // Cacheable shell commands that had to run
+    CTR_COALESCED,       // Commands answered with an identical one's output
+    CTR_LIMIT_KILLED,    // Children killed by a resource limit rather than the timeout
+    CTR_EXPIRED,         // Clients reclaimed after dying without EXIT
+    CTR_JOURNAL_RECORDS, // Commands written to the journal
+    CTR_JOURNAL_COMMITS, // msyncs of the journal, each covering many records
+    CTR_GATEWAY_ACCEPTED,// Gateway connections accepted
+    CTR_GATEWAY_CLOSED,  // and closed
+    CTR_COUNT
+};
+
+enum histogram {
+    HIST_DISPATCH,       // Receipt to the scheduler queue
+    HIST_QUEUE_WAIT,     // Pool hand-off to a worker picking it up
+    HIST_REGISTRY_LOCK,  // Time a registry shard lock is held
+    HIST_CHILD_RUN,      // Fork to reap of shell commands
+    HIST_SCHED_WAIT,     // Time in the client's scheduler queue
+    HIST_CONTROL_WAIT,   // Control lane hand-off to a worker picking it up
+    HIST_CHILD_CPU,      // User plus system CPU time of shell commands
+    HIST_JOURNAL_COMMIT, // One group commit's msync
+    HIST_EXEC,           // Worker time per opcode, HIST_EXEC + opcode
+    HIST_COUNT = HIST_EXEC + OP_COUNT
+};
+
+int64_t metrics_now(void);
+void metrics_count(enum counter c, int64_t n);
+void metrics_record(int h, int64_t ns);
+void metrics_since(int h, int64_t start_ns);
+int metrics_report(char *buf, int size);
+
+int log_start(void);
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_write(const char *text, int len);
+void log_flush(void);
+
+#endif
@@ -0,0 +1,350 @@
+/* Worker pool with per-worker deques and work stealing.
+
+Each worker serves its own deque from the head (oldest first). When it runs
+dry it steals from the tail of the other workers' deques before going to sleep.
+The control lane is a plain ring of copied commands under idle_lock; it is
+checked before any deque, and its reserved workers wait on a condition of
+their own so bulk submissions never wake them. A client's control commands
+run one at a time in the order they came: a thread skips past those whose
+client already has one running, and picks them up once it has finished.
+Slots for struct command_args are carved out of one array at startup and kept
+on a free list, so the receive loop never calls malloc or pthread_create.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+// One worker's queue of pending commands (ring buffer)
+struct deque {
+    pthread_mutex_t lock;
+    struct command_args **items;
+    int head;    // Next item the owner takes
+    int count;
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    struct deque dq;
+};
+
+static struct worker *workers;
+static int worker_count;
+static int deque_depth;
+static pool_release_fn released;
+static unsigned int next_worker = 0;  // Round-robin cursor for pool_submit
+
+// Free list of preallocated command slots
+static struct command_args *slots;
+static struct command_args **free_slots;
+static int free_count;
+static int slot_count;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Idle workers sleep here until something is submitted
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int pending = 0;  // Commands sitting in any deque
+
+// Control lane, guarded by idle_lock
+static struct command_args *control_items;
+static int control_head = 0;
+static int control_count = 0;
+static int control_workers;
+static int control_running = 0;   // Control commands being executed
+static int *control_pids;         // Per thread: client whose control command it runs, 0 if none
+static pthread_cond_t control_cond = PTHREAD_COND_INITIALIZER;  // Reserved workers wait here
+static pthread_cond_t control_room = PTHREAD_COND_INITIALIZER;  // Submitters wait for space
+
+// Push to the tail of a deque; returns -1 if it is full
+static int deque_push(struct deque *dq, struct command_args *args) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == deque_depth) {
+        pthread_mutex_unlock(&dq->lock);
+        return -1;
+    }
+    dq->items[(dq->head + dq->count) % deque_depth] = args;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// Owner side: take the oldest command
+static struct command_args *deque_pop(struct deque *dq) {
+    struct command_args *args = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        args = dq->items[dq->head];
+        dq->head = (dq->head + 1) % deque_depth;
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return args;
+}
+
+// Thief side: take the newest command so we don't fight the owner for the head
+static struct command_args *deque_steal(struct deque *dq) {
+    struct command_args *args = NULL;
+    if (pthread_mutex_trylock(&dq->lock) != 0) {
+        return NULL;  // Owner or another thief is busy with it, try elsewhere
+    }
+    if (dq->count > 0) {
+        dq->count--;
+        args = dq->items[(dq->head + dq->count) % deque_depth];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return args;
+}
+
+// Find work: own deque first, then the others
+static struct command_args *find_work(struct worker *self) {
+    struct command_args *args = deque_pop(&self->dq);
+    for (int i = 1; args == NULL && i < worker_count; i++) {
+        args = deque_steal(&workers[(self->index + i) % worker_count].dq);
+    }
+    return args;
+}
+
+// Position (from the head) of the oldest control command whose client has
+// none running, or -1. Caller holds idle_lock.
+static int control_next(void) {
+    for (int k = 0; k < control_count; k++) {
+        int pid = control_items[(control_head + k) % POOL_CONTROL_DEPTH].client_pid;
+        int running = 0;
+        for (int t = 0; t < worker_count + control_workers && !running; t++) {
+            running = control_pids[t] == pid;
+        }
+        if (!running) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+// Copy out control command k, close the gap behind it and note that thread
+// slot runs it for its client. Caller holds idle_lock.
+static void control_take(int k, int slot, struct command_args *out) {
+    *out = control_items[(control_head + k) % POOL_CONTROL_DEPTH];
+    for (; k > 0; k--) {
+        control_items[(control_head + k) % POOL_CONTROL_DEPTH] =
+            control_items[(control_head + k - 1) % POOL_CONTROL_DEPTH];
+    }
+    control_head = (control_head + 1) % POOL_CONTROL_DEPTH;
+    control_pids[slot] = out->client_pid;
+    control_running++;
+    if (__atomic_fetch_sub(&control_count, 1, __ATOMIC_RELAXED) == POOL_CONTROL_DEPTH) {
+        pthread_cond_signal(&control_room);
+    }
+}
+
+// The client's control command on thread slot is done, so the next one it
+// queued may run
+static void control_finish(int slot) {
+    pthread_mutex_lock(&idle_lock);
+    control_pids[slot] = 0;
+    control_running--;
+    if (control_count > 0) {
+        pthread_cond_signal(control_workers > 0 ? &control_cond : &idle_cond);
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// Run one control command if one may run. Returns 0 if there was none.
+static int run_control(int slot) {
+    struct command_args args;
+    if (__atomic_load_n(&control_count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&idle_lock);
+    int k = control_next();
+    if (k == -1) {
+        pthread_mutex_unlock(&idle_lock);
+        return 0;
+    }
+    control_take(k, slot, &args);
+    pthread_mutex_unlock(&idle_lock);
+    execute_command(&args);
+    control_finish(slot);
+    return 1;
+}
+
+// Reserved worker: control commands only
+static void *control_main(void *arg) {
+    int slot = (int)(intptr_t)arg;
+    struct command_args args;
+
+    while (1) {
+        pthread_mutex_lock(&idle_lock);
+        int k;
+        while ((k = control_next()) == -1) {
+            pthread_cond_wait(&control_cond, &idle_lock);
+        }
+        control_take(k, slot, &args);
+        pthread_mutex_unlock(&idle_lock);
+        execute_command(&args);
+        control_finish(slot);
+    }
+    return NULL;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *self = (struct worker *)arg;
+
+    while (1) {
+        if (run_control(self->index)) {
+            continue;
+        }
+        struct command_args *args = find_work(self);
+        if (args == NULL) {
+            pthread_mutex_lock(&idle_lock);
+            while (pending == 0 && control_next() == -1) {
+                pthread_cond_wait(&idle_cond, &idle_lock);
+            }
+            pthread_mutex_unlock(&idle_lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_lock);
+        pending--;
+        pthread_mutex_unlock(&idle_lock);
+
+        execute_command(args);
+        pool_release(args);
+        if (released) {
+            released();
+        }
+    }
+    return NULL;
+}
+
+// Start the workers and carve out the command slots
+int pool_init(int count, int control, int depth, pool_release_fn on_release) {
+    worker_count = count;
+    control_workers = control;
+    deque_depth = depth;
+    released = on_release;
+
+    int total = count * depth;
+    workers = calloc(count, sizeof(struct worker));
+    slots = calloc(total, sizeof(struct command_args));
+    free_slots = calloc(total, sizeof(struct command_args *));
+    control_items = calloc(POOL_CONTROL_DEPTH, sizeof(struct command_args));
+    control_pids = calloc(count + control, sizeof(int));
+    if (!workers || !slots || !free_slots || !control_items || !control_pids) {
+        perror("calloc failed");
+        return -1;
+    }
+    for (int i = 0; i < total; i++) {
+        free_slots[i] = &slots[i];
+    }
+    free_count = total;
+    slot_count = total;
+
+    for (int i = 0; i < count; i++) {
+        workers[i].index = i;
+        pthread_mutex_init(&workers[i].dq.lock, NULL);
+        workers[i].dq.items = calloc(depth, sizeof(struct command_args *));
+        if (!workers[i].dq.items) {
+            perror("calloc failed");
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create failed");
+            return -1;
+        }
+        pthread_detach(workers[i].thread);
+    }
+    for (int i = 0; i < control; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, control_main, (void *)(intptr_t)(count + i)) != 0) {
+            perror("pthread_create failed");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    printf("Worker pool started: %d workers, %d slots, %d control workers\n", count, total, control);
+    return 0;
+}
+
+// Take up to n free command slots under one lock. Returns how many were
+// free, possibly 0; the caller keeps the rest until a slot is released.
+int pool_acquire(struct command_args **out, int n) {
+    pthread_mutex_lock(&free_lock);
+    int got = n < free_count ? n : free_count;
+    for (int i = 0; i < got; i++) {
+        out[i] = free_slots[--free_count];
+    }
+    pthread_mutex_unlock(&free_lock);
+    return got;
+}
+
+// Return a slot to the free list
+void pool_release(struct command_args *args) {
+    pthread_mutex_lock(&free_lock);
+    free_slots[free_count++] = args;
+    pthread_mutex_unlock(&free_lock);
+}
+
+// Hand filled slots to the workers in turn, waking them once for the whole
+// batch. The slots came from pool_acquire, so each one fits in some deque.
+void pool_submit(struct command_args **args, int n) {
+    unsigned int start = __atomic_fetch_add(&next_worker, n, __ATOMIC_RELAXED);
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < worker_count; i++) {
+            if (deque_push(&workers[(start + j + i) % worker_count].dq, args[j]) == 0) {
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    pending += n;
+    if (n == 1) {
+        pthread_cond_signal(&idle_cond);
+    } else {
+        pthread_cond_broadcast(&idle_cond);
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// Queue a copy of a registry command on the control lane, waiting if it is
+// full. A reserved worker picks it up; ordinary workers are only woken when
+// there is more than the reserved ones can take at once.
+void pool_submit_control(const struct command_args *args) {
+    pthread_mutex_lock(&idle_lock);
+    while (control_count == POOL_CONTROL_DEPTH) {
+        pthread_cond_wait(&control_room, &idle_lock);
+    }
+    control_items[(control_head + control_count) % POOL_CONTROL_DEPTH] = *args;
+    __atomic_add_fetch(&control_count, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&control_cond);
+    if (control_count > control_workers) {
+        pthread_cond_signal(&idle_cond);
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// Commands handed to the pool and not finished with: in a deque, on the
+// control lane or running. A shell command counts until its worker has passed
+// it to the supervisor.
+int pool_busy(void) {
+    pthread_mutex_lock(&free_lock);
+    int busy = slot_count - free_count;
+    pthread_mutex_unlock(&free_lock);
+    pthread_mutex_lock(&idle_lock);
+    busy += control_count + control_running;
+    pthread_mutex_unlock(&idle_lock);
+    return busy;
+}
+
+int pool_size(void) {
+    return worker_count;
+}
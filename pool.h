@@ -0,0 +1,36 @@
+/* Fixed-size worker pool for executing client commands.
+
+The pool is started once at boot. Every worker owns a small deque of pending
+commands; the receive loop hands new commands out round-robin and idle workers
+steal from their neighbours, so one slow command does not hold up the others
+queued behind it. Command arguments live in preallocated slots that are reused
+instead of being malloc'd and freed for every message.
+
+Registry commands take a separate control lane: a FIFO served by a few
+reserved workers that never run shell commands, so their latency does not
+depend on how much shell work is queued. The ordinary workers also take from
+the control lane first whenever they look for work. Control commands from one
+client still run one after another, in the order they were submitted.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "server.h"
+
+#define POOL_DEFAULT_DEPTH 64   // Deque slots per worker
+#define POOL_CONTROL_DEPTH 256  // Commands queued on the control lane
+
+// Called by a worker each time it frees a slot, so whoever feeds the pool can
+// top it up
+typedef void (*pool_release_fn)(void);
+
+int pool_init(int workers, int control_workers, int depth, pool_release_fn on_release);
+int pool_acquire(struct command_args **out, int n);
+void pool_submit(struct command_args **args, int n);
+void pool_release(struct command_args *args);
+void pool_submit_control(const struct command_args *args);
+int pool_busy(void);
+int pool_size(void);
+
+#endif
@@ -0,0 +1,194 @@
+/* Message formats shared by the client and the server.
+
+Requests travel to the server as msg_type MSG_TYPE_CONTROL (1) or
+MSG_TYPE_BULK (2). Registry commands go as control and shell commands as bulk;
+the server receives with msgtyp -MSG_TYPE_BULK, which takes the lowest type
+first, so control requests overtake shell work already waiting in the queue.
+Old clients send everything as 1.
+
+The server may spread intake over several request queues (shards), each with
+its own receiver thread. MSG_QUEUE_KEY is only the rendezvous: a client sends
+OP_HELLO there and the reply lists the queue ids of all shards; the client
+then sends everything to shard shard_for_pid(pid, count). Old clients that
+skip the handshake simply stay on the first shard.
+
+Everything the server sends back (command output, acknowledgements, the
+SHUTDOWN broadcast) is a reply_buffer addressed to the client's PID as
+msg_type, so each client only ever receives its own replies.
+
+Each client owns a reply queue with key REPLY_QUEUE_KEY(pid). Keeping replies
+off the request queue means a client that stops reading can only fill its own
+queue; everyone else's output and new commands keep flowing. Clients that do
+not create a reply queue get their replies on the request queue as before.
+
+Requests are binary: a fixed wire_header (magic, version, opcode, client PID,
+sequence number, payload length) followed by the payload, and only that many
+bytes are sent. OP_BATCH packs up to BATCH_MAX commands into one request. Built-in commands travel as opcodes so the server dispatches
+them with a table lookup. The old "PID command" text format is still accepted;
+neither byte of WIRE_MAGIC is an ASCII digit, which is how the server tells
+the two apart.
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_CMD_LEN 256
+#define WIRE_MAX_PAYLOAD 2048   // Largest request payload (a full batch)
+#define BATCH_MAX 64            // Commands packed into one OP_BATCH request
+#define MSG_QUEUE_KEY 12345
+#define MSG_TYPE_CONTROL 1   // Request priorities; both below any client PID
+#define MSG_TYPE_BULK 2
+#define MAX_SHARDS 64        // Request queues a server can spread intake over
+#define REPLY_CHUNK 1024   // Largest piece of output sent in one reply message
+#define REPLY_QUEUE_KEY(pid) (0x52000000 | (pid))  // PIDs fit in 22 bits
+
+// Reply flags
+#define REPLY_END      0x1  // Last chunk for this command; status is valid
+#define REPLY_SHUTDOWN 0x2  // Server is going away
+#define REPLY_USAGE    0x4  // With REPLY_END: data ends with a reply_usage, not part of the output
+
+// Message structure for the message queue (text protocol)
+struct msg_buffer {
+    long msg_type;
+    char msg_text[MAX_CMD_LEN];
+};
+
+#define WIRE_MAGIC 0xC35A
+#define WIRE_VERSION 1
+
+// Request opcodes
+enum opcode {
+    OP_SHELL,      // Payload is a shell command
+    OP_LIST,
+    OP_HIDE,
+    OP_UNHIDE,
+    OP_EXIT,
+    OP_CHPT,       // Payload is the new prompt
+    OP_STATUS,
+    OP_SHUTDOWN,
+    OP_BATCH,      // Payload is a run of batch_entry records
+    OP_STATS,      // Server metrics
+    OP_HELLO,      // Reply data is the shards' queue ids, one int each
+    OP_PING,       // Heartbeat: renews the client's lease, gets no reply
+    OP_JOB,        // Payload is a job spec (see job.h), up to WIRE_MAX_PAYLOAD bytes
+    OP_COUNT
+};
+
+struct wire_header {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    int32_t client_pid;
+    uint32_t seq;      // Chosen by the client, echoed in every reply chunk
+    uint32_t len;      // Payload bytes that follow, without a terminating NUL
+};
+
+// Registry commands that finish in microseconds. These run on the server's
+// control lane instead of queueing behind shell commands. OP_JOB only queues
+// its steps there, which go through the scheduler as shell commands.
+static inline int opcode_is_control(int opcode) {
+    return opcode != OP_SHELL && opcode != OP_BATCH;
+}
+
+// Request queue (index into the OP_HELLO reply) a client should use
+static inline int shard_for_pid(int pid, int count) {
+    unsigned int h = (unsigned int)pid * 2654435761u;
+    return (h ^ (h >> 16)) % count;
+}
+
+// Binary request; only WIRE_SIZE(hdr.len) bytes after msg_type are sent
+struct wire_msg {
+    long msg_type;
+    struct wire_header hdr;
+    char payload[WIRE_MAX_PAYLOAD];
+};
+
+// One command inside an OP_BATCH payload, followed by len payload bytes.
+// Entry i is answered with sequence number hdr.seq + i.
+struct batch_entry {
+    uint8_t opcode;
+    uint8_t reserved;
+    uint16_t len;
+};
+
+// Longest JOB spec: it may fill a request on its own
+#define MAX_JOB_LEN (WIRE_MAX_PAYLOAD - sizeof(struct batch_entry))
+
+#define WIRE_SIZE(len) (sizeof(struct wire_header) + (len))
+
+// Map a typed command to its opcode. *arg is set to the payload to send:
+// the new prompt for CHPT, the steps for JOB, the whole command for OP_SHELL,
+// otherwise "".
+static inline int opcode_for_name(const char *cmd, const char **arg) {
+    static const struct {
+        const char *name;
+        int opcode;
+    } names[] = {
+        { "LIST", OP_LIST },
+        { "HIDE", OP_HIDE },
+        { "UNHIDE", OP_UNHIDE },
+        { "EXIT", OP_EXIT },
+        { "status", OP_STATUS },
+        { "shutdown", OP_SHUTDOWN },
+        { "STATS", OP_STATS },
+    };
+
+    if (strncmp(cmd, "CHPT", 4) == 0) {
+        *arg = cmd + 4;
+        while (**arg == ' ') (*arg)++;
+        return OP_CHPT;
+    }
+    if (strncmp(cmd, "JOB", 3) == 0 && (cmd[3] == ' ' || cmd[3] == '\0')) {
+        *arg = cmd + 3;
+        while (**arg == ' ') (*arg)++;
+        return OP_JOB;
+    }
+    *arg = "";
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(cmd, names[i].name) == 0) {
+            return names[i].opcode;
+        }
+    }
+    *arg = cmd;
+    return OP_SHELL;
+}
+
+// What a shell command's process used, from wait4()
+struct reply_usage {
+    uint32_t user_us;     // CPU time
+    uint32_t sys_us;
+    uint32_t maxrss_kb;   // Peak resident set of the largest process
+};
+
+// One chunk of a reply; only the first len bytes of data are sent
+struct reply_buffer {
+    long msg_type;   // Client PID
+    int flags;
+    unsigned int seq;  // Sequence number of the request being answered
+    int status;      // Exit status of the command, set with REPLY_END
+    int len;
+    char data[REPLY_CHUNK + sizeof(struct reply_usage)];
+};
+
+// Take the usage trailer off a reply that has one. Returns 1 if it did.
+static inline int reply_take_usage(struct reply_buffer *reply, struct reply_usage *usage) {
+    if (!(reply->flags & REPLY_USAGE) || reply->len < (int)sizeof(*usage)) {
+        return 0;
+    }
+    reply->len -= sizeof(*usage);
+    memcpy(usage, reply->data + reply->len, sizeof(*usage));
+    return 1;
+}
+
+// Size to pass to msgsnd for a reply carrying len bytes
+#define REPLY_SIZE(len) (offsetof(struct reply_buffer, data) - sizeof(long) + (len))
+
+// Slot sizes of the shared-memory request ring and a client's reply ring
+#define REQUEST_RING_SLOT_SIZE WIRE_SIZE(WIRE_MAX_PAYLOAD)
+#define REPLY_RING_SLOT_SIZE (sizeof(struct reply_buffer) - sizeof(long))
+
+#endif
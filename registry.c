@@ -0,0 +1,331 @@
+/* Sharded, open-addressing client registry.
+
+A PID is hashed once to pick its shard and its home slot. Each shard is a
+linear-probing table guarded by its own mutex; removed entries leave a
+tombstone so probe chains stay intact, and a shard is rebuilt at twice the
+size once live entries plus tombstones pass 3/4 of its capacity. LIST takes a
+snapshot one shard at a time, so a writer is only ever held up by the copy of
+a single shard rather than the whole walk.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "registry.h"
+#include "shmring.h"
+#include "metrics.h"
+
+#define INITIAL_CAPACITY 16   // Slots per shard, power of two
+#define EMPTY 0
+#define TOMBSTONE -1
+
+struct shard {
+    pthread_mutex_t lock;
+    struct client_record *slots;
+    int capacity;
+    int used;     // Live entries
+    int removed;  // Tombstones
+};
+
+static struct shard shards[REGISTRY_SHARDS];
+static int max_clients = 0;   // 0 = no limit
+static int client_count = 0;
+static unsigned long long version = 0;   // Bumped by every change LIST can see
+
+static unsigned int hash_pid(int pid) {
+    unsigned int h = (unsigned int)pid * 2654435761u;  // Knuth's multiplicative hash
+    return h ^ (h >> 16);
+}
+
+// Lock a shard. Returns when the lock was taken, for unlock_shard to time the hold.
+static int64_t lock_shard(struct shard *sh) {
+    pthread_mutex_lock(&sh->lock);
+    return metrics_now();
+}
+
+static void unlock_shard(struct shard *sh, int64_t locked_at) {
+    int64_t held = metrics_now() - locked_at;
+    pthread_mutex_unlock(&sh->lock);
+    metrics_record(HIST_REGISTRY_LOCK, held);
+}
+
+static struct shard *shard_for(int pid) {
+    return &shards[hash_pid(pid) & (REGISTRY_SHARDS - 1)];
+}
+
+// Find the slot holding pid, or NULL. Caller holds the shard lock.
+static struct client_record *find_slot(struct shard *sh, int pid) {
+    unsigned int mask = sh->capacity - 1;
+    unsigned int i = (hash_pid(pid) / REGISTRY_SHARDS) & mask;
+    while (sh->slots[i].pid != EMPTY) {
+        if (sh->slots[i].pid == pid) {
+            return &sh->slots[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Rebuild a shard's table with the given capacity, dropping tombstones
+static int rehash(struct shard *sh, int capacity) {
+    struct client_record *slots = calloc(capacity, sizeof(struct client_record));
+    if (!slots) {
+        perror("calloc failed");
+        return -1;
+    }
+    unsigned int mask = capacity - 1;
+    for (int j = 0; j < sh->capacity; j++) {
+        struct client_record *rec = &sh->slots[j];
+        if (rec->pid == EMPTY || rec->pid == TOMBSTONE) {
+            continue;
+        }
+        unsigned int i = (hash_pid(rec->pid) / REGISTRY_SHARDS) & mask;
+        while (slots[i].pid != EMPTY) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = *rec;
+    }
+    free(sh->slots);
+    sh->slots = slots;
+    sh->capacity = capacity;
+    sh->removed = 0;
+    return 0;
+}
+
+int registry_init(int limit) {
+    max_clients = limit;
+    for (int s = 0; s < REGISTRY_SHARDS; s++) {
+        pthread_mutex_init(&shards[s].lock, NULL);
+        shards[s].slots = calloc(INITIAL_CAPACITY, sizeof(struct client_record));
+        if (!shards[s].slots) {
+            perror("calloc failed");
+            return -1;
+        }
+        shards[s].capacity = INITIAL_CAPACITY;
+    }
+    return 0;
+}
+
+// Add a client. Returns REG_ADDED, REG_EXISTS, REG_INVALID, or REG_FULL when
+// the configured limit is reached (or memory runs out).
+int registry_add(int pid) {
+    if (pid <= 0) {
+        return REG_INVALID;
+    }
+    struct shard *sh = shard_for(pid);
+    int64_t locked_at = lock_shard(sh);
+
+    if (find_slot(sh, pid) != NULL) {
+        unlock_shard(sh, locked_at);
+        return REG_EXISTS;
+    }
+    // Claim a place under the limit first so shards racing each other cannot overshoot it
+    if (__atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED) > max_clients && max_clients > 0) {
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+        unlock_shard(sh, locked_at);
+        return REG_FULL;
+    }
+    if ((sh->used + sh->removed + 1) * 4 > sh->capacity * 3) {
+        // Grow if mostly live entries, otherwise just clear the tombstones
+        int capacity = (sh->used + 1) * 2 > sh->capacity ? sh->capacity * 2 : sh->capacity;
+        if (rehash(sh, capacity) == -1) {
+            __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+            unlock_shard(sh, locked_at);
+            return REG_FULL;
+        }
+    }
+
+    // Reuse the first tombstone on the probe chain, if any
+    unsigned int mask = sh->capacity - 1;
+    unsigned int i = (hash_pid(pid) / REGISTRY_SHARDS) & mask;
+    while (sh->slots[i].pid != EMPTY && sh->slots[i].pid != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (sh->slots[i].pid == TOMBSTONE) {
+        sh->removed--;
+    }
+    memset(&sh->slots[i], 0, sizeof(struct client_record));
+    sh->slots[i].pid = pid;
+    sh->used++;
+    __atomic_add_fetch(&version, 1, __ATOMIC_RELEASE);
+
+    unlock_shard(sh, locked_at);
+    return REG_ADDED;
+}
+
+// Remove a client, dropping the registry's hold on its reply ring. Returns 1
+// if it was registered.
+int registry_remove(int pid) {
+    struct shard *sh = shard_for(pid);
+    int64_t locked_at = lock_shard(sh);
+    struct client_record *rec = find_slot(sh, pid);
+    struct shm_ring *ring = NULL;
+    if (rec) {
+        ring = rec->ring;
+        rec->ring = NULL;
+        rec->pid = TOMBSTONE;
+        sh->used--;
+        sh->removed++;
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&version, 1, __ATOMIC_RELEASE);
+    }
+    unlock_shard(sh, locked_at);
+    if (ring) {
+        ring_detach(ring);  // Unmapped once replies still being sent let go
+    }
+    return rec != NULL;
+}
+
+// Set the hidden flag. Returns the previous value, or -1 if not registered.
+int registry_set_hidden(int pid, int hidden) {
+    struct shard *sh = shard_for(pid);
+    int64_t locked_at = lock_shard(sh);
+    struct client_record *rec = find_slot(sh, pid);
+    int old = -1;
+    if (rec) {
+        old = rec->hidden;
+        rec->hidden = hidden;
+        __atomic_add_fetch(&version, 1, __ATOMIC_RELEASE);
+    }
+    unlock_shard(sh, locked_at);
+    return old;
+}
+
+// Store a client's prompt. Returns -1 if not registered.
+int registry_set_prompt(int pid, const char *prompt) {
+    struct shard *sh = shard_for(pid);
+    int64_t locked_at = lock_shard(sh);
+    struct client_record *rec = find_slot(sh, pid);
+    if (rec) {
+        strncpy(rec->prompt, prompt, PROMPT_LEN - 1);
+        rec->prompt[PROMPT_LEN - 1] = '\0';
+    }
+    unlock_shard(sh, locked_at);
+    return rec ? 0 : -1;
+}
+
+// Remember a client's attached reply ring, taking over the caller's
+// reference. Returns -1 if not registered.
+int registry_set_ring(int pid, struct shm_ring *ring) {
+    struct shard *sh = shard_for(pid);
+    int64_t locked_at = lock_shard(sh);
+    struct client_record *rec = find_slot(sh, pid);
+    if (rec) {
+        rec->ring = ring;
+    }
+    unlock_shard(sh, locked_at);
+    return rec ? 0 : -1;
+}
+
+// A client's reply ring, or NULL if it has none (or is not registered). Only
+// good for checking whether there is one; to send to it, hold it.
+struct shm_ring *registry_get_ring(int pid) {
+    struct shard *sh = shard_for(pid);
+    int64_t locked_at = lock_shard(sh);
+    struct client_record *rec = find_slot(sh, pid);
+    struct shm_ring *ring = rec ? rec->ring : NULL;
+    unlock_shard(sh, locked_at);
+    return ring;
+}
+
+// A client's reply ring with a reference taken for the caller, who drops it
+// with ring_detach(); NULL if it has none
+struct shm_ring *registry_hold_ring(int pid) {
+    struct shard *sh = shard_for(pid);
+    int64_t locked_at = lock_shard(sh);
+    struct client_record *rec = find_slot(sh, pid);
+    struct shm_ring *ring = rec ? rec->ring : NULL;
+    if (ring) {
+        ring_hold(ring);
+    }
+    unlock_shard(sh, locked_at);
+    return ring;
+}
+
+int registry_count(void) {
+    return __atomic_load_n(&client_count, __ATOMIC_RELAXED);
+}
+
+// Changes with every add, remove or hide/unhide, so two equal values mean
+// LIST would print the same thing
+unsigned long long registry_version(void) {
+    return __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+}
+
+// Copy out the records of every registered client into a malloc'd array the
+// caller frees, one shard at a time. Returns how many, or -1.
+int registry_export(struct client_record **records) {
+    int size = registry_count() + REGISTRY_SHARDS;
+    int count = 0;
+    struct client_record *out = malloc(size * sizeof(struct client_record));
+    if (!out) {
+        perror("malloc failed");
+        return -1;
+    }
+
+    for (int s = 0; s < REGISTRY_SHARDS; s++) {
+        struct shard *sh = &shards[s];
+        int64_t locked_at = lock_shard(sh);
+        if (count + sh->used > size) {
+            size = (count + sh->used) * 2;
+            struct client_record *grown = realloc(out, size * sizeof(struct client_record));
+            if (!grown) {
+                unlock_shard(sh, locked_at);
+                perror("realloc failed");
+                free(out);
+                return -1;
+            }
+            out = grown;
+        }
+        for (int i = 0; i < sh->capacity; i++) {
+            if (sh->slots[i].pid > 0) {
+                out[count++] = sh->slots[i];
+            }
+        }
+        unlock_shard(sh, locked_at);
+    }
+
+    *records = out;
+    return count;
+}
+
+// Copy out registered PIDs (optionally skipping hidden clients) into a
+// malloc'd array the caller frees. Each shard is locked only while it is
+// copied. Returns the number of PIDs, or -1 on allocation failure.
+int registry_snapshot(int **pids, int visible_only) {
+    int size = registry_count() + REGISTRY_SHARDS;
+    int count = 0;
+    int *out = malloc(size * sizeof(int));
+    if (!out) {
+        perror("malloc failed");
+        return -1;
+    }
+
+    for (int s = 0; s < REGISTRY_SHARDS; s++) {
+        struct shard *sh = &shards[s];
+        int64_t locked_at = lock_shard(sh);
+        if (count + sh->used > size) {
+            size = (count + sh->used) * 2;
+            int *grown = realloc(out, size * sizeof(int));
+            if (!grown) {
+                unlock_shard(sh, locked_at);
+                perror("realloc failed");
+                free(out);
+                return -1;
+            }
+            out = grown;
+        }
+        for (int i = 0; i < sh->capacity; i++) {
+            struct client_record *rec = &sh->slots[i];
+            if (rec->pid > 0 && !(visible_only && rec->hidden)) {
+                out[count++] = rec->pid;
+            }
+        }
+        unlock_shard(sh, locked_at);
+    }
+
+    *pids = out;
+    return count;
+}
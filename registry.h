@@ -0,0 +1,47 @@
+/* Client registry: every connected client, keyed by PID.
+
+The registry is split into shards, each an open-addressing hash table with
+its own lock, so register/lookup/remove are O(1) and clients on different
+shards never contend. Tables grow as clients arrive; there is no fixed
+client limit unless one is configured. A client's hidden flag and prompt live
+in the same record as its PID, along with its reply ring when it talks to us
+over the shared-memory transport. The registry holds a reference to the ring
+and drops it when the client is removed; whoever is still sending to the
+client took a reference of its own with registry_hold_ring().
+*/
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#define REGISTRY_SHARDS 16   // Power of two
+#define PROMPT_LEN 48
+
+struct shm_ring;
+
+struct client_record {
+    int pid;                 // 0 = empty slot, -1 = removed
+    int hidden;
+    char prompt[PROMPT_LEN];
+    struct shm_ring *ring;   // Attached reply ring, or NULL
+};
+
+// Results of registry_add
+#define REG_ADDED 1
+#define REG_EXISTS 0
+#define REG_FULL -1
+#define REG_INVALID -2   // PID <= 0; those values mark empty and removed slots
+
+int registry_init(int max_clients);
+int registry_add(int pid);
+int registry_remove(int pid);
+int registry_set_hidden(int pid, int hidden);
+int registry_set_prompt(int pid, const char *prompt);
+int registry_set_ring(int pid, struct shm_ring *ring);
+struct shm_ring *registry_get_ring(int pid);
+struct shm_ring *registry_hold_ring(int pid);
+int registry_count(void);
+unsigned long long registry_version(void);
+int registry_snapshot(int **pids, int visible_only);
+int registry_export(struct client_record **records);
+
+#endif
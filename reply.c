@@ -0,0 +1,230 @@
+/* Per-client reply channel.
+
+Replies go to the client's connection if it came in through the gateway, to
+its reply ring if it uses the shared-memory transport, otherwise to its own
+reply queue (the request queue for clients that did not create one),
+addressed to the client's PID as msg_type. Output is cut
+into REPLY_CHUNK sized messages. Workers send with a bounded retry so a client
+that stops reading cannot hold a worker forever; the supervisor sends with
+nowait and handles EAGAIN itself.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#include "server.h"
+#include "registry.h"
+#include "shmring.h"
+#include "metrics.h"
+#include "cache.h"
+#include "flight.h"
+#include "job.h"
+#include "journal.h"
+#include "gateway.h"
+#include "sched.h"
+
+#define SEND_RETRIES 1000     // Retries of 1 ms each before a reply is dropped
+
+// Old clients read replies from the request queue. Never let replies take
+// more than half of it, so commands from other clients can still get in.
+static int shared_queue_full(int len) {
+    struct msqid_ds info;
+    if (msgctl(msgid, IPC_STAT, &info) == -1) {
+        return 0;
+    }
+    return info.msg_cbytes + REPLY_SIZE(len) > info.msg_qbytes / 2;
+}
+
+// Find the queue a client reads its replies from
+int reply_queue(int client_pid) {
+    int qid = msgget(REPLY_QUEUE_KEY(client_pid), 0);
+    return qid == -1 ? msgid : qid;
+}
+
+void reply_init(struct reply *r, int client_pid) {
+    r->client_pid = client_pid;
+    r->qid = client_pid >= GATEWAY_ID_BASE ? -1 : reply_queue(client_pid);
+    r->ring = registry_hold_ring(client_pid);
+    if (!r->ring && r->qid != -1) {
+        r->ring = sched_hold_ring(client_pid);  // Sent EXIT before this command ran
+    }
+    r->flags = 0;
+    r->seq = 0;
+    r->status = 0;
+    r->len = 0;
+    r->fill = NULL;
+    r->flight = NULL;
+    r->job = NULL;
+    r->command = NULL;
+    r->opcode = 0;
+    r->started_ns = 0;
+    r->output_bytes = 0;
+}
+
+// Try once to hand a chunk to the client's ring or queue
+static int send_chunk(struct reply *r, struct reply_buffer *msg) {
+    if (r->client_pid >= GATEWAY_ID_BASE) {
+        return gateway_send(r->client_pid, &msg->flags, REPLY_SIZE(msg->len));
+    }
+    if (r->ring) {
+        return ring_push(r->ring, &msg->flags, REPLY_SIZE(msg->len), 0);
+    }
+    if (r->qid == msgid && shared_queue_full(msg->len)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return msgsnd(r->qid, msg, REPLY_SIZE(msg->len), IPC_NOWAIT);
+}
+
+// Send the buffered chunk to the client. With nowait, returns -1 with errno
+// EAGAIN if the queue is full.
+static int send_buffered(struct reply *r, int nowait) {
+    struct reply_buffer msg;
+    msg.msg_type = r->client_pid;
+    msg.flags = r->flags;
+    msg.seq = r->seq;
+    msg.status = r->status;
+    msg.len = r->len;
+    memcpy(msg.data, r->buf, r->len);
+    if (r->flags & REPLY_USAGE) {
+        memcpy(msg.data + msg.len, &r->usage, sizeof(r->usage));
+        msg.len += sizeof(r->usage);
+    }
+
+    for (int tries = 0; ; tries++) {
+        if (send_chunk(r, &msg) == 0) {
+            break;
+        }
+        if (errno != EAGAIN) {
+            perror("Failed to send reply");
+            break;  // Drop it; nothing better to do
+        }
+        if (nowait) {
+            return -1;
+        }
+        if (tries == SEND_RETRIES) {
+            // Make room so at least this message (which may carry END) gets through
+            log_printf("Client %d is not reading replies, dropping %d bytes\n", r->client_pid, r->len);
+            reply_purge(r);
+            if (send_chunk(r, &msg) == -1) {
+                perror("Failed to send reply");
+            }
+            break;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+// Send whatever is buffered (and the END flag if set). With nowait, returns -1
+// with errno EAGAIN if the queue is full and leaves the data buffered. A job
+// step's output is kept for the job's report instead of being sent.
+int reply_flush(struct reply *r, int nowait) {
+    if (r->len == 0 && !(r->flags & REPLY_END)) {
+        return 0;
+    }
+
+    if (r->job) {
+        job_capture(r->job, r->step, r->buf, r->len);
+    } else if (send_buffered(r, nowait) == -1) {
+        return -1;
+    }
+    r->output_bytes += r->len;
+    if (r->command && (r->flags & REPLY_END)) {
+        journal_append(r);
+        r->command = NULL;
+    }
+    if (r->fill) {
+        cache_capture(r->fill, r->buf, r->len);
+        if (r->flags & REPLY_END) {
+            cache_finish(r->fill, r->status);
+            r->fill = NULL;
+        }
+    }
+    if (r->flight) {
+        flight_capture(r->flight, r->buf, r->len);
+        if (r->flags & REPLY_END) {
+            flight_finish(r->flight, r->status, nowait);
+            r->flight = NULL;
+        }
+    }
+    if (r->job && (r->flags & REPLY_END)) {
+        job_step_done(r->job, r->step, r->status, r->flags & REPLY_USAGE ? &r->usage : NULL);
+        r->job = NULL;
+    }
+    r->len = 0;
+    return 0;
+}
+
+// Throw away the replies one client has left unread. Only messages addressed
+// to that client are touched, even on the shared request queue. Only the
+// consumer can take messages off a ring, so ring replies are left alone, as
+// is what a gateway connection has buffered (part of it may be sent already).
+void reply_purge(struct reply *r) {
+    struct reply_buffer msg;
+    if (r->ring || r->qid == -1) {
+        return;
+    }
+    int dropped = 0;
+    while (msgrcv(r->qid, &msg, sizeof(msg) - sizeof(long), r->client_pid, IPC_NOWAIT) != -1) {
+        dropped++;
+    }
+    if (dropped > 0) {
+        log_printf("Purged %d unread replies for client %d\n", dropped, r->client_pid);
+    }
+}
+
+// Append output, flushing each full chunk
+int reply_write(struct reply *r, const char *data, int len, int nowait) {
+    while (len > 0) {
+        int room = REPLY_CHUNK - r->len;
+        int n = len < room ? len : room;
+        memcpy(r->buf + r->len, data, n);
+        r->len += n;
+        data += n;
+        len -= n;
+        if (r->len == REPLY_CHUNK && reply_flush(r, nowait) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Append formatted text. It is echoed to the server log as well.
+void reply_printf(struct reply *r, const char *fmt, ...) {
+    char text[REPLY_CHUNK];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if (n >= (int)sizeof(text)) {
+        n = sizeof(text) - 1;
+    }
+    log_write(text, n);
+    reply_write(r, text, n, 0);
+}
+
+// Mark the reply complete and send the last chunk along with r->status
+int reply_finish(struct reply *r, int nowait) {
+    r->flags |= REPLY_END;
+    return reply_flush(r, nowait);
+}
+
+// Done with the reply, sent or not: let go of the client's reply ring, which
+// is unmapped once the client has left and no other reply holds it. Every
+// reply_init() is paired with one of these.
+void reply_release(struct reply *r) {
+    if (r->ring) {
+        ring_detach(r->ring);
+        r->ring = NULL;
+    }
+}
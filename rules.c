@@ -0,0 +1,238 @@
+/* Rules file parser and DFA.
+
+Every rule's word is added to a trie whose nodes carry a full 256-entry
+transition table, so each byte of a command costs one array lookup. Rules
+hang off the node their word ends at, in file order. Checking walks the
+command from the root: at each node on the way, its rules are tried against
+the byte that follows, and the first that applies wins.
+
+A reload compiles a complete new table and swaps it in under a write lock;
+checks hold the read lock only while they walk.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "rules.h"
+
+struct rule {
+    int kind;
+    int word_len;
+    int next;            // Next rule on the same node, or -1
+    char message[RULE_MESSAGE_MAX];
+};
+
+struct node {
+    int next[256];       // 0 = no transition (the root is never a target)
+    int first_rule;      // -1 if no word ends here
+};
+
+struct rule_set {
+    struct node *nodes;
+    int node_count;
+    int node_cap;
+    struct rule *rules;
+    int rule_count;
+    int rule_cap;
+};
+
+static pthread_rwlock_t rules_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct rule_set *current = NULL;
+
+static const char *const kind_names[] = { "exact", "prefix", "nospace", "exec" };
+
+static void free_set(struct rule_set *set) {
+    if (set) {
+        free(set->nodes);
+        free(set->rules);
+        free(set);
+    }
+}
+
+static int add_node(struct rule_set *set) {
+    if (set->node_count == set->node_cap) {
+        int cap = set->node_cap ? set->node_cap * 2 : 32;
+        struct node *grown = realloc(set->nodes, cap * sizeof(struct node));
+        if (!grown) {
+            return -1;
+        }
+        set->nodes = grown;
+        set->node_cap = cap;
+    }
+    memset(&set->nodes[set->node_count], 0, sizeof(struct node));
+    set->nodes[set->node_count].first_rule = -1;
+    return set->node_count++;
+}
+
+static int add_rule(struct rule_set *set, int kind, const char *word, const char *message) {
+    int state = 0;
+    for (const unsigned char *p = (const unsigned char *)word; *p; p++) {
+        if (set->nodes[state].next[*p] == 0) {
+            int n = add_node(set);
+            if (n == -1) {
+                return -1;
+            }
+            set->nodes[state].next[*p] = n;
+        }
+        state = set->nodes[state].next[*p];
+    }
+    if (set->rule_count == set->rule_cap) {
+        int cap = set->rule_cap ? set->rule_cap * 2 : 16;
+        struct rule *grown = realloc(set->rules, cap * sizeof(struct rule));
+        if (!grown) {
+            return -1;
+        }
+        set->rules = grown;
+        set->rule_cap = cap;
+    }
+    struct rule *rule = &set->rules[set->rule_count];
+    rule->kind = kind;
+    rule->word_len = strlen(word);
+    rule->next = -1;
+    strncpy(rule->message, message, RULE_MESSAGE_MAX - 1);
+    rule->message[RULE_MESSAGE_MAX - 1] = '\0';
+
+    // Keep file order among the rules of one node
+    int *link = &set->nodes[state].first_rule;
+    while (*link != -1) {
+        link = &set->rules[*link].next;
+    }
+    *link = set->rule_count++;
+    return 0;
+}
+
+// Read a double-quoted string at *p into out (size bytes) and move *p past
+// it. Returns -1 if there is none.
+static int read_quoted(char **p, char *out, int size) {
+    char *s = *p;
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    if (*s != '"') {
+        return -1;
+    }
+    char *end = strchr(s + 1, '"');
+    if (!end || end - (s + 1) >= size) {
+        return -1;
+    }
+    memcpy(out, s + 1, end - (s + 1));
+    out[end - (s + 1)] = '\0';
+    *p = end + 1;
+    return 0;
+}
+
+// Parse and compile a rules file. Returns NULL (after saying why) on error.
+static struct rule_set *compile(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    struct rule_set *set = calloc(1, sizeof(struct rule_set));
+    if (!set || add_node(set) == -1) {
+        perror("calloc failed");
+        free_set(set);
+        fclose(fp);
+        return NULL;
+    }
+
+    char line[1024];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        char *p = line;
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+        char kind_name[16];
+        char word[RULE_MESSAGE_MAX];
+        char message[RULE_MESSAGE_MAX];
+        int len = strcspn(p, " \t");
+        int kind = -1;
+        snprintf(kind_name, sizeof(kind_name), "%.*s", len, p);
+        for (int i = 0; i < (int)(sizeof(kind_names) / sizeof(kind_names[0])); i++) {
+            if (strcmp(kind_name, kind_names[i]) == 0) {
+                kind = i;
+            }
+        }
+        p += len;
+        if (kind == -1 || read_quoted(&p, word, sizeof(word)) == -1 || word[0] == '\0' ||
+            read_quoted(&p, message, sizeof(message)) == -1) {
+            fprintf(stderr, "%s:%d: expected: exact|prefix|nospace|exec \"word\" \"message\"\n", path, line_no);
+            free_set(set);
+            fclose(fp);
+            return NULL;
+        }
+        if (add_rule(set, kind, word, message) == -1) {
+            perror("realloc failed");
+            free_set(set);
+            fclose(fp);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    return set;
+}
+
+// Load the rules in path in place of the current ones. Returns -1, leaving
+// the old rules in force, if the file cannot be read or has an error.
+int rules_load(const char *path) {
+    struct rule_set *set = compile(path);
+    if (!set) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&rules_lock);
+    struct rule_set *old = current;
+    current = set;
+    pthread_rwlock_unlock(&rules_lock);
+    free_set(old);
+    printf("Loaded %d validation rules from %s\n", set->rule_count, path);
+    return 0;
+}
+
+// Does rule apply when the byte after its word is c?
+static int applies(const struct rule *rule, unsigned char c) {
+    switch (rule->kind) {
+    case RULE_EXACT:
+        return c == '\0';
+    case RULE_NOSPACE:
+        return c != '\0' && c != ' ';
+    default:
+        return 1;
+    }
+}
+
+// Find the rule that applies to cmd. Returns its kind, with its message
+// copied to message (RULE_MESSAGE_MAX bytes) and the length of its word in
+// *word_len, or RULE_NONE.
+int rules_check(const char *cmd, char *message, int *word_len) {
+    int kind = RULE_NONE;
+    pthread_rwlock_rdlock(&rules_lock);
+    if (current) {
+        const unsigned char *p = (const unsigned char *)cmd;
+        int state = 0;
+        while (kind == RULE_NONE) {
+            for (int i = current->nodes[state].first_rule; i != -1; i = current->rules[i].next) {
+                const struct rule *rule = &current->rules[i];
+                if (applies(rule, *p)) {
+                    kind = rule->kind;
+                    *word_len = rule->word_len;
+                    memcpy(message, rule->message, RULE_MESSAGE_MAX);
+                    break;
+                }
+            }
+            if (*p == '\0' || (state = current->nodes[state].next[*p]) == 0) {
+                break;
+            }
+            p++;
+        }
+    }
+    pthread_rwlock_unlock(&rules_lock);
+    return kind;
+}
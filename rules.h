@@ -0,0 +1,29 @@
+/* Command validation rules.
+
+The checks execute_in_shell() makes before running a command (missing
+arguments, a missing space after the command name, ./program that is not
+executable) come from a rules file instead of code. The file is compiled into
+a DFA over the command's bytes, so a command is classified in one pass however
+many rules there are. Sending the server SIGHUP reloads the file; commands
+being checked at that moment finish with the old rules.
+*/
+
+#ifndef RULES_H
+#define RULES_H
+
+#define RULES_DEFAULT_PATH "rules.conf"
+#define RULE_MESSAGE_MAX 256
+
+// What a matching rule asks for
+enum rule_kind {
+    RULE_NONE = -1,   // No rule matched; run the command
+    RULE_EXACT,       // Reject: the command is exactly the word
+    RULE_PREFIX,      // Reject: the command starts with the word
+    RULE_NOSPACE,     // Reject: the word is followed by something other than a space
+    RULE_EXEC         // Run the program after the word if it is executable
+};
+
+int rules_load(const char *path);
+int rules_check(const char *cmd, char *message, int *word_len);
+
+#endif
@@ -0,0 +1,551 @@
+/* Deficit round-robin over per-client queues.
+
+Clients are kept in a chained hash table keyed by PID. Those with commands
+waiting are also on a circular "active" list that the scheduler walks; a
+client leaves the list when its queue empties and its leftover credit is
+dropped, as DRR prescribes. A client at its in-flight cap is passed over
+without earning credit until one of its commands finishes.
+
+Everything is guarded by one mutex. The pool is fed from sched_pump(), which
+runs whenever a command is queued, a pool slot comes free or a command
+finishes, and stops as soon as the pool is full or nobody is eligible.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sched.h"
+#include "pool.h"
+#include "shmring.h"
+#include "metrics.h"
+#include "job.h"
+
+#define CLIENT_BUCKETS 256   // Power of two
+#define REPORT_MAX 32        // Clients listed by STATS
+
+struct sched_item {
+    struct sched_item *next;
+    int64_t queued_ns;
+    struct command_args args;
+};
+
+struct sched_client {
+    int pid;
+    int queued;
+    int inflight;
+    int deficit;
+    int credited;      // Earned this round's quantum already
+    int leaving;       // Sent EXIT; free the record once idle
+    struct shm_ring *ring;  // Held for a client that left: replies still due use it
+    int taken;         // Commands taken out for a restart; keep the record for them
+    struct sched_item *head, *tail;
+    struct sched_client *next, *prev;   // Active list
+    struct sched_client *hash_next;
+    unsigned long long served;
+    unsigned long long rejected;
+    int64_t wait_total_ns;
+    int64_t wait_max_ns;
+    int64_t cpu_ns;    // CPU time used by the client's shell commands
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sched_client *clients[CLIENT_BUCKETS];
+static struct sched_client *cursor = NULL;   // Next client on the active list
+static int active_count = 0;
+static int queued_total = 0;
+static struct sched_item *free_items = NULL;
+
+static int inflight_limit;
+static int queue_depth;
+static enum sched_policy sched_policy;
+
+static unsigned int bucket_for(int pid) {
+    unsigned int h = (unsigned int)pid * 2654435761u;
+    return (h ^ (h >> 16)) & (CLIENT_BUCKETS - 1);
+}
+
+// Find a client's record, creating it if asked. Caller holds sched_lock.
+static struct sched_client *find_client(int pid, int create) {
+    struct sched_client **head = &clients[bucket_for(pid)];
+    for (struct sched_client *c = *head; c; c = c->hash_next) {
+        if (c->pid == pid) {
+            return c;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    struct sched_client *c = calloc(1, sizeof(struct sched_client));
+    if (!c) {
+        perror("calloc failed");
+        return NULL;
+    }
+    c->pid = pid;
+    c->hash_next = *head;
+    *head = c;
+    return c;
+}
+
+// Drop a client that has left and has nothing queued or running
+static void free_if_gone(struct sched_client *c) {
+    if (!c->leaving || c->queued > 0 || c->inflight > 0 || c->taken > 0) {
+        return;
+    }
+    if (c->ring) {
+        ring_detach(c->ring);  // Stays mapped while a reply still holds it
+    }
+    struct sched_client **p = &clients[bucket_for(c->pid)];
+    while (*p != c) {
+        p = &(*p)->hash_next;
+    }
+    *p = c->hash_next;
+    free(c);
+}
+
+static void activate(struct sched_client *c) {
+    if (cursor == NULL) {
+        c->next = c->prev = c;
+        cursor = c;
+    } else {
+        // Join just behind the cursor, i.e. at the end of the current round
+        c->next = cursor;
+        c->prev = cursor->prev;
+        cursor->prev->next = c;
+        cursor->prev = c;
+    }
+    active_count++;
+}
+
+static void deactivate(struct sched_client *c) {
+    if (c->next == c) {
+        cursor = NULL;
+    } else {
+        c->prev->next = c->next;
+        c->next->prev = c->prev;
+        if (cursor == c) {
+            cursor = c->next;
+        }
+    }
+    c->next = c->prev = NULL;
+    c->deficit = 0;
+    c->credited = 0;
+    active_count--;
+}
+
+// DRR: pick the client whose command goes next and charge it, or NULL if
+// every waiting client is at its in-flight cap. A full lap plus one visit
+// covers the client under the cursor having just spent its credit.
+static struct sched_client *pick_client(void) {
+    for (int visits = 0; cursor && visits <= active_count; visits++) {
+        struct sched_client *c = cursor;
+        if (c->inflight < inflight_limit) {
+            if (!c->credited) {
+                c->deficit += SCHED_QUANTUM;
+                c->credited = 1;
+            }
+            if (c->deficit >= SCHED_COST_SHELL) {
+                c->deficit -= SCHED_COST_SHELL;
+                return c;
+            }
+        }
+        c->credited = 0;
+        cursor = c->next;
+    }
+    return NULL;
+}
+
+// Move commands into the pool while it has room. Caller holds sched_lock.
+static void pump_locked(void) {
+    struct command_args *slots[BATCH_MAX];
+    int n = 0;
+
+    struct sched_client *c;
+    while (queued_total > 0 && (c = pick_client()) != NULL) {
+        if (pool_acquire(&slots[n], 1) == 0) {
+            c->deficit += SCHED_COST_SHELL;  // Not served after all
+            break;
+        }
+        struct sched_item *item = c->head;
+        c->head = item->next;
+        if (c->head == NULL) {
+            c->tail = NULL;
+        }
+        c->queued--;
+        c->inflight++;
+        c->served++;
+        __atomic_sub_fetch(&queued_total, 1, __ATOMIC_RELAXED);
+        if (c->queued == 0) {
+            deactivate(c);
+        }
+
+        *slots[n] = item->args;
+        slots[n]->queued_ns = metrics_now();
+        int64_t waited = slots[n]->queued_ns - item->queued_ns;
+        c->wait_total_ns += waited;
+        if (waited > c->wait_max_ns) {
+            c->wait_max_ns = waited;
+        }
+        metrics_record(HIST_SCHED_WAIT, waited);
+        item->next = free_items;
+        free_items = item;
+
+        if (++n == BATCH_MAX) {
+            pool_submit(slots, n);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        pool_submit(slots, n);
+    }
+}
+
+int sched_init(int limit, int depth, enum sched_policy policy) {
+    inflight_limit = limit;
+    queue_depth = depth;
+    sched_policy = policy;
+    printf("Scheduler: %d in flight and %d queued per client (%s when full)\n",
+           limit, depth, policy == SCHED_BLOCK ? "block" : "reject");
+    return 0;
+}
+
+// Queue a command behind its client's earlier ones and feed the pool.
+// Returns -1 if it was dropped (reject policy with a full queue, or no memory).
+// Never waits: under the block policy the caller has checked sched_room (or
+// held the command back until it could), and the command goes in even past
+// the depth (the tail of a batch bigger than the whole queue).
+int sched_enqueue(const struct command_args *req) {
+    int overflow = sched_policy == SCHED_BLOCK;
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(req->client_pid, 1);
+    if (!c) {
+        pthread_mutex_unlock(&sched_lock);
+        return -1;
+    }
+    struct sched_item *item = free_items;
+    if (item) {
+        free_items = item->next;
+    } else {
+        item = malloc(sizeof(struct sched_item));
+    }
+    if ((c->queued >= queue_depth && !overflow) || !item) {
+        if (item) {
+            item->next = free_items;
+            free_items = item;
+        }
+        c->rejected++;
+        free_if_gone(c);
+        pthread_mutex_unlock(&sched_lock);
+        return -1;
+    }
+
+    item->next = NULL;
+    item->queued_ns = metrics_now();
+    item->args = *req;
+    if (c->tail) {
+        c->tail->next = item;
+    } else {
+        c->head = item;
+    }
+    c->tail = item;
+    if (c->queued++ == 0) {
+        activate(c);
+    }
+    __atomic_add_fetch(&queued_total, 1, __ATOMIC_RELAXED);
+    pump_locked();
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+// Put a command that was already let through back at the head of its
+// client's queue, giving up its in-flight place. It was admitted once, so
+// the queue depth is not checked and this never blocks. Returns -1 only if
+// memory runs out.
+int sched_requeue(const struct command_args *req) {
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(req->client_pid, 1);
+    struct sched_item *item = free_items;
+    if (item) {
+        free_items = item->next;
+    } else {
+        item = malloc(sizeof(struct sched_item));
+    }
+    if (!c || !item) {
+        free(item);
+        if (c && c->inflight > 0) {
+            c->inflight--;
+        }
+        pump_locked();
+        pthread_mutex_unlock(&sched_lock);
+        return -1;
+    }
+    if (c->inflight > 0) {
+        c->inflight--;
+    }
+    c->served--;   // Counted again when it is handed out
+    item->queued_ns = metrics_now();
+    item->args = *req;
+    item->next = c->head;
+    c->head = item;
+    if (!c->tail) {
+        c->tail = item;
+    }
+    if (c->queued++ == 0) {
+        activate(c);
+    }
+    __atomic_add_fetch(&queued_total, 1, __ATOMIC_RELAXED);
+    pump_locked();
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+// Queue a command admitted earlier: a step of a job the client has already
+// sent, or a command taken over from the server before a restart. Either way
+// it skips the depth check and this never blocks. Returns -1 if the client
+// has gone (or memory runs out).
+int sched_push(const struct command_args *req) {
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(req->client_pid, 1);
+    struct sched_item *item = free_items;
+    if (item) {
+        free_items = item->next;
+    } else {
+        item = malloc(sizeof(struct sched_item));
+    }
+    // A client that left only gets back what a failed restart took out
+    if (!c || !item || (c->leaving && (c->taken == 0 || req->job))) {
+        if (item) {
+            item->next = free_items;
+            free_items = item;
+        }
+        pthread_mutex_unlock(&sched_lock);
+        return -1;
+    }
+
+    if (c->taken > 0 && !req->job) {
+        c->taken--;
+    }
+    item->next = NULL;
+    item->queued_ns = metrics_now();
+    item->args = *req;
+    if (c->tail) {
+        c->tail->next = item;
+    } else {
+        c->head = item;
+    }
+    c->tail = item;
+    if (c->queued++ == 0) {
+        activate(c);
+    }
+    __atomic_add_fetch(&queued_total, 1, __ATOMIC_RELAXED);
+    pump_locked();
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+// Whether a client's queue has room for count more commands, for a receiver
+// that must not block on one client (it holds the commands back instead). A batch bigger than the whole queue
+// fits once the queue is empty. Always yes with the reject policy, which
+// never blocks.
+int sched_room(int client_pid, int count) {
+    if (sched_policy != SCHED_BLOCK) {
+        return 1;
+    }
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(client_pid, 0);
+    int queued = c ? c->queued : 0;
+    pthread_mutex_unlock(&sched_lock);
+    return queued == 0 || queued + count <= queue_depth;
+}
+
+// One of a client's commands has finished, freeing an in-flight place
+void sched_done(int client_pid) {
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(client_pid, 0);
+    if (c && c->inflight > 0) {
+        c->inflight--;
+        free_if_gone(c);
+    }
+    pump_locked();
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Add CPU time used by one of a client's commands to its account
+void sched_charge(int client_pid, int64_t cpu_ns) {
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(client_pid, 0);
+    if (c) {
+        c->cpu_ns += cpu_ns;
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// The client sent EXIT; its record goes once its last command is answered.
+// ring, if not NULL, is a hold on its reply ring, kept until then so that
+// commands EXIT overtook on the control lane can still answer on it.
+void sched_forget(int client_pid, struct shm_ring *ring) {
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(client_pid, 0);
+    if (c && !c->ring) {
+        c->ring = ring;
+        ring = NULL;
+    }
+    if (c) {
+        c->leaving = 1;
+        free_if_gone(c);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    if (ring) {
+        ring_detach(ring);
+    }
+}
+
+// A held reference to the reply ring of a client that sent EXIT with
+// commands still queued or running, or NULL
+struct shm_ring *sched_hold_ring(int client_pid) {
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(client_pid, 0);
+    struct shm_ring *ring = c ? c->ring : NULL;
+    if (ring) {
+        ring_hold(ring);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return ring;
+}
+
+// The client died without EXIT: throw its queued commands away and free its
+// record once nothing is running. Jobs that lose a step are cancelled.
+// Returns how many of its commands are still in flight.
+int sched_drop(int client_pid) {
+    struct sched_item *steps = NULL;
+    pthread_mutex_lock(&sched_lock);
+    struct sched_client *c = find_client(client_pid, 0);
+    int inflight = 0;
+    if (c) {
+        while (c->head) {
+            struct sched_item *item = c->head;
+            c->head = item->next;
+            if (item->args.job) {
+                item->next = steps;  // Told to the job below, outside the lock
+                steps = item;
+            } else {
+                item->next = free_items;
+                free_items = item;
+            }
+        }
+        c->tail = NULL;
+        if (c->queued > 0) {
+            __atomic_sub_fetch(&queued_total, c->queued, __ATOMIC_RELAXED);
+            c->queued = 0;
+            deactivate(c);
+        }
+        inflight = c->inflight;
+        c->leaving = 1;
+        free_if_gone(c);
+    }
+    pthread_mutex_unlock(&sched_lock);
+
+    while (steps) {
+        struct sched_item *item = steps;
+        steps = item->next;
+        job_step_done(item->args.job, item->args.step, JOB_STATUS_DROPPED, NULL);
+        free(item);
+    }
+    return inflight;
+}
+
+// Take every queued command out of the scheduler, except job steps (their
+// job is running), for a restart to hand over. Each client's commands stay
+// in order. Returns how many were put in the malloc'd *out, or -1.
+int sched_take_pending(struct command_args **out) {
+    pthread_mutex_lock(&sched_lock);
+    struct command_args *taken = malloc((queued_total + 1) * sizeof(struct command_args));
+    if (!taken) {
+        pthread_mutex_unlock(&sched_lock);
+        perror("malloc failed");
+        return -1;
+    }
+    int count = 0;
+    for (int b = 0; b < CLIENT_BUCKETS; b++) {
+        for (struct sched_client *c = clients[b]; c; c = c->hash_next) {
+            struct sched_item **link = &c->head;
+            c->tail = NULL;
+            while (*link) {
+                struct sched_item *item = *link;
+                if (item->args.job) {
+                    c->tail = item;
+                    link = &item->next;
+                    continue;
+                }
+                *link = item->next;
+                taken[count++] = item->args;
+                item->next = free_items;
+                free_items = item;
+                c->queued--;
+                c->taken++;
+                __atomic_sub_fetch(&queued_total, 1, __ATOMIC_RELAXED);
+            }
+            if (c->queued == 0 && c->next) {
+                deactivate(c);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sched_lock);
+    *out = taken;
+    return count;
+}
+
+// Commands queued or in flight, across all clients
+int sched_busy(void) {
+    pthread_mutex_lock(&sched_lock);
+    int busy = queued_total;
+    for (int b = 0; b < CLIENT_BUCKETS; b++) {
+        for (struct sched_client *c = clients[b]; c; c = c->hash_next) {
+            busy += c->inflight;
+        }
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return busy;
+}
+
+// A pool slot came free
+void sched_pump(void) {
+    if (__atomic_load_n(&queued_total, __ATOMIC_RELAXED) == 0) {
+        return;  // Anything queued after this pumps for itself
+    }
+    pthread_mutex_lock(&sched_lock);
+    pump_locked();
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Per-client queue depth, in-flight count, scheduler wait and CPU time for STATS.
+// Returns the length written.
+int sched_report(char *buf, int size) {
+    int len = 0;
+    int listed = 0;
+    int more = 0;
+
+    pthread_mutex_lock(&sched_lock);
+    len += snprintf(buf + len, size - len, "sched_queued %d\nsched_active_clients %d\n",
+                    queued_total, active_count);
+    for (int b = 0; b < CLIENT_BUCKETS && len < size; b++) {
+        for (struct sched_client *c = clients[b]; c && len < size; c = c->hash_next) {
+            if (listed == REPORT_MAX) {
+                more++;
+                continue;
+            }
+            listed++;
+            len += snprintf(buf + len, size - len,
+                            "client %-8d queued=%d inflight=%d served=%llu rejected=%llu wait_mean_us=%.1f wait_max_us=%.1f cpu_ms=%.1f\n",
+                            c->pid, c->queued, c->inflight, c->served, c->rejected,
+                            c->served ? c->wait_total_ns / 1000.0 / c->served : 0.0,
+                            c->wait_max_ns / 1000.0, c->cpu_ns / 1e6);
+        }
+    }
+    if (more > 0 && len < size) {
+        len += snprintf(buf + len, size - len, "(%d more clients)\n", more);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,46 @@
+/* Per-client fair scheduling in front of the worker pool.
+
+Commands are queued per client instead of going straight into the pool, and
+the scheduler feeds the pool with deficit round-robin across the clients that
+have work waiting: each turn a client earns SCHED_QUANTUM credit and spends it
+on its commands. Only shell commands are queued here (registry commands take
+the pool's control lane), so they all cost SCHED_COST_SHELL. A client also
+has a cap on commands in flight (handed to the pool and not yet finished,
+which for a shell command means its child has exited), so one client
+streaming thousands of commands cannot fill the workers or the child table
+while the others wait behind it.
+*/
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+#include "server.h"
+
+#define SCHED_DEFAULT_QUEUE 256   // Commands queued per client
+#define SCHED_QUANTUM 4           // Credit a client earns per round
+#define SCHED_COST_SHELL 4        // A shell command spawns a process
+
+// What to do when a client's queue is full
+enum sched_policy {
+    SCHED_BLOCK,    // Hold the client's further commands until there is room
+    SCHED_REJECT    // Drop the command and report it
+};
+
+int sched_init(int inflight_limit, int queue_depth, enum sched_policy policy);
+int sched_enqueue(const struct command_args *req);
+int sched_requeue(const struct command_args *req);
+int sched_push(const struct command_args *req);
+int sched_room(int client_pid, int count);
+void sched_done(int client_pid);
+void sched_charge(int client_pid, int64_t cpu_ns);
+void sched_forget(int client_pid, struct shm_ring *ring);
+struct shm_ring *sched_hold_ring(int client_pid);
+int sched_drop(int client_pid);
+int sched_take_pending(struct command_args **out);
+int sched_busy(void);
+void sched_pump(void);
+int sched_report(char *buf, int size);
+
+#endif
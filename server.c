@@ -13,6 +13,8 @@ commands independently.
 // COMPILE: gcc -o server server.c -lpthread (ONLY ADD IF ONE WINDOWS)-lrt 
 // RUN: ./server
 
+#define _GNU_SOURCE  // pipe2, pthread_setaffinity_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -23,76 +25,380 @@ commands independently.
 #include <signal.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "server.h"
+#include "pool.h"
+#include "sched.h"
+#include "supervisor.h"
+#include "registry.h"
+#include "shmring.h"
+#include "metrics.h"
+#include "executor.h"
+#include "builtins.h"
+#include "cache.h"
+#include "flight.h"
+#include "rules.h"
+#include "isolate.h"
+#include "lease.h"
+#include "job.h"
+#include "journal.h"
+#include "handoff.h"
+#include "gateway.h"
+#include "clientlib.h"
 
-#define MAX_CMD_LEN 256
-#define MSG_QUEUE_KEY 12345
-#define MAX_CLIENTS 3
-#define TIMEOUT 3
 int msgid;
-// Message structure for the message queue
-struct msg_buffer {
-    long msg_type;
-    char msg_text[MAX_CMD_LEN];
+int shard_qids[MAX_SHARDS];  // Request queues; shard 0 is msgid
+int shard_count = 1;
+struct shm_ring *request_ring = NULL;  // Set when the shared-memory transport is on
+volatile sig_atomic_t shutting_down = 0;
+char **server_argv;  // To exec the new binary with on restart
+
+// Restart handover: receivers park here once they see their marker
+pthread_mutex_t restart_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t restart_cond = PTHREAD_COND_INITIALIZER;
+int restarting = 0;
+int parked = 0;
+int hold_limit = CLIENT_WINDOW;  // Commands a receiver holds back per client: at least a library client's window
+
+// Requests a receiver holds back, under the block policy, for a client whose
+// scheduler queue is full. The receiver goes on reading everyone else's
+// requests and feeds these to the scheduler, in order, as the queue drains.
+struct held_batch {
+    struct held_batch *next;
+    int64_t received_ns;
+    int count;
+    struct command_args reqs[];
 };
-// Structure to pass both client_pid and command to the thread
-struct command_args {
+
+struct held_client {
+    struct held_client *next;
     int client_pid;
-    char command[MAX_CMD_LEN];
+    int commands;    // In its held batches
+    struct held_batch *head, *tail;
 };
 
-pthread_t thread_id;
-
 // Function declarations (prototypes)
-void handle_signal(int sig);
+void *signal_thread(void *arg);
+void shutdown_server();
+void restart_server();
 void handle_commands(int msgid);
-void *execute_command(void *arg);
+void *shard_receiver(void *arg);
+void *handle_ring_commands(void *arg);
+void dispatch_requests(struct command_args *reqs, int count, int64_t received_ns);
+void dispatch_or_hold(struct held_client **held, struct command_args *reqs, int count, int64_t received_ns);
+int release_held(struct held_client **held, int all);
+void reject_request(struct command_args *req);
 void handle_chpt(char *cmd);
-void handle_exit(int client_pid);
-void handle_list();
-void handle_hide(int client_pid);
-void handle_unhide(int client_pid);
+void handle_exit(int client_pid, struct reply *r);
+void handle_list(struct reply *r);
+void handle_hide(int client_pid, struct reply *r);
+void handle_unhide(int client_pid, struct reply *r);
 void handle_exit_command();
-void handle_invalid_command(char *cmd, char *msg);
+void handle_invalid_command(struct reply *r, char *cmd, char *msg);
 void handle_shutdown();
-void execute_in_shell(char *cmd);
+int execute_in_shell(struct reply *r, char *cmd);
+int start_command(struct reply *r, char *cmd);
 void register_client(int client_pid);
+int client_expired(int client_pid);
+int gateway_request(int client_id, struct wire_msg *message, int size, int *replies);
+void gateway_closed(int client_id);
 void handle_user_input(int msgid, char *command);
 
-pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
-int client_hidden[MAX_CLIENTS] = {0};  // Tracks hidden clients
-int client_count = 0;  // Tracks the number of connected clients
-int client_list[MAX_CLIENTS] = {0};
+sigset_t handled_signals;
+const char *rules_path = RULES_DEFAULT_PATH;
+const char *handoff_path = HANDOFF_DEFAULT_PATH;
 
-// Signal handler for graceful shutdown
-void handle_signal(int sig) {
-    printf("\nServer shutting down...\n");
-
-    pthread_mutex_lock(&client_list_mutex);
+// Wait for Ctrl+C, SIGHUP to reload the rules file and SIGUSR2 to restart, on
+// a thread of its own. All are blocked everywhere else, so the shutdown
+// broadcast (which allocates and takes registry locks) runs in normal thread
+// context rather than inside a signal handler.
+void *signal_thread(void *arg) {
+    (void)arg;
+    int sig;
+    while (1) {
+        if (sigwait(&handled_signals, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGHUP) {
+            rules_load(rules_path);  // Keeps the old rules if the file is bad
+            continue;
+        }
+        if (sig == SIGUSR2) {
+            restart_server();  // Only returns if the new binary could not start
+            continue;
+        }
+        shutdown_server();
+    }
+    return NULL;
+}
 
-    // Send SHUTDOWN message to all clients
-    struct msg_buffer shutdown_msg;
-    shutdown_msg.msg_type = 1;  // Using 1 as broadcast type
+// Tell every client we are going away, remove the queue and exit
+void shutdown_server() {
+    static pthread_mutex_t shutdown_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&shutdown_lock);  // Never released: the first caller exits
+    shutting_down = 1;
+    log_flush();  // Keep the log in order with what follows
+    printf("\nServer shutting down...\n");
 
-    strncpy(shutdown_msg.msg_text, "SHUTDOWN", MAX_CMD_LEN);
+    int *clients;
+    int client_count = registry_snapshot(&clients, 0);
 
+    // Send SHUTDOWN message to all clients, over whichever transport each one uses
     for (int i = 0; i < client_count; i++) {
-        shutdown_msg.msg_type = client_list[i];  // Send to each client individually
-        if (msgsnd(msgid, &shutdown_msg, sizeof(shutdown_msg) - sizeof(long), 0) == -1) {
+        if (!client_alive(clients[i])) {
+            continue;  // Died without EXIT and its lease has not run out yet
+        }
+        struct reply shutdown_msg;
+        reply_init(&shutdown_msg, clients[i]);
+        shutdown_msg.flags = REPLY_SHUTDOWN;
+        reply_write(&shutdown_msg, "SHUTDOWN", strlen("SHUTDOWN"), 1);
+        if (reply_finish(&shutdown_msg, 1) == -1) {
             perror("Failed to send shutdown message");
         }
+        reply_release(&shutdown_msg);
     }
 
-    pthread_mutex_unlock(&client_list_mutex);
-
     // Cleanup resources
-    if (msgctl(msgid, IPC_RMID, NULL) == -1) {
-        perror("msgctl (IPC_RMID) failed");
+    for (int i = 0; i < shard_count; i++) {
+        if (msgctl(shard_qids[i], IPC_RMID, NULL) == -1) {
+            perror("msgctl (IPC_RMID) failed");
+        }
+    }
+    if (request_ring) {
+        ring_remove(request_ring);
     }
+    gateway_close();
+    journal_close();
 
+    log_flush();
     printf("All resources freed. Exiting...\n");
     exit(0);
 }
 
+// Called by a receiver that took its restart marker: stay off the queue (or
+// ring) until the restart is over, which for a successful one is never
+void park_receiver() {
+    pthread_mutex_lock(&restart_lock);
+    parked++;
+    pthread_cond_broadcast(&restart_cond);
+    while (restarting) {
+        pthread_cond_wait(&restart_cond, &restart_lock);
+    }
+    parked--;
+    pthread_mutex_unlock(&restart_lock);
+}
+
+// Take whatever the scheduler still has queued onto the end of *pending
+int take_pending(struct command_args **pending, int *count) {
+    struct command_args *taken;
+    int n = sched_take_pending(&taken);
+    if (n <= 0) {
+        return n;
+    }
+    struct command_args *grown = realloc(*pending, (*count + n) * sizeof(struct command_args));
+    if (!grown) {
+        perror("realloc failed");
+        for (int i = 0; i < n; i++) {
+            sched_push(&taken[i]);  // Put back; they will run before the handover
+        }
+        free(taken);
+        return -1;
+    }
+    memcpy(grown + *count, taken, n * sizeof(struct command_args));
+    *pending = grown;
+    *count += n;
+    free(taken);
+    return n;
+}
+
+// SIGUSR2: hand over to a fresh copy of the binary (see handoff.h). The queues
+// and request ring are left in place, so whatever clients send meanwhile waits
+// there for the new server. Commands still queued here go into the state
+// file; commands already running are waited for.
+void restart_server() {
+    int receivers = shard_count + (request_ring != NULL);
+    int marked[MAX_SHARDS] = {0};
+    struct command_args *pending = NULL;
+    int pending_count = 0;
+
+    log_flush();
+    printf("Restarting: stopping intake...\n");
+    int64_t paused = metrics_now();
+    pthread_mutex_lock(&restart_lock);
+    __atomic_store_n(&restarting, 1, __ATOMIC_RELAXED);
+
+    // Each queue's receiver parks when it takes our marker, which as a control
+    // message comes before anything bulk. Requests a receiver held back for a
+    // full client queue go to the scheduler first, and are taken from there.
+    while (parked < receivers) {
+        pthread_mutex_unlock(&restart_lock);
+        for (int i = 0; i < shard_count; i++) {
+            struct wire_msg marker;
+            memset(&marker, 0, WIRE_SIZE(0) + sizeof(long));
+            marker.msg_type = MSG_TYPE_CONTROL;
+            marker.hdr.magic = WIRE_MAGIC;
+            marker.hdr.version = WIRE_VERSION;
+            marker.hdr.client_pid = getpid();
+            if (!marked[i] && msgsnd(shard_qids[i], &marker, WIRE_SIZE(0), IPC_NOWAIT) == 0) {
+                marked[i] = 1;
+            }
+        }
+        take_pending(&pending, &pending_count);
+        usleep(1000);
+        pthread_mutex_lock(&restart_lock);
+    }
+    pthread_mutex_unlock(&restart_lock);
+    take_pending(&pending, &pending_count);  // Queued just before a receiver parked
+
+    // Let running commands, jobs and control requests finish
+    int64_t waited = metrics_now();
+    while (sched_busy() > 0 || pool_busy() > 0 || supervisor_active() > 0 || job_active() > 0) {
+        if (metrics_now() - waited >= 1000000000LL) {
+            printf("Restarting: waiting for %d running commands and %d jobs\n",
+                   pool_busy() + supervisor_active(), job_active());
+            waited = metrics_now();
+        }
+        usleep(1000);
+    }
+
+    if (handoff_save(handoff_path, shard_qids, shard_count, pending, pending_count, paused) == 0) {
+        printf("Restarting: state saved to %s\n", handoff_path);
+        int journalled = journal_close();  // The new server starts a segment of its own
+        log_flush();
+        fflush(NULL);
+        setenv(HANDOFF_ENV, handoff_path, 1);
+        execvp(server_argv[0], server_argv);
+        perror("Could not start the new server");
+        unsetenv(HANDOFF_ENV);
+        unlink(handoff_path);
+        printf("Restart failed: carrying on with this server%s\n", journalled ? "; the journal stays closed" : "");
+    } else {
+        printf("Restart failed: carrying on with this server\n");
+    }
+
+    // Carry on as before: queue the commands again and let the receivers go
+    for (int i = 0; i < pending_count; i++) {
+        sched_push(&pending[i]);
+    }
+    free(pending);
+    pthread_mutex_lock(&restart_lock);
+    __atomic_store_n(&restarting, 0, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&restart_cond);
+    pthread_mutex_unlock(&restart_lock);
+}
+
+// Built-in command handlers, indexed by opcode. Each returns 1 if it handed
+// the reply to the supervisor, 0 if execute_command should finish it.
+typedef int (*command_handler)(struct command_args *args, struct reply *r);
+
+int op_shell(struct command_args *args, struct reply *r) {
+    // Ensure the command is not empty
+    if (args->command[0] == '\0') {
+        handle_invalid_command(r, args->command, "Invalid: Empty command received.");
+        return 0;
+    }
+    return execute_in_shell(r, args->command);  // Anything else runs as a shell command
+}
+
+int op_list(struct command_args *args, struct reply *r) {
+    (void)args;
+    handle_list(r);
+    return 0;
+}
+
+int op_hide(struct command_args *args, struct reply *r) {
+    handle_hide(args->client_pid, r);
+    return 0;
+}
+
+int op_unhide(struct command_args *args, struct reply *r) {
+    handle_unhide(args->client_pid, r);
+    return 0;
+}
+
+int op_exit(struct command_args *args, struct reply *r) {
+    // Hand the scheduler the reply ring before the registry lets go of it
+    sched_forget(args->client_pid, registry_hold_ring(args->client_pid));
+    handle_exit(args->client_pid, r);
+    isolate_forget(args->client_pid);
+    lease_forget(args->client_pid);
+    return 0;
+}
+
+int op_chpt(struct command_args *args, struct reply *r) {
+    if (args->command[0] == '\0') {  // If no argument follows
+        handle_invalid_command(r, "CHPT", "<new_prompt>"); // Display error message
+    } else {
+        reply_printf(r, "CHPT command received with argument: '%s'\n", args->command);
+        registry_set_prompt(args->client_pid, args->command);
+    }
+    return 0;
+}
+
+int op_status(struct command_args *args, struct reply *r) {
+    (void)args;
+    reply_printf(r, "Server is running normally.\n");
+    return 0;
+}
+
+int op_shutdown(struct command_args *args, struct reply *r) {
+    (void)args;
+    reply_printf(r, "Shutdown command received. Terminating server.\n");
+    reply_finish(r, 0);
+    shutdown_server();  // Same path as Ctrl+C: SHUTDOWN broadcast, then IPC_RMID
+    return 1;
+}
+
+int op_stats(struct command_args *args, struct reply *r) {
+    (void)args;
+    char report[8192];
+    int len = metrics_report(report, sizeof(report));
+    len += sched_report(report + len, sizeof(report) - len);
+    len += cache_report(report + len, sizeof(report) - len);
+    reply_write(r, report, len, 0);
+    return 0;
+}
+
+int op_hello(struct command_args *args, struct reply *r) {
+    (void)args;
+    reply_write(r, (const char *)shard_qids, shard_count * sizeof(int), 0);
+    return 0;
+}
+
+// Runs twice per job: once when the client sends it, to queue its first
+// steps, and again when job.c hands it back with every step finished
+int op_job(struct command_args *args, struct reply *r) {
+    if (!args->job) {
+        handle_invalid_command(r, "JOB", args->command);
+        return 0;
+    }
+    if (!job_finished(args->job)) {
+        job_start(args->job, args);
+        return 1;  // Answered once the last step is done
+    }
+    if (job_report(args->job, r) == -1) {
+        return 1;  // The client is gone; nobody to answer
+    }
+    return 0;
+}
+
+static const command_handler handlers[OP_COUNT] = {
+    [OP_SHELL] = op_shell,
+    [OP_LIST] = op_list,
+    [OP_HIDE] = op_hide,
+    [OP_UNHIDE] = op_unhide,
+    [OP_EXIT] = op_exit,
+    [OP_CHPT] = op_chpt,
+    [OP_STATUS] = op_status,
+    [OP_SHUTDOWN] = op_shutdown,
+    [OP_STATS] = op_stats,
+    [OP_HELLO] = op_hello,
+    [OP_JOB] = op_job,
+};
+
 void *execute_command(void *arg) {
     if (!arg) {
         fprintf(stderr, "Error: NULL argument received in execute_command.\n");
@@ -100,146 +406,506 @@ void *execute_command(void *arg) {
     }
 
     struct command_args *args = (struct command_args *)arg;
-    char *command = args->command;
-    int client_pid = args->client_pid;
+    int64_t start = metrics_now();
+    int control = opcode_is_control(args->opcode);
+    metrics_record(control ? HIST_CONTROL_WAIT : HIST_QUEUE_WAIT, start - args->queued_ns);
 
-    // Trim leading spaces
-    while (*command == ' ') command++;
+    struct reply reply;  // Results go back to the client that sent the command
+    reply_init(&reply, args->client_pid);
+    reply.seq = args->seq;
+    reply.command = args->command;
+    reply.opcode = args->opcode;
+    reply.started_ns = start;
+    if (args->job && args->step >= 0) {
+        reply.job = args->job;  // A step: its output goes into the job's report
+        reply.step = args->step;
+        job_step_started(args->job, args->step);
+    }
 
-    // Ensure the command is not empty
-    if (command[0] == '\0') {  // Proper check for empty command
-        handle_invalid_command(command, "Invalid: Empty command received.");
-        free(arg);
-        return NULL;
+    log_printf("Executing command: op %d '%s' (Client PID: %d)\n", args->opcode, args->command, args->client_pid);
+
+    // Join an identical command that is already running, or run it ourselves
+    if (!flight_begin(args, &reply) && !handlers[args->opcode](args, &reply)) {
+        reply_finish(&reply, 0);
+        if (!control) {
+            sched_done(args->client_pid);  // Control commands never went through the scheduler
+        }
+    }  // Otherwise the supervisor (or the command we joined) finishes the reply
+    reply_release(&reply);
+    metrics_since(HIST_EXEC + args->opcode, start);
+    return NULL;
+}
+
+// Copy a request's payload into req. A JOB is parsed here, in the receiver,
+// because its spec may not fit in command; a bad one leaves job NULL and the
+// reason in command for op_job to report.
+void set_payload(struct command_args *req, const char *payload, size_t len) {
+    size_t n = len < MAX_CMD_LEN ? len : MAX_CMD_LEN - 1;
+    memcpy(req->command, payload, n);
+    req->command[n] = '\0';
+    req->job = NULL;
+    req->step = -1;
+    if (req->opcode == OP_JOB) {
+        char error[MAX_CMD_LEN];
+        req->job = job_parse(payload, len, error, sizeof(error));
+        if (!req->job) {
+            strcpy(req->command, error);
+        }
     }
+}
 
-    printf("Executing command: '%s' (Client PID: %d)\n", command, client_pid);
+// Parse an old-style "PID command" message. Built-in command names are turned
+// into opcodes here so workers only ever see the binary form.
+int parse_text_request(struct msg_buffer *message, struct command_args *req) {
+    log_printf("Received raw message: %s\n", message->msg_text);
 
-    // Handle CHPT command with proper input validation
-    if (strncmp(command, "CHPT", 4) == 0) {
-        char *arg_start = command + 4;
+    // Extract the client PID first
+    char *space_pos = strchr(message->msg_text, ' ');  // Find first space
+    if (space_pos == NULL) {
+        log_printf("Invalid message format: No command found.\n");
+        return -1;
+    }
+    *space_pos = '\0';  // Split the string
+    req->client_pid = atoi(message->msg_text);  // Convert PID from string to int
+    if (req->client_pid <= 0) {
+        // Nobody to reply to, and 0/-1 would collide with registry sentinels
+        log_printf("Invalid message format: Bad client PID '%s'.\n", message->msg_text);
+        return -1;
+    }
 
-        // Trim spaces after "CHPT"
-        while (*arg_start == ' ') arg_start++;
+    // Trim leading spaces
+    char *command = space_pos + 1;
+    while (*command == ' ') command++;
 
-        if (*arg_start == '\0') {  // If no argument follows
-            handle_invalid_command(command, "<new_prompt>"); // Display error message
-        } else {
-            printf("CHPT command received with argument: '%s'\n", arg_start);
-            // Handle the CHPT command normally
-        }
-    } 
-    else if (strcmp(command, "shutdown") == 0) {
-        printf("Shutdown command received. Terminating server.\n");
-        free(arg);
-        exit(0);
-    } 
-    else if (strcmp(command, "status") == 0) {
-        printf("Server is running normally.\n");
-    } 
-    else if (strcmp(command, "HIDE") == 0) {
-        handle_hide(client_pid);  // Call the handle_hide function
-    } 
-    else if (strcmp(command, "UNHIDE") == 0) {
-        handle_unhide(client_pid);  // Call the handle_unhide function
-    }
-    else if (strcmp(command, "LIST") == 0) {
-        handle_list();  // Call the handle_list function
-    }
-    else if (strcmp(command, "EXIT") == 0) {
-        handle_exit(client_pid);
-    }
-    else {
-        printf("Unknown command: '%s'\n", command);
-    }
-
-    free(arg);
-    return NULL;
+    const char *payload;
+    req->opcode = opcode_for_name(command, &payload);
+    req->seq = 0;
+    set_payload(req, payload, strlen(payload));
+    return 0;
+}
+
+// Validate a binary request of size bytes (as returned by msgrcv) and unpack
+// it into reqs, which has room for BATCH_MAX commands. Returns the number of
+// commands, or -1 if the request is malformed.
+int parse_wire_request(struct wire_msg *message, ssize_t size, struct command_args *reqs) {
+    struct wire_header *hdr = &message->hdr;
+    if (hdr->version != WIRE_VERSION || hdr->opcode >= OP_COUNT ||
+        hdr->len > WIRE_MAX_PAYLOAD || size != (ssize_t)WIRE_SIZE(hdr->len)) {
+        log_printf("Invalid message format: Bad binary request (version %d, op %d, %zd bytes).\n",
+               hdr->version, hdr->opcode, size);
+        return -1;
+    }
+    if (hdr->client_pid <= 0) {
+        log_printf("Invalid message format: Bad client PID '%d'.\n", hdr->client_pid);
+        return -1;
+    }
+    if (hdr->opcode != OP_BATCH) {
+        if (hdr->len >= MAX_CMD_LEN && hdr->opcode != OP_JOB) {
+            log_printf("Invalid message format: Command too long (%u bytes).\n", hdr->len);
+            return -1;
+        }
+        reqs[0].client_pid = hdr->client_pid;
+        reqs[0].opcode = hdr->opcode;
+        reqs[0].seq = hdr->seq;
+        set_payload(&reqs[0], message->payload, hdr->len);
+        return 1;
+    }
+
+    // Batch: a run of entries, each a small header and its payload
+    int count = 0;
+    uint32_t offset = 0;
+    while (offset < hdr->len) {
+        struct batch_entry entry;
+        if (count == BATCH_MAX || offset + sizeof(entry) > hdr->len) {
+            log_printf("Invalid message format: Bad batch from client %d.\n", hdr->client_pid);
+            return -1;
+        }
+        memcpy(&entry, message->payload + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.opcode >= OP_COUNT || entry.opcode == OP_BATCH ||
+            (entry.len >= MAX_CMD_LEN && entry.opcode != OP_JOB) || offset + entry.len > hdr->len) {
+            log_printf("Invalid message format: Bad batch entry %d from client %d.\n", count, hdr->client_pid);
+            return -1;
+        }
+        reqs[count].client_pid = hdr->client_pid;
+        reqs[count].opcode = entry.opcode;
+        reqs[count].seq = hdr->seq + count;
+        set_payload(&reqs[count], message->payload + offset, entry.len);
+        offset += entry.len;
+        count++;
+    }
+    return count;
 }
+
 // Function to handle commands in the message queue
 void handle_commands(int msgid) {
-    struct msg_buffer message;
+    union {
+        struct msg_buffer text;
+        struct wire_msg wire;
+    } message;
+    struct command_args reqs[BATCH_MAX];
+    struct held_client *held = NULL;
 
     while (1) {
+        // While requests are held back, poll so they go in soon after room appears
+        int holding = release_held(&held, 0);
+
         // Receive a message from the client
-        if (msgrcv(msgid, &message, sizeof(message) - sizeof(long), 1, 0) == -1) {
+        // Lowest type first: control requests before bulk ones
+        ssize_t size = msgrcv(msgid, &message, sizeof(message) - sizeof(long), -MSG_TYPE_BULK,
+                              holding ? IPC_NOWAIT : 0);
+        if (size == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOMSG) {
+                usleep(1000);
+                continue;
+            }
+            if (errno == EIDRM || errno == EINVAL) {
+                // Queue removed: either we are already shutting down or
+                // someone ran ipcrm on it; either way there is nothing left to serve
+                if (!shutting_down) {
+                    shutdown_server();
+                }
+                pause();  // Let the shutting-down thread finish exiting
+            }
             perror("msgrcv failed");
             continue;
         }
 
-        printf("Received raw message: %s\n", message.msg_text);
-        int client_pid;
-        char command[MAX_CMD_LEN];
-
-        // Extract the client PID first
-        char *space_pos = strchr(message.msg_text, ' ');  // Find first space
-        if (space_pos == NULL) {
-            printf("Invalid message format: No command found.\n");
+        if (size == WIRE_SIZE(0) && message.wire.hdr.magic == WIRE_MAGIC &&
+            message.wire.hdr.client_pid == getpid() && __atomic_load_n(&restarting, __ATOMIC_RELAXED)) {
+            release_held(&held, 1);  // Into the scheduler, for the restart to take
+            park_receiver();  // Our own restart marker
             continue;
         }
-        *space_pos = '\0';  // Split the string
-        client_pid = atoi(message.msg_text);  // Convert PID from string to int
-        strncpy(command, space_pos + 1, MAX_CMD_LEN);
-        command[MAX_CMD_LEN - 1] = '\0';  // Ensure null termination
-        printf("Client PID: %d | Command: %s\n", client_pid, command);
 
+        int64_t received = metrics_now();
+        int count;
+        if (size >= (ssize_t)sizeof(struct wire_header) && message.wire.hdr.magic == WIRE_MAGIC) {
+            count = parse_wire_request(&message.wire, size, reqs);
+        } else {
+            count = parse_text_request(&message.text, reqs) == 0 ? 1 : -1;
+        }
+        if (count <= 0) {
+            continue;
+        }
         // Register the client before processing the command
-        register_client(client_pid);
+        register_client(reqs[0].client_pid);
+        dispatch_or_hold(&held, reqs, count, received);
+    }
+}
+
+// Pin the calling thread to the index'th CPU we are allowed to run on, so
+// each receiver keeps its queue's lock and cache lines on one core
+void pin_to_core(int index) {
+    cpu_set_t allowed, one;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+            return;
+        }
+    }
+}
+
+// Receive loop for one of the extra request queues
+void *shard_receiver(void *arg) {
+    int shard = (int)(intptr_t)arg;
+    pin_to_core(shard);
+    handle_commands(shard_qids[shard]);
+    return NULL;
+}
+
+// Receive loop for the shared-memory transport. Runs alongside the message
+// queue loop, so clients on either transport are served.
+void *handle_ring_commands(void *arg) {
+    (void)arg;
+    static struct wire_msg message;
+    static struct command_args reqs[BATCH_MAX];
+    struct command_args *req = &reqs[0];
+    struct held_client *held = NULL;
+
+    while (1) {
+        if (__atomic_load_n(&restarting, __ATOMIC_RELAXED)) {
+            release_held(&held, 1);
+            park_receiver();
+        }
+        // Wake up now and then to notice a restart, and often while requests
+        // are held back
+        int size = ring_pop(request_ring, &message.hdr, release_held(&held, 0) ? 1 : 100);
+        if (size == -1) {
+            continue;
+        }
+        int64_t received = metrics_now();
+        int count = message.hdr.magic == WIRE_MAGIC ? parse_wire_request(&message, size, reqs) : -1;
+        if (count <= 0) {
+            continue;
+        }
 
-        // Declare thread_id **before** using it
-        pthread_t thread_id;
+        // Attach the client's reply ring the first time we hear from it
+        register_client(req->client_pid);
+        if (registry_get_ring(req->client_pid) == NULL) {
+            struct shm_ring *ring = ring_attach(REPLY_RING_KEY(req->client_pid), REPLY_RING_SLOT_SIZE);
+            if (ring && registry_set_ring(req->client_pid, ring) == -1) {
+                // Not registered (client limit): answer on the ring and drop the commands
+                for (int i = 0; i < count; i++) {
+                    struct reply full;
+                    reply_init(&full, req->client_pid);
+                    full.seq = reqs[i].seq;
+                    full.ring = ring;
+                    ring_hold(ring);
+                    reply_printf(&full, "Max clients reached: dropping command from client %d\n", req->client_pid);
+                    full.status = 1;
+                    reply_finish(&full, 0);
+                    reply_release(&full);
+                    if (reqs[i].job) {
+                        job_free(reqs[i].job);
+                    }
+                }
+                ring_detach(ring);
+                continue;
+            }
+        }
+        dispatch_or_hold(&held, reqs, count, received);
+    }
+    return NULL;
+}
 
-        // Allocate memory for arguments
-        struct command_args *args = malloc(sizeof(struct command_args));
-        if (!args) {
-            perror("malloc failed");
+// Send registry commands down the control lane and queue shell commands with
+// the scheduler, which hands them to the worker pool in fair order. Never
+// waits: under the block policy the caller has made sure there is room.
+void dispatch_requests(struct command_args *reqs, int count, int64_t received_ns) {
+    metrics_count(CTR_RECEIVED, count);
+    for (int i = 0; i < count; i++) {
+        struct command_args *req = &reqs[i];
+        log_printf("Client PID: %d | Op: %d | Seq: %u | Command: %s\n", req->client_pid, req->opcode, req->seq, req->command);
+        metrics_since(HIST_DISPATCH, received_ns);
+        if (req->opcode == OP_PING) {
+            continue;  // register_client() already renewed the lease
+        }
+        req->solo = 0;
+        if (opcode_is_control(req->opcode)) {
+            req->queued_ns = metrics_now();
+            pool_submit_control(req);
+            continue;
+        }
+        if (sched_enqueue(req) == 0) {
             continue;
         }
+        reject_request(req);  // Reject policy and the client's queue is full
+    }
+}
 
-        args->client_pid = client_pid;
-        strncpy(args->command, command, MAX_CMD_LEN);
-        args->command[MAX_CMD_LEN - 1] = '\0';  // Ensure null termination
+// Tell a client about a command that was dropped because its queue was full
+void reject_request(struct command_args *req) {
+    metrics_count(CTR_REJECTED, 1);
+    struct reply busy;
+    reply_init(&busy, req->client_pid);
+    busy.seq = req->seq;
+    reply_printf(&busy, "Server busy: dropping command from client %d\n", busy.client_pid);
+    busy.status = 1;
+    reply_finish(&busy, 0);
+    reply_release(&busy);
+    if (req->job) {
+        job_free(req->job);
+    }
+}
 
-        // Create a new thread to execute the command
-        if (pthread_create(&thread_id, NULL, execute_command, args) != 0) {
-            perror("pthread_create failed");
-            free(args);  // Free memory if thread creation fails
+// Shell commands in a batch, which need places in the scheduler queue
+static int shell_count(const struct command_args *reqs, int count) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        n += !opcode_is_control(reqs[i].opcode);
+    }
+    return n;
+}
+
+// Dispatch a batch, or hold it back if its client's queue is full or the
+// client already has batches held (they go first). Holding never waits, so
+// one client filling its queue does not stop the receiver serving the rest.
+// A client gets at most hold_limit commands held, which a client keeping its
+// window full stays within; past that its batches are dropped as under the
+// reject policy.
+void dispatch_or_hold(struct held_client **held, struct command_args *reqs, int count, int64_t received_ns) {
+    int client_pid = reqs[0].client_pid;
+    struct held_client *h = *held;
+    while (h && h->client_pid != client_pid) {
+        h = h->next;
+    }
+    if (!h && sched_room(client_pid, shell_count(reqs, count))) {
+        dispatch_requests(reqs, count, received_ns);
+        return;
+    }
+
+    struct held_batch *batch = NULL;
+    if (!h || h->commands + count <= hold_limit) {
+        batch = malloc(sizeof(struct held_batch) + count * sizeof(struct command_args));
+    }
+    if (batch && !h) {
+        h = calloc(1, sizeof(struct held_client));
+        if (h) {
+            h->client_pid = client_pid;
+            h->next = *held;
+            *held = h;
         }
+    }
+    if (!batch || !h) {
+        free(batch);
+        metrics_count(CTR_RECEIVED, count);
+        for (int i = 0; i < count; i++) {
+            reject_request(&reqs[i]);
+        }
+        return;
+    }
+    batch->next = NULL;
+    batch->received_ns = received_ns;
+    batch->count = count;
+    memcpy(batch->reqs, reqs, count * sizeof(struct command_args));
+    if (h->tail) {
+        h->tail->next = batch;
+    } else {
+        h->head = batch;
+    }
+    h->tail = batch;
+    h->commands += count;
+}
 
-        // Detach the thread so it cleans up automatically
-        pthread_detach(thread_id);
+// Dispatch held batches whose client's queue has room again, or all of them
+// (a restart takes them from the scheduler). Returns whether any are left.
+int release_held(struct held_client **held, int all) {
+    struct held_client **link = held;
+    while (*link) {
+        struct held_client *h = *link;
+        while (h->head && (all || sched_room(h->client_pid, shell_count(h->head->reqs, h->head->count)))) {
+            struct held_batch *batch = h->head;
+            h->head = batch->next;
+            h->commands -= batch->count;
+            dispatch_requests(batch->reqs, batch->count, batch->received_ns);
+            free(batch);
+        }
+        if (h->head) {
+            link = &h->next;
+        } else {
+            *link = h->next;
+            free(h);
+        }
     }
+    return *held != NULL;
 }
 
 // Function to handle invalid commands
-void handle_invalid_command(char *cmd, char *msg) {
-    printf("Error: %s (Command: '%s')\n", msg, cmd);
+void handle_invalid_command(struct reply *r, char *cmd, char *msg) {
+    reply_printf(r, "Error: %s (Command: '%s')\n", msg, cmd);
+    r->status = 1;
 }
 
 
-// Register Clients
+// Register Clients. Called for every request, which also counts as a heartbeat.
 void register_client(int client_pid) {
-    pthread_mutex_lock(&client_list_mutex);
-    // Check if the client is already registered
-    for (int i = 0; i < client_count; i++) {
-        if (client_list[i] == client_pid) {
-            pthread_mutex_unlock(&client_list_mutex);
-            return; // Client is already registered
+    int result = registry_add(client_pid);
+    if (result == REG_FULL) {
+        log_printf("Max clients reached. Cannot register client %d\n", client_pid);
+        return;
+    }
+    if (result == REG_ADDED) {
+        log_printf("Client %d registered\n", client_pid);
+    }
+    lease_renew(client_pid);
+}
+
+// A client is alive while its process exists, or for a gateway client while
+// its connection is open
+int client_alive(int client_pid) {
+    if (client_pid >= GATEWAY_ID_BASE) {
+        return gateway_connected(client_pid);
+    }
+    return kill(client_pid, 0) == 0 || errno == EPERM;
+}
+
+// Called by the lease thread for a client that has sent nothing for a whole
+// lease. One whose process still exists is just idle at its prompt and keeps
+// its place. A dead one loses its queued commands at once and, when the last
+// of its running commands has finished, its registry slot, scheduler record,
+// cgroup, reply ring and any replies nobody will read. Returns 1 to keep the
+// client.
+int client_expired(int client_pid) {
+    if (client_alive(client_pid)) {
+        return 1;
+    }
+    if (sched_drop(client_pid) > 0) {
+        return 1;  // Check again after another lease
+    }
+
+    struct shm_ring *ring = registry_hold_ring(client_pid);
+    int removed = registry_remove(client_pid);
+    isolate_forget(client_pid);
+    if (client_pid < GATEWAY_ID_BASE) {
+        int qid = msgget(REPLY_QUEUE_KEY(client_pid), 0);
+        if (qid != -1 && msgctl(qid, IPC_RMID, NULL) == -1) {
+            perror("msgctl (IPC_RMID) failed");
+        }
+        // Old clients read their replies from the request queue
+        struct reply_buffer stale;
+        while (msgrcv(msgid, &stale, sizeof(stale) - sizeof(long), client_pid, IPC_NOWAIT) != -1) {
         }
     }
-    // Register new clients if space is available
-    if (client_count >= MAX_CLIENTS) {
-        printf("Max clients reached. Cannot register client %d\n", client_pid);
-        pthread_mutex_unlock(&client_list_mutex);
-        return;
+    if (ring) {
+        ring_remove(ring);  // The client never got to remove it
+        ring_detach(ring);
+    }
+    if (removed) {
+        metrics_count(CTR_EXPIRED, 1);
+        log_printf("Client %d is gone: %s\n", client_pid,
+                   client_pid >= GATEWAY_ID_BASE ? "connection closed" : "lease expired");
+    }
+    return 0;
+}
+
+// A request from a gateway connection, framed like one from a queue. The
+// gateway thread must not block on one client, so instead of waiting for room
+// in the client's scheduler queue the request is turned away (returns 0) and
+// offered again later; likewise while a restart has intake stopped. Every
+// command but PING is answered, busy replies included.
+int gateway_request(int client_id, struct wire_msg *message, int size, int *replies) {
+    static struct command_args reqs[BATCH_MAX];  // Gateway thread only
+    if (__atomic_load_n(&restarting, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    int64_t received = metrics_now();
+    message->hdr.client_pid = client_id;  // Whatever the connection claims
+    int count = parse_wire_request(message, size, reqs);
+    if (count <= 0) {
+        return 1;
+    }
+    if (!sched_room(client_id, count)) {
+        for (int i = 0; i < count; i++) {
+            if (reqs[i].job) {
+                job_free(reqs[i].job);
+            }
+        }
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        *replies += reqs[i].opcode != OP_PING;
+    }
+    register_client(client_id);
+    dispatch_requests(reqs, count, received);
+    return 1;
+}
+
+// A gateway connection closed: the client is gone, as if its lease ran out
+// now. If commands of its are still running, the lease finishes the job.
+void gateway_closed(int client_id) {
+    if (client_expired(client_id) == 0) {
+        lease_forget(client_id);
     }
-    // Store client PID
-    client_list[client_count] = client_pid;
-    client_hidden[client_count] = 0;
-    client_count++;
-    
-    printf("Client %d registered\n", client_pid);
-    pthread_mutex_unlock(&client_list_mutex);
 }
 
 // Command handlers
@@ -256,87 +922,52 @@ void handle_chpt(char *cmd) {
     }
 }
 
-void handle_exit(int client_pid) {
-    pthread_mutex_lock(&client_list_mutex);
-    
-    int found = -1;  // Track client index
-    for (int i = 0; i < client_count; i++) {
-        if (client_list[i] == client_pid) {
-            found = i;
-            break;
-        }
-    }
-
-    if (found != -1) {
-        printf("Client %d Disconnected.\n", client_pid);  // Message displayed in terminal
-
-        // Shift array left to remove the client
-        for (int j = found; j < client_count - 1; j++) {
-            client_list[j] = client_list[j + 1];
-            client_hidden[j] = client_hidden[j + 1];  // Shift hidden status too
-        }
-        client_count--;  // Reduce count
+void handle_exit(int client_pid, struct reply *r) {
+    if (registry_remove(client_pid)) {
+        reply_printf(r, "Client %d Disconnected.\n", client_pid);  // Message displayed in terminal
     } else {
-        printf("Client %d not found.\n", client_pid);
+        reply_printf(r, "Client %d not found.\n", client_pid);
     }
-
-    pthread_mutex_unlock(&client_list_mutex);
 }
 
 
 // Handle the list 
-void handle_list() {
-    pthread_mutex_lock(&client_list_mutex);
-    if (client_count == 0) {
-        printf("No clients connected.\n");
-        pthread_mutex_unlock(&client_list_mutex);
+void handle_list(struct reply *r) {
+    // Work from a snapshot so registering clients are not held up while we print
+    int *clients;
+    int count = registry_snapshot(&clients, 1);
+    if (count == -1) {
         return;
     }
-    printf("Connected Clients: ");
-    for (int i = 0; i < client_count; i++) {
-        if (!client_hidden[i]) {
-            printf("%d ", client_list[i]);  // Print actual client PID
-        }
+    if (registry_count() == 0) {
+        reply_printf(r, "No clients connected.\n");
+        free(clients);
+        return;
+    }
+    reply_printf(r, "Connected Clients: ");
+    for (int i = 0; i < count; i++) {
+        reply_printf(r, "%d ", clients[i]);  // Print actual client PID
     }
-    printf("\n");
-    pthread_mutex_unlock(&client_list_mutex);
+    reply_printf(r, "\n");
+    free(clients);
 }
 
-void handle_hide(int client_pid) {
-    pthread_mutex_lock(&client_list_mutex);
-
-    for (int i = 0; i < client_count; i++) {
-        if (client_list[i] == client_pid) {
-            if (client_hidden[i]) {
-                printf("Client %d: You Are Already Hidden.\n", client_pid);
-            } else {
-                client_hidden[i] = 1;
-                printf("Client %d: You Are Now hidden.\n", client_pid);
-            } 
-            pthread_mutex_unlock(&client_list_mutex);
-            return;
-        }
+void handle_hide(int client_pid, struct reply *r) {
+    int was_hidden = registry_set_hidden(client_pid, 1);
+    if (was_hidden == 1) {
+        reply_printf(r, "Client %d: You Are Already Hidden.\n", client_pid);
+    } else if (was_hidden == 0) {
+        reply_printf(r, "Client %d: You Are Now hidden.\n", client_pid);
     }
-    pthread_mutex_unlock(&client_list_mutex);
 }
 
-void handle_unhide(int client_pid) {
-    pthread_mutex_lock(&client_list_mutex);
-
-    for (int i = 0; i < client_count; i++) {
-        if (client_list[i] == client_pid) {
-            if (!client_hidden[i]) {
-                printf("Client %d: You Are Not Hidden.\n", client_pid);
-            } else {
-                client_hidden[i] = 0;
-                printf("Client %d: You Are Now Visible Again.\n", client_pid);
-            }
-            pthread_mutex_unlock(&client_list_mutex);
-            return;
-        }
+void handle_unhide(int client_pid, struct reply *r) {
+    int was_hidden = registry_set_hidden(client_pid, 0);
+    if (was_hidden == 0) {
+        reply_printf(r, "Client %d: You Are Not Hidden.\n", client_pid);
+    } else if (was_hidden == 1) {
+        reply_printf(r, "Client %d: You Are Now Visible Again.\n", client_pid);
     }
-
-    pthread_mutex_unlock(&client_list_mutex);
 }
 
 void handle_exit_command() {
@@ -348,109 +979,368 @@ void handle_shutdown() {
     exit(0);
 }
 
-void execute_in_shell(char *cmd) {
-    // Check for commands where the argument should be separated by a space
-    if (strncmp(cmd, "ls-l", 4) == 0) {
-        handle_invalid_command(cmd, "Invalid: 'ls-l' should be 'ls -l'. Missing space between command and flag.");
-        return;
+// Called by the supervisor once a shell command has been reaped and its
+// output sent; sets the exit status and resource usage carried by the final
+// reply chunk
+void shell_command_done(pid_t pid, int status, const struct rusage *usage, int timed_out,
+                        struct reply *r, void *ctx) {
+    (void)ctx;
+    int64_t user_ns = usage->ru_utime.tv_sec * 1000000000LL + usage->ru_utime.tv_usec * 1000LL;
+    int64_t sys_ns = usage->ru_stime.tv_sec * 1000000000LL + usage->ru_stime.tv_usec * 1000LL;
+    metrics_record(HIST_CHILD_CPU, user_ns + sys_ns);
+    sched_charge(r->client_pid, user_ns + sys_ns);
+    sched_done(r->client_pid);
+    if (timed_out && r->fill) {
+        cache_abandon(r->fill);  // Cut short; running it again may give more
+        r->fill = NULL;
     }
-    if (strncmp(cmd, "echo", 4) == 0) {
-        // Ensure that 'echo' is followed by a space and some content
-        if (strlen(cmd) == 4) {
-            handle_invalid_command(cmd, "Invalid: 'echo' requires a space and text to be printed.");
-            return;
-        }
-        // Check if there is no space after echo, handle it as invalid
-        if (cmd[4] != ' ') {
-            handle_invalid_command(cmd, "Invalid: 'echo' requires a space between 'echo' and the text.");
-            return;
-        }
-    }    
-    if (strncmp(cmd, "cat", 3) == 0) {
-        // Ensure that 'cat' is followed by a space and a file name
-        if (strlen(cmd) == 3) {
-            handle_invalid_command(cmd, "Invalid: 'cat' requires a file name.");
-            return;
-        }
-        // Check if there is no space after 'cat', handle it as invalid
-        if (cmd[3] != ' ') {
-            handle_invalid_command(cmd, "Invalid: 'cat' requires a space between 'cat' and the file name.");
-            return;
-        }
+    if (timed_out) {
+        reply_printf(r, "Command Timeout: Killing process %d\n", pid);
+    }
+    if (WIFEXITED(status)) {
+        r->status = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        r->status = 128 + WTERMSIG(status);  // Same convention as the shell
+    }
+    if (!timed_out && WIFSIGNALED(status) && (WTERMSIG(status) == SIGXCPU || WTERMSIG(status) == SIGKILL)) {
+        metrics_count(CTR_LIMIT_KILLED, 1);  // CPU limit, or the cgroup's OOM killer
     }
-    if (strncmp(cmd, "./", 2) == 0) {
-        // Extract the binary name
-        char binary[MAX_CMD_LEN];
-        sscanf(cmd, "./%s", binary);
 
-        // Check if the file exists and is executable
+    // Set last: anything written above may have gone out in a chunk of its own
+    r->usage.user_us = user_ns / 1000;
+    r->usage.sys_us = sys_ns / 1000;
+    r->usage.maxrss_kb = usage->ru_maxrss;
+    r->flags |= REPLY_USAGE;
+}
+
+// Spawn a command with stdout/stderr on a pipe and hand it to the supervisor,
+// which streams the output to the client and kills it after TIMEOUT seconds.
+// The worker returns straight away instead of sleeping out the timeout.
+// Returns 1 if the command started; the supervisor then finishes the reply.
+int start_command(struct reply *r, char *cmd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        handle_invalid_command(r, cmd, "Error: Could not start command.");
+        return 0;
+    }
+
+    struct child *c = supervisor_reserve();
+    struct isolate_plan plan;
+    pid_t pid = 0;
+    isolate_plan(r->client_pid, &plan);
+    int err = executor_spawn(cmd, fds[1], isolate_enter, &plan, &pid);
+    isolate_finish(pid, r->client_pid, &plan);
+    close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        supervisor_cancel(c);
+        // Report it the way the shell would
+        reply_printf(r, "%.*s: %s\n", (int)strcspn(cmd, " "), cmd,
+                     err == ENOENT ? "command not found" : strerror(err));
+        r->status = 127;
+        return 0;
+    }
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    supervisor_watch(c, pid, fds[0], r, TIMEOUT * 1000, shell_command_done, NULL);
+    return 1;
+}
+
+// Validate and run a shell command. Returns 1 if a child was started.
+int execute_in_shell(struct reply *r, char *cmd) {
+    // Reject malformed commands as the rules file says
+    char message[RULE_MESSAGE_MAX];
+    int word_len;
+    switch (rules_check(cmd, message, &word_len)) {
+    case RULE_NONE:
+        break;
+    case RULE_EXEC: {
+        // Run the named file directly if it exists and is executable
+        char binary[MAX_CMD_LEN];
+        snprintf(binary, sizeof(binary), "%.*s", (int)strcspn(cmd + word_len, " "), cmd + word_len);
         if (access(binary, X_OK) == 0) {
-            pid_t pid = fork();
-            if (pid == 0) {
-                execl(cmd, cmd, (char *)NULL);  // Execute the binary
-                perror("execl failed");
-                exit(1);
+            return start_command(r, cmd);
+        }
+        handle_invalid_command(r, cmd, message);
+        return 0;
+    }
+    default:
+        handle_invalid_command(r, cmd, message);
+        return 0;
+    }
+    // Read-only commands may already have an answer
+    if (cache_lookup(r, cmd)) {
+        return 0;
+    }
+    // Plain echo, cat, mkdir, rm and ls run in-process
+    char fallback[MAX_CMD_LEN];
+    if (builtin_run(r, cmd, fallback) == BUILTIN_DONE) {
+        metrics_count(CTR_BUILTIN, 1);
+        return 0;
+    }
+    // If no invalid case detected, execute the command (or whatever the
+    // builtin left over, after the output it already produced)
+    reply_flush(r, 0);
+    return start_command(r, fallback);
+}
+
+// Print command line options
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-C control_workers] [-q depth] [-i inflight] [-Q depth] [-b block|reject] [-c max_clients] [-S shards] [-T msg|shm] [-R cache_mb] [-J classes] [-V rules_file]\n"
+                    "       [-L command_limits] [-P client_limits -G cgroup_dir] [-l lease_seconds] [-j parallel]\n"
+                    "       [-W journal_dir [-Z segment_mb]] [-H state_file] [-U socket_path] [-t tcp_port]\n", prog);
+    fprintf(stderr, "  -w  number of worker threads (default: number of cores)\n");
+    fprintf(stderr, "  -C  workers reserved for registry commands (default: 1)\n");
+    fprintf(stderr, "  -q  queued commands per worker (default: %d)\n", POOL_DEFAULT_DEPTH);
+    fprintf(stderr, "  -i  commands in flight per client (default: number of workers)\n");
+    fprintf(stderr, "  -Q  commands queued per client (default: %d)\n", SCHED_DEFAULT_QUEUE);
+    fprintf(stderr, "  -b  what to do when a client's queue is full (default: block)\n");
+    fprintf(stderr, "  -c  maximum registered clients, 0 for no limit (default: 0)\n");
+    fprintf(stderr, "  -S  request queues, each with its own receiver thread (default: 1)\n");
+    fprintf(stderr, "  -T  also accept clients over shared-memory rings with 'shm' (default: msg)\n");
+    fprintf(stderr, "  -R  megabytes of output to cache for read-only commands, 0 for none (default: 0)\n");
+    fprintf(stderr, "  -J  command classes identical commands may share a run of: list, status, stats, read\n"
+                    "      or none (default: %s)\n", FLIGHT_DEFAULT_CLASSES);
+    fprintf(stderr, "  -V  command validation rules, reloaded on SIGHUP (default: %s)\n", RULES_DEFAULT_PATH);
+    fprintf(stderr, "  -L  limits per shell command as cpu=seconds,mem=MB,files=N, 0 for none (default: %s)\n",
+            ISOLATE_DEFAULT_LIMITS);
+    fprintf(stderr, "  -P  limits per client as cpu=percent,mem=MB,procs=N, in a cgroup of its own (default: none)\n");
+    fprintf(stderr, "  -G  cgroup v2 directory to create client cgroups in (default: none)\n");
+    fprintf(stderr, "  -l  seconds a client may stay silent before it is checked for, 0 for never (default: %d)\n",
+            LEASE_DEFAULT_SECONDS);
+    fprintf(stderr, "  -j  steps of one JOB that may run at once (default: %d)\n", JOB_DEFAULT_PARALLEL);
+    fprintf(stderr, "  -W  directory to journal every answered command in (default: none)\n");
+    fprintf(stderr, "  -Z  size of each journal segment in megabytes (default: %d)\n", JOURNAL_DEFAULT_SEGMENT_MB);
+    fprintf(stderr, "  -H  file to hand clients and queued commands over in on SIGUSR2 (default: %s)\n", HANDOFF_DEFAULT_PATH);
+    fprintf(stderr, "  -U  also accept clients on this Unix-domain socket (default: none)\n");
+    fprintf(stderr, "  -t  also accept clients on this TCP port of 127.0.0.1 (default: none)\n");
+}
+
+// Main starts here
+int main(int argc, char *argv[]) {
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int control_workers = 1;
+    int depth = POOL_DEFAULT_DEPTH;
+    int inflight = 0;  // Defaults to the number of workers
+    int client_depth = SCHED_DEFAULT_QUEUE;
+    enum sched_policy policy = SCHED_BLOCK;
+    int max_clients = 0;
+    int use_shm = 0;
+    int cache_mb = 0;
+    const char *coalesce = FLIGHT_DEFAULT_CLASSES;
+    const char *command_limits = ISOLATE_DEFAULT_LIMITS;
+    const char *client_limits = "";
+    const char *cgroup_dir = NULL;
+    int lease_seconds = LEASE_DEFAULT_SECONDS;
+    int job_parallel = JOB_DEFAULT_PARALLEL;
+    const char *journal_dir = NULL;
+    int segment_mb = JOURNAL_DEFAULT_SEGMENT_MB;
+    const char *socket_path = NULL;
+    int tcp_port = 0;
+    int opt;
+
+    server_argv = argv;
+    while ((opt = getopt(argc, argv, "w:C:q:i:Q:b:c:S:T:R:J:V:L:P:G:l:j:W:Z:H:U:t:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'C':
+            control_workers = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'i':
+            inflight = atoi(optarg);
+            break;
+        case 'Q':
+            client_depth = atoi(optarg);
+            if (client_depth > hold_limit) {
+                hold_limit = client_depth;
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "block") == 0) {
+                policy = SCHED_BLOCK;
+            } else if (strcmp(optarg, "reject") == 0) {
+                policy = SCHED_REJECT;
             } else {
-                sleep(TIMEOUT);
-                if (waitpid(pid, NULL, WNOHANG) == 0) {
-                    kill(pid, SIGKILL);
-                    printf("Command Timeout: Killing process %d\n", pid);
-                }
+                usage(argv[0]);
+                exit(1);
             }
-        } else {
-            handle_invalid_command(cmd, "Error: File does not exist or is not executable.");
-        }
-        return;
-    }    
-    if (strncmp(cmd, "mkdir", 5) == 0) {
-        // Ensure that 'mkdir' is followed by a space and a folder name
-        if (strlen(cmd) == 5) {
-            handle_invalid_command(cmd, "Invalid: 'mkdir' requires a folder name.");
-            return;
-        }
-        // Check if there is no space after mkdir, handle it as invalid
-        if (cmd[5] != ' ') {
-            handle_invalid_command(cmd, "Invalid: 'mkdir' requires a space between 'mkdir' and the folder name.");
-            return;
+            break;
+        case 'c':
+            max_clients = atoi(optarg);
+            break;
+        case 'S':
+            shard_count = atoi(optarg);
+            break;
+        case 'T':
+            if (strcmp(optarg, "shm") == 0) {
+                use_shm = 1;
+            } else if (strcmp(optarg, "msg") != 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'R':
+            cache_mb = atoi(optarg);
+            break;
+        case 'J':
+            coalesce = optarg;
+            break;
+        case 'V':
+            rules_path = optarg;
+            break;
+        case 'L':
+            command_limits = optarg;
+            break;
+        case 'P':
+            client_limits = optarg;
+            break;
+        case 'G':
+            cgroup_dir = optarg;
+            break;
+        case 'l':
+            lease_seconds = atoi(optarg);
+            break;
+        case 'j':
+            job_parallel = atoi(optarg);
+            break;
+        case 'W':
+            journal_dir = optarg;
+            break;
+        case 'Z':
+            segment_mb = atoi(optarg);
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'U':
+            socket_path = optarg;
+            break;
+        case 't':
+            tcp_port = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
         }
-    }    
+    }
+    if (inflight == 0) {
+        inflight = workers;
+    }
+    if (workers < 1 || control_workers < 0 || depth < 1 || inflight < 1 || client_depth < 1 || max_clients < 0 ||
+        shard_count < 1 || shard_count > MAX_SHARDS || cache_mb < 0 || lease_seconds < 0 || job_parallel < 1 || segment_mb < 1 ||
+        tcp_port < 0 || tcp_port > 65535 ||
+        flight_init(coalesce) == -1 || isolate_init(command_limits, client_limits, cgroup_dir) == -1) {
+        usage(argv[0]);
+        exit(1);
+    }
 
-    if (strncmp(cmd, "grep patternfile.txt", 21) == 0) {
-        handle_invalid_command(cmd, "Invalid: 'grep patternfile.txt' should be 'grep pattern file.txt'. Missing space.");
-        return;
+    // A bad rules file is fatal; only a missing default one is let go
+    if (rules_load(rules_path) == -1) {
+        if (strcmp(rules_path, RULES_DEFAULT_PATH) != 0 || access(rules_path, F_OK) == 0) {
+            exit(1);
+        }
+        printf("No %s: shell commands are not validated\n", rules_path);
     }
+    job_init(job_parallel);
 
-    // Check for other invalid cases where commands should have arguments
-    if (strncmp(cmd, "rm", 2) == 0 && strlen(cmd) == 2) {
-        handle_invalid_command(cmd, "Invalid: 'rm' requires a file or directory to delete.");
-        return;
+    // Started by a restart: take over from the server that exec'd us
+    const struct handoff_header *handoff = NULL;
+    if (getenv(HANDOFF_ENV)) {
+        handoff = handoff_load(getenv(HANDOFF_ENV));
+        unsetenv(HANDOFF_ENV);
     }
-    // If no invalid case detected, execute the command
-    pid_t pid = fork();
-    if (pid == 0) {
-        execlp("/bin/bash", "bash", "-c", cmd, (char *)NULL);
-        perror("execlp failed");
+
+    // Handle Ctrl+C gracefully: block it (and SIGHUP, SIGUSR2) before any
+    // thread starts so only signal_thread ever receives it
+    pthread_t sig_tid;
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGHUP);
+    sigaddset(&handled_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &handled_signals, NULL);
+    if (pthread_create(&sig_tid, NULL, signal_thread, NULL) != 0) {
+        perror("pthread_create failed");
         exit(1);
-    } else {
-        // Monitor command execution time (timeout after 3 seconds)
-        sleep(TIMEOUT);
-        if (waitpid(pid, NULL, WNOHANG) == 0) {
-            kill(pid, SIGKILL);  // Kill process if it exceeds 3 seconds
-            printf("Command Timeout: Killing process %d\n", pid);
-        }
     }
-}
+    pthread_detach(sig_tid);
 
-// Main starts here
-int main() {
-    signal(SIGINT, handle_signal);  // Handle Ctrl+C gracefully
+    if (log_start() == -1) {
+        exit(1);
+    }
 
     // Initialize message queue
-    int msgid = msgget(MSG_QUEUE_KEY, 0666 | IPC_CREAT);
+    msgid = msgget(MSG_QUEUE_KEY, 0666 | IPC_CREAT);
     if (msgid == -1) {
         perror("msgget failed");
         exit(1);
     }
+    // Extra shards are private queues; clients learn their ids from OP_HELLO.
+    // After a restart they are the previous server's, with clients' requests
+    // still in them.
+    shard_qids[0] = msgid;
+    if (handoff) {
+        shard_count = handoff->shard_count;
+        memcpy(shard_qids, handoff->shard_qids, shard_count * sizeof(int));
+    }
+    for (int i = 1; i < shard_count && !handoff; i++) {
+        shard_qids[i] = msgget(IPC_PRIVATE, 0666 | IPC_CREAT);
+        if (shard_qids[i] == -1) {
+            perror("msgget failed");
+            exit(1);
+        }
+    }
+
+    // Start the client registry, the child supervisor, the scheduler and the
+    // worker pool once, before any command arrives
+    if (registry_init(max_clients) == -1 || supervisor_init() == -1 ||
+        sched_init(inflight, client_depth, policy) == -1 ||
+        pool_init(workers, control_workers, depth, sched_pump) == -1 ||
+        cache_init((long)cache_mb << 20) == -1 || lease_init(lease_seconds, client_expired) == -1 ||
+        journal_init(journal_dir, (long)segment_mb << 20) == -1) {
+        exit(1);
+    }
+    // Clients and their queued commands go back in before any receiver
+    // starts, so each client's older commands stay ahead of its newer ones
+    if (handoff) {
+        int64_t paused = handoff->paused_ns;
+        int queued = handoff_restore(handoff);
+        printf("Took over %d clients and %d queued commands; intake was paused for %.1f ms\n",
+               registry_count(), queued, (metrics_now() - paused) / 1e6);
+    }
+    if (use_shm) {
+        pthread_t ring_tid;
+        request_ring = handoff ? ring_attach(SHM_REQUEST_KEY, REQUEST_RING_SLOT_SIZE) : NULL;
+        if (!request_ring) {
+            request_ring = ring_create(SHM_REQUEST_KEY, REQUEST_RING_SLOTS, REQUEST_RING_SLOT_SIZE);
+        }
+        if (!request_ring || pthread_create(&ring_tid, NULL, handle_ring_commands, NULL) != 0) {
+            fprintf(stderr, "Could not start the shared-memory transport\n");
+            exit(1);
+        }
+        pthread_detach(ring_tid);
+        printf("Shared-memory transport enabled (key %d)\n", SHM_REQUEST_KEY);
+    }
+    if (gateway_init(socket_path, tcp_port, gateway_request, gateway_closed) == -1) {
+        exit(1);
+    }
+    for (int i = 1; i < shard_count; i++) {
+        pthread_t shard_tid;
+        if (pthread_create(&shard_tid, NULL, shard_receiver, (void *)(intptr_t)i) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+        pthread_detach(shard_tid);
+    }
+    if (shard_count > 1) {
+        printf("Receiving on %d request queues\n", shard_count);
+        pin_to_core(0);  // After every other thread is started, so none inherit it
+    }
     printf("Server started. Waiting for client commands...\n");
     handle_commands(msgid);  // Start handling commands from the message queue
     return 0;
@@ -460,4 +1350,4 @@ int main() {
 // To Do:
 // 1. Empty Input
 // 2. " " Fix Cases
-// 3. 
\ No newline at end of file
+// 3. 
\ No newline at end of file
@@ -0,0 +1,65 @@
+/* Shared definitions for the server and its subsystems (worker pool, etc.).
+   Anything that more than one server source file needs lives here.
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "protocol.h"
+
+#define TIMEOUT 3
+
+extern int msgid;
+
+// Structure to pass both client_pid and command to a worker
+struct command_args {
+    int client_pid;
+    int opcode;              // enum opcode
+    unsigned int seq;
+    int64_t queued_ns;       // When it was handed to the pool (metrics)
+    int solo;                // Run it even if an identical command is in flight
+    struct job *job;         // Parsed OP_JOB, or the job this command is a step of
+    int step;                // Step index within job, -1 for the job itself
+    char command[MAX_CMD_LEN];  // Shell command, CHPT prompt, or why a JOB was rejected
+};
+
+struct shm_ring;
+struct job;
+struct cache_fill;
+struct flight;
+
+// Reply being built for one command. Output is buffered until a full chunk
+// is ready or the reply is flushed.
+struct reply {
+    int client_pid;
+    int qid;         // Client's reply queue, or the request queue for old clients
+    struct shm_ring *ring;  // Client's reply ring, held until reply_release(); used instead of qid when set
+    int flags;
+    unsigned int seq;
+    int status;
+    int len;
+    struct cache_fill *fill;  // Copy of the output for the result cache, or NULL
+    struct flight *flight;    // Identical commands waiting for this output, or NULL
+    struct job *job;          // Output goes to this job's report instead of the client
+    int step;
+    const char *command;      // Journalled once END is sent; NULL if it answers no command
+    int opcode;
+    int64_t started_ns;       // When a worker picked the command up
+    int64_t output_bytes;     // Output sent (or captured) so far
+    struct reply_usage usage; // Sent after the output with REPLY_USAGE
+    char buf[REPLY_CHUNK];
+};
+
+void *execute_command(void *arg);
+
+void reply_init(struct reply *r, int client_pid);
+void reply_printf(struct reply *r, const char *fmt, ...);
+int reply_write(struct reply *r, const char *data, int len, int nowait);
+int reply_flush(struct reply *r, int nowait);
+int reply_finish(struct reply *r, int nowait);
+void reply_purge(struct reply *r);
+void reply_release(struct reply *r);
+int reply_queue(int client_pid);
+int client_alive(int client_pid);
+
+#endif
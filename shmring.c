@@ -0,0 +1,328 @@
+/* Lock-free shared-memory rings with futex wakeups.
+
+Each slot carries a sequence number (Vyukov's bounded queue): a slot at
+position pos is free when its sequence is pos and full when it is pos + 1.
+Producers claim a position by advancing head with a compare-and-swap, copy the
+message in and then publish it by bumping the slot's sequence. The single
+consumer reads at tail and hands the slot back by setting its sequence to
+pos + slots.
+
+data_signal and space_signal are futex words bumped after every push and pop.
+A side that has to wait reads the signal before it tries and then sleeps only
+while the signal still holds that value, so a push or pop that lands between
+the attempt and the sleep is never missed. Timeouts: 0 means don't wait, -1 means wait forever.
+
+A segment is writable by every local user, so a process never trusts the
+geometry stored in it once mapped. Its struct shm_ring is a private handle
+holding the slot count, slot size and stride, checked at attach time against
+the size of the segment and what the caller expects. A slot whose size claims
+more than that is skipped rather than copied.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+#define RING_MAGIC 0x52494E47   // "RING"
+#define CACHE_LINE 64
+#define RING_CORRUPT -2         // try_pop: the slot held a bad size and was skipped
+
+struct ring_slot {
+    uint32_t seq;
+    uint32_t size;
+    char data[];
+};
+
+// The start of the segment, as every process sees it
+struct ring_header {
+    uint32_t magic;
+    int shmid;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t stride;
+    // Producer, consumer and wakeup state each get a cache line of their own
+    uint32_t head __attribute__((aligned(CACHE_LINE)));
+    uint32_t tail __attribute__((aligned(CACHE_LINE)));
+    uint32_t data_signal __attribute__((aligned(CACHE_LINE)));
+    uint32_t consumer_waiting;
+    uint32_t space_signal;
+    uint32_t producers_waiting;
+    char area[] __attribute__((aligned(CACHE_LINE)));
+};
+
+// This process's view of a ring; the geometry is copied out of the header
+// once and never read from shared memory again
+struct shm_ring {
+    struct ring_header *hdr;
+    int shmid;            // -1 for a ring_alloc() ring
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t stride;
+    int refs;             // Holders; the last ring_detach() unmaps
+};
+
+static struct ring_slot *slot_at(struct shm_ring *ring, uint32_t pos) {
+    return (struct ring_slot *)(ring->hdr->area + (size_t)(pos & (ring->slots - 1)) * ring->stride);
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Sleep while *signal still equals seen, at most until deadline (-1 = none)
+static void ring_sleep(uint32_t *signal, uint32_t seen, uint32_t *waiting, long deadline) {
+    struct timespec ts, *tsp = NULL;
+    if (deadline != -1) {
+        long left = deadline - now_ms();
+        if (left <= 0) {
+            return;
+        }
+        ts.tv_sec = left / 1000;
+        ts.tv_nsec = (left % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    __atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, signal, FUTEX_WAIT, seen, tsp, NULL, 0);
+    __atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+// Bump a signal and wake its sleepers, if there are any
+static void ring_notify(uint32_t *signal, uint32_t *waiting) {
+    __atomic_add_fetch(signal, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, signal, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+static uint32_t slot_stride(int slot_size) {
+    return (sizeof(struct ring_slot) + slot_size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+}
+
+static size_t ring_bytes(int slots, int slot_size) {
+    return sizeof(struct ring_header) + (size_t)slots * slot_stride(slot_size);
+}
+
+// Wrap a mapped header in a handle. Returns NULL if out of memory.
+static struct shm_ring *ring_handle(struct ring_header *hdr, int shmid, int slots, int slot_size) {
+    struct shm_ring *ring = malloc(sizeof(struct shm_ring));
+    if (!ring) {
+        perror("malloc failed");
+        return NULL;
+    }
+    ring->hdr = hdr;
+    ring->shmid = shmid;
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->stride = slot_stride(slot_size);
+    ring->refs = 1;
+    return ring;
+}
+
+static void ring_init(struct shm_ring *ring) {
+    struct ring_header *hdr = ring->hdr;
+    memset(hdr, 0, sizeof(struct ring_header));
+    hdr->shmid = ring->shmid;
+    hdr->slots = ring->slots;
+    hdr->slot_size = ring->slot_size;
+    hdr->stride = ring->stride;
+    for (uint32_t i = 0; i < ring->slots; i++) {
+        slot_at(ring, i)->seq = i;
+    }
+    __atomic_store_n(&hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);  // Ready for ring_attach
+}
+
+// Create a ring in a new segment, replacing one left behind under the same key
+struct shm_ring *ring_create(key_t key, int slots, int slot_size) {
+    size_t size = ring_bytes(slots, slot_size);
+
+    int shmid = shmget(key, size, 0666 | IPC_CREAT | IPC_EXCL);
+    if (shmid == -1 && errno == EEXIST) {
+        shmctl(shmget(key, 0, 0666), IPC_RMID, NULL);
+        shmid = shmget(key, size, 0666 | IPC_CREAT | IPC_EXCL);
+    }
+    if (shmid == -1) {
+        perror("shmget failed");
+        return NULL;
+    }
+    struct ring_header *hdr = shmat(shmid, NULL, 0);
+    if (hdr == (void *)-1) {
+        perror("shmat failed");
+        shmctl(shmid, IPC_RMID, NULL);
+        return NULL;
+    }
+    struct shm_ring *ring = ring_handle(hdr, shmid, slots, slot_size);
+    if (!ring) {
+        shmdt(hdr);
+        shmctl(shmid, IPC_RMID, NULL);
+        return NULL;
+    }
+
+    ring_init(ring);
+    return ring;
+}
+
+// Create a ring in ordinary memory, for threads of one process
+struct shm_ring *ring_alloc(int slots, int slot_size) {
+    size_t size = ring_bytes(slots, slot_size);
+    struct ring_header *hdr = aligned_alloc(CACHE_LINE, (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+    if (!hdr) {
+        perror("aligned_alloc failed");
+        return NULL;
+    }
+    struct shm_ring *ring = ring_handle(hdr, -1, slots, slot_size);
+    if (!ring) {
+        free(hdr);
+        return NULL;
+    }
+    ring_init(ring);
+    return ring;
+}
+
+// Map an existing ring whose slots hold slot_size bytes. Returns NULL if
+// there is none under this key, or if its header does not describe such a
+// ring fitting inside the segment.
+struct shm_ring *ring_attach(key_t key, int slot_size) {
+    int shmid = shmget(key, 0, 0666);
+    struct shmid_ds ds;
+    if (shmid == -1 || shmctl(shmid, IPC_STAT, &ds) == -1 || ds.shm_segsz < sizeof(struct ring_header)) {
+        return NULL;
+    }
+    struct ring_header *hdr = shmat(shmid, NULL, 0);
+    if (hdr == (void *)-1) {
+        return NULL;
+    }
+    uint32_t slots = hdr->slots;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != RING_MAGIC || hdr->slot_size != (uint32_t)slot_size ||
+        slots == 0 || slots > INT_MAX || (slots & (slots - 1)) != 0 || ring_bytes(slots, slot_size) > ds.shm_segsz) {
+        shmdt(hdr);
+        return NULL;
+    }
+    struct shm_ring *ring = ring_handle(hdr, shmid, slots, slot_size);
+    if (!ring) {
+        shmdt(hdr);
+    }
+    return ring;
+}
+
+// Take another reference to a ring, so that it stays mapped until this
+// holder detaches as well
+void ring_hold(struct shm_ring *ring) {
+    __atomic_add_fetch(&ring->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference; the last one unmaps the ring
+void ring_detach(struct shm_ring *ring) {
+    if (__atomic_sub_fetch(&ring->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        shmdt(ring->hdr);
+        free(ring);
+    }
+}
+
+// Mark the segment for removal; it goes away once every process detaches
+void ring_remove(struct shm_ring *ring) {
+    if (shmctl(ring->shmid, IPC_RMID, NULL) == -1) {
+        perror("shmctl (IPC_RMID) failed");
+    }
+}
+
+static int try_push(struct shm_ring *ring, const void *data, int size) {
+    struct ring_header *hdr = ring->hdr;
+    uint32_t pos = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+    while (1) {
+        struct ring_slot *slot = slot_at(ring, pos);
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&hdr->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                memcpy(slot->data, data, size);
+                slot->size = size;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // Full
+        } else {
+            pos = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Returns the size copied into buf, -1 if the ring is empty, or RING_CORRUPT
+// if the slot claimed more than a slot holds
+static int try_pop(struct shm_ring *ring, void *buf) {
+    struct ring_header *hdr = ring->hdr;
+    uint32_t pos = hdr->tail;
+    struct ring_slot *slot = slot_at(ring, pos);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+        return -1;  // Empty
+    }
+    uint32_t size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+    if (size <= ring->slot_size) {
+        memcpy(buf, slot->data, size);
+    }
+    __atomic_store_n(&slot->seq, pos + ring->slots, __ATOMIC_RELEASE);
+    hdr->tail = pos + 1;
+    return size <= ring->slot_size ? (int)size : RING_CORRUPT;
+}
+
+// Copy a message into the ring. Returns -1 with errno EAGAIN if it is still
+// full when the timeout expires, or EMSGSIZE if the message cannot fit a slot.
+int ring_push(struct shm_ring *ring, const void *data, int size, int timeout_ms) {
+    if (size < 0 || (uint32_t)size > ring->slot_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    struct ring_header *hdr = ring->hdr;
+    long deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+    while (1) {
+        uint32_t seen = __atomic_load_n(&hdr->space_signal, __ATOMIC_SEQ_CST);
+        if (try_push(ring, data, size) == 0) {
+            ring_notify(&hdr->data_signal, &hdr->consumer_waiting);
+            return 0;
+        }
+        if (deadline != -1 && now_ms() >= deadline) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ring_sleep(&hdr->space_signal, seen, &hdr->producers_waiting, deadline);
+    }
+}
+
+// Copy the oldest message out into buf (at least the ring's slot size).
+// Returns its size, or -1 with errno EAGAIN if nothing arrived in time.
+int ring_pop(struct shm_ring *ring, void *buf, int timeout_ms) {
+    struct ring_header *hdr = ring->hdr;
+    long deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+    while (1) {
+        uint32_t seen = __atomic_load_n(&hdr->data_signal, __ATOMIC_SEQ_CST);
+        int size = try_pop(ring, buf);
+        if (size != -1) {
+            ring_notify(&hdr->space_signal, &hdr->producers_waiting);
+        }
+        if (size >= 0) {
+            return size;
+        }
+        if (size == RING_CORRUPT) {
+            continue;  // Someone scribbled on the slot; it is free again, try the next
+        }
+        if (deadline != -1 && now_ms() >= deadline) {
+            errno = EAGAIN;
+            return -1;
+        }
+        ring_sleep(&hdr->data_signal, seen, &hdr->consumer_waiting, deadline);
+    }
+}
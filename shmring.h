@@ -0,0 +1,39 @@
+/* Shared-memory ring buffers, an alternative transport to the message queue.
+
+A ring lives in its own SysV shared memory segment and holds a fixed number of
+fixed-size slots. Any number of processes or threads may push; exactly one
+consumer pops. Pushing and popping are lock-free and copy the message once,
+straight into or out of the shared slot, without entering the kernel. A
+consumer with nothing to read (or a producer facing a full ring) sleeps on a
+futex in the segment, and the other side only calls FUTEX_WAKE when someone is
+actually asleep.
+
+The server owns one request ring (SHM_REQUEST_KEY); every client using the
+transport owns a reply ring (REPLY_RING_KEY(pid)). ring_attach() refuses a
+segment that does not hold a ring with the expected slot size. ring_alloc()
+builds the same ring in ordinary memory for use between threads of one process.
+*/
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <sys/types.h>
+
+#define SHM_REQUEST_KEY 12346
+#define REPLY_RING_KEY(pid) (0x53000000 | (pid))  // PIDs fit in 22 bits
+
+#define REQUEST_RING_SLOTS 1024   // Powers of two
+#define REPLY_RING_SLOTS 64
+
+struct shm_ring;
+
+struct shm_ring *ring_create(key_t key, int slots, int slot_size);
+struct shm_ring *ring_alloc(int slots, int slot_size);
+struct shm_ring *ring_attach(key_t key, int slot_size);
+void ring_hold(struct shm_ring *ring);
+void ring_detach(struct shm_ring *ring);
+void ring_remove(struct shm_ring *ring);
+int ring_push(struct shm_ring *ring, const void *data, int size, int timeout_ms);
+int ring_pop(struct shm_ring *ring, void *buf, int timeout_ms);
+
+#endif
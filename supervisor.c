@@ -0,0 +1,476 @@
+/* Child process supervisor: reaps children as they exit, enforces timeouts and
+streams their output back to the client.
+
+A worker reserves a child record, forks, and passes the pid and the read end
+of the child's output pipe to supervisor_watch(). From then on the supervisor
+thread owns the child: it adds a pidfd and the pipe to its epoll set and
+sleeps until a child writes, exits, or the earliest deadline passes. If
+pidfd_open is not available (old kernels) it falls back to polling
+waitpid(WNOHANG) on a short interval.
+
+Replies are sent with IPC_NOWAIT. When a client's reply queue is full the
+child's pipe is taken out of the epoll set, so the child blocks on its own
+output instead of the server buffering it, and the send is retried shortly
+after. Other children keep streaming in the meantime.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "supervisor.h"
+#include "metrics.h"
+#include "cache.h"
+#include "flight.h"
+
+#define POLL_INTERVAL_MS 50    // Fallback reaping interval without pidfd
+#define RETRY_INTERVAL_MS 10   // How often a stalled reply is retried
+#define STALL_LIMIT_MS 10000   // Give up on a client that reads nothing for this long
+#define MAX_EVENTS 32
+#define READS_PER_EVENT 16     // Chunks read from one pipe before serving others
+
+// epoll data: index * 2 + kind, or WAKE_EVENT for the eventfd
+#define KIND_PIDFD 0
+#define KIND_PIPE 1
+#define WAKE_EVENT UINT64_MAX
+
+struct child {
+    int in_use;          // Reserved by a worker
+    int watching;        // Fields below are valid
+    pid_t pid;
+    int pidfd;           // -1 when pidfd_open is unavailable or after exit
+    int outfd;           // Read end of the output pipe, -1 once closed
+    int pipe_armed;      // outfd is in the epoll set with EPOLLIN
+    int exited;
+    int status;
+    struct rusage usage; // Of the child and every process it reaped
+    int timed_out;
+    int finished;        // done() has run, final chunk is queued in reply
+    int discard;         // Client stopped reading; drop output, still send END
+    long long deadline;  // Monotonic time in ms
+    long long stall_since;
+    int64_t started_ns;
+    child_done_fn done;
+    void *ctx;
+    struct reply reply;
+    char command[MAX_CMD_LEN];  // For the journal; the worker's copy is gone
+};
+
+static struct child children[MAX_CHILDREN];
+static int reserved = 0;
+static pthread_mutex_t children_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t children_cond = PTHREAD_COND_INITIALIZER;
+
+static int epfd = -1;
+static int wakefd = -1;        // eventfd used to pick up newly watched children
+static int have_pidfd = 1;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static uint64_t event_key(struct child *c, int kind) {
+    return (uint64_t)(c - children) * 2 + kind;
+}
+
+// Add, re-arm or disarm the output pipe in the epoll set
+static void arm_pipe(struct child *c, int armed) {
+    struct epoll_event ev = { .events = armed ? EPOLLIN : 0, .data.u64 = event_key(c, KIND_PIPE) };
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->outfd, &ev) == -1) {
+        perror("epoll_ctl failed");
+    }
+    c->pipe_armed = armed;
+}
+
+static void close_pipe(struct child *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->outfd, NULL);
+    close(c->outfd);
+    c->outfd = -1;
+    c->pipe_armed = 0;
+}
+
+// Hand a record back to the table and wake a worker waiting for one
+static void release_child(struct child *c) {
+    reply_release(&c->reply);
+    pthread_mutex_lock(&children_lock);
+    memset(c, 0, sizeof(*c));
+    c->pidfd = -1;
+    c->outfd = -1;
+    reserved--;
+    pthread_cond_signal(&children_cond);
+    pthread_mutex_unlock(&children_lock);
+}
+
+// Try to send what is buffered. Returns -1 while the client's queue is full.
+static int flush_reply(struct child *c) {
+    if (reply_flush(&c->reply, 1) == 0) {
+        c->stall_since = 0;
+        return 0;
+    }
+    if (c->stall_since == 0) {
+        c->stall_since = now_ms();
+    } else if (now_ms() - c->stall_since > STALL_LIMIT_MS) {
+        // Drop the rest of this command's output, but keep END so the client
+        // is not left waiting if it ever reads again
+        log_printf("Client %d is not reading replies, dropping output of process %d\n",
+               c->reply.client_pid, c->pid);
+        reply_purge(&c->reply);
+        if (c->reply.fill) {
+            cache_abandon(c->reply.fill);  // What we have is not the whole output
+            c->reply.fill = NULL;
+        }
+        if (c->reply.flight) {
+            flight_abandon(c->reply.flight, 1);
+            c->reply.flight = NULL;
+        }
+        c->reply.len = 0;
+        c->discard = 1;
+        c->stall_since = 0;
+        if (reply_flush(&c->reply, 1) == -1) {
+            c->reply.flags &= ~REPLY_END;  // Queue still full; nothing more we can do
+        }
+        return 0;
+    }
+    if (c->pipe_armed) {
+        arm_pipe(c, 0);  // Let the child block on a full pipe meanwhile
+    }
+    return -1;
+}
+
+// Move output from the pipe into replies. Stops at EAGAIN, EOF, a full client
+// queue, or after max chunks. Returns -1 if the reply stalled.
+static int read_output(struct child *c, int max) {
+    for (int i = 0; c->outfd != -1 && (max == 0 || i < max); i++) {
+        struct reply *r = &c->reply;
+        if (r->len == REPLY_CHUNK && flush_reply(c) == -1) {
+            return -1;  // Still stalled; a zero-length read would look like EOF
+        }
+        ssize_t n = read(c->outfd, r->buf + r->len, REPLY_CHUNK - r->len);
+        if (n > 0 && c->discard) {
+            continue;
+        }
+        if (n > 0) {
+            r->len += n;
+            if (flush_reply(c) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            if (c->exited) {
+                close_pipe(c);  // A background grandchild may keep it open
+            }
+            break;
+        }
+        close_pipe(c);  // EOF or error
+    }
+    return 0;
+}
+
+// Record the exit status and resource usage if the child has exited
+static void reap_child(struct child *c) {
+    int status;
+    struct rusage usage;
+    pid_t r = wait4(c->pid, &status, WNOHANG, &usage);
+    if (r == 0) {
+        return;  // Still running
+    }
+    if (r == -1) {
+        perror("wait4 failed");
+        status = 0;
+        memset(&usage, 0, sizeof(usage));
+    }
+    if (c->pidfd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->pidfd, NULL);
+        close(c->pidfd);
+        c->pidfd = -1;
+    }
+    pthread_mutex_lock(&children_lock);
+    c->exited = 1;
+    c->status = status;
+    c->usage = usage;
+    pthread_mutex_unlock(&children_lock);
+    metrics_since(HIST_CHILD_RUN, c->started_ns);
+}
+
+// Advance a child towards completion: retry stalled replies, drain output
+// after exit, send the final chunk and release the record.
+static void progress_child(struct child *c) {
+    struct reply *r = &c->reply;
+
+    if ((r->len > 0 || (r->flags & REPLY_END)) && flush_reply(c) == -1) {
+        return;
+    }
+    if (c->finished) {
+        release_child(c);
+        return;
+    }
+    if (c->outfd != -1 && !c->pipe_armed) {
+        arm_pipe(c, 1);
+    }
+    if (!c->exited) {
+        return;
+    }
+    if (c->outfd != -1 && read_output(c, 0) == -1) {
+        return;
+    }
+    if (c->outfd != -1) {
+        return;
+    }
+
+    c->finished = 1;
+    if (c->done) {
+        c->done(c->pid, c->status, &c->usage, c->timed_out, r, c->ctx);
+    }
+    r->flags |= REPLY_END;
+    if (flush_reply(c) == 0) {
+        release_child(c);
+    }
+}
+
+// Kill children past their deadline and work out how long epoll may sleep
+static int check_deadlines(void) {
+    long long now = now_ms();
+    long long next = -1;
+    int retry = 0;
+
+    pthread_mutex_lock(&children_lock);
+    for (int i = 0; i < MAX_CHILDREN; i++) {
+        struct child *c = &children[i];
+        if (!c->watching) {
+            continue;
+        }
+        if (c->stall_since != 0) {
+            retry = 1;
+        }
+        if (c->exited || c->timed_out) {
+            continue;
+        }
+        if (c->deadline <= now) {
+            kill(c->pid, SIGKILL);  // Reported to the client by the done callback
+            c->timed_out = 1;
+            metrics_count(CTR_TIMEOUTS, 1);
+            continue;
+        }
+        if (next == -1 || c->deadline < next) {
+            next = c->deadline;
+        }
+    }
+    pthread_mutex_unlock(&children_lock);
+
+    int timeout = next == -1 ? -1 : (int)(next - now);
+    if (retry && (timeout == -1 || timeout > RETRY_INTERVAL_MS)) {
+        timeout = RETRY_INTERVAL_MS;
+    }
+    if (!have_pidfd && (timeout == -1 || timeout > POLL_INTERVAL_MS)) {
+        timeout = POLL_INTERVAL_MS;
+    }
+    return timeout;
+}
+
+static void *supervisor_main(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int timeout = check_deadlines();
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait failed");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t key = events[i].data.u64;
+            if (key == WAKE_EVENT) {
+                uint64_t value;
+                if (read(wakefd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                    perror("read eventfd failed");
+                }
+                continue;
+            }
+            struct child *c = &children[key / 2];
+            if (key % 2 == KIND_PIPE) {
+                if (c->outfd != -1) {
+                    read_output(c, READS_PER_EVENT);
+                }
+            } else if (!c->exited) {
+                reap_child(c);
+            }
+        }
+
+        // Catch up on every child in flight; the table is small
+        for (int i = 0; i < MAX_CHILDREN; i++) {
+            struct child *c = &children[i];
+            pthread_mutex_lock(&children_lock);
+            int watching = c->watching;
+            pthread_mutex_unlock(&children_lock);
+            if (!watching) {
+                continue;
+            }
+            if (!have_pidfd && !c->exited) {
+                reap_child(c);
+            }
+            progress_child(c);
+        }
+    }
+    return NULL;
+}
+
+// Start the supervisor thread
+int supervisor_init(void) {
+    for (int i = 0; i < MAX_CHILDREN; i++) {
+        children[i].pidfd = -1;
+        children[i].outfd = -1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd == -1 || wakefd == -1) {
+        perror("supervisor setup failed");
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = WAKE_EVENT };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) == -1) {
+        perror("epoll_ctl failed");
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, supervisor_main, NULL) != 0) {
+        perror("pthread_create failed");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Reserve a child record before forking. Waits while the table is full so
+// the number of children in flight stays bounded.
+struct child *supervisor_reserve(void) {
+    pthread_mutex_lock(&children_lock);
+    while (reserved == MAX_CHILDREN) {
+        pthread_cond_wait(&children_cond, &children_lock);
+    }
+    struct child *c = NULL;
+    for (int i = 0; i < MAX_CHILDREN; i++) {
+        if (!children[i].in_use) {
+            c = &children[i];
+            break;
+        }
+    }
+    c->in_use = 1;
+    reserved++;
+    pthread_mutex_unlock(&children_lock);
+    return c;
+}
+
+// Give back a reserved record that never got a child (e.g. fork failed)
+void supervisor_cancel(struct child *c) {
+    release_child(c);
+}
+
+// Hand a freshly forked child to the supervisor thread. outfd is the
+// non-blocking read end of the child's stdout/stderr pipe. The child's output
+// is sent to the same client and request as the owner reply, which also hands
+// over its hold on the client's reply ring (the client may send EXIT before
+// this command is done), its result cache fill, the commands waiting on it and
+// the job it is a step of.
+void supervisor_watch(struct child *c, pid_t pid, int outfd, struct reply *owner,
+                      int timeout_ms, child_done_fn done, void *ctx) {
+    int pidfd = have_pidfd ? open_pidfd(pid) : -1;
+    if (pidfd == -1 && have_pidfd) {
+        // Switch to polling for good rather than lose track of this child
+        perror("pidfd_open failed, polling children instead");
+        have_pidfd = 0;
+    }
+
+    pthread_mutex_lock(&children_lock);
+    c->pid = pid;
+    c->pidfd = pidfd;
+    c->outfd = outfd;
+    c->pipe_armed = 1;
+    c->exited = 0;
+    c->timed_out = 0;
+    c->finished = 0;
+    c->discard = 0;
+    c->deadline = now_ms() + timeout_ms;
+    c->stall_since = 0;
+    c->started_ns = metrics_now();
+    c->done = done;
+    c->ctx = ctx;
+    reply_init(&c->reply, owner->client_pid);
+    reply_release(&c->reply);
+    c->reply.ring = owner->ring;
+    c->reply.seq = owner->seq;
+    c->reply.fill = owner->fill;
+    c->reply.flight = owner->flight;
+    c->reply.job = owner->job;
+    c->reply.step = owner->step;
+    if (owner->command) {
+        snprintf(c->command, sizeof(c->command), "%s", owner->command);
+        c->reply.command = c->command;
+        owner->command = NULL;
+    }
+    c->reply.opcode = owner->opcode;
+    c->reply.started_ns = owner->started_ns;
+    c->reply.output_bytes = owner->output_bytes;
+    owner->ring = NULL;
+    owner->fill = NULL;
+    owner->flight = NULL;
+    owner->job = NULL;
+    pthread_mutex_unlock(&children_lock);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = event_key(c, KIND_PIPE) };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, outfd, &ev) == -1) {
+        perror("epoll_ctl failed");
+    }
+    if (pidfd != -1) {
+        ev.data.u64 = event_key(c, KIND_PIDFD);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd, &ev) == -1) {
+            perror("epoll_ctl failed");
+        }
+    }
+
+    // Only now let the supervisor loop look at the record
+    pthread_mutex_lock(&children_lock);
+    c->watching = 1;
+    pthread_mutex_unlock(&children_lock);
+
+    // Wake the supervisor so it picks up the new deadline
+    uint64_t one = 1;
+    if (write(wakefd, &one, sizeof(one)) == -1) {
+        perror("write eventfd failed");
+    }
+}
+
+// Number of children currently reserved or running
+int supervisor_active(void) {
+    pthread_mutex_lock(&children_lock);
+    int n = reserved;
+    pthread_mutex_unlock(&children_lock);
+    return n;
+}
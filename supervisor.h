@@ -0,0 +1,38 @@
+/* Child process supervisor.
+
+Commands run by execute_in_shell() are handed to a single supervisor thread
+instead of being babysat by the worker that forked them. The supervisor waits
+on a pidfd per child with epoll, reaps each child the moment it exits and
+kills it once its timeout expires. It also reads the child's stdout/stderr
+pipe and streams the output back to the client in REPLY_CHUNK pieces as soon
+as it is produced. Child records come from a fixed table, so memory does not
+grow with the number of commands in flight.
+*/
+
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "server.h"
+
+#define MAX_CHILDREN 128
+
+// Called on the supervisor thread once a child has been reaped and all of its
+// output has been sent (or dropped, for a client that stopped reading).
+// status is the raw wait status and usage what wait4() reported. Anything
+// written to r goes out with the final chunk of the reply.
+typedef void (*child_done_fn)(pid_t pid, int status, const struct rusage *usage,
+                              int timed_out, struct reply *r, void *ctx);
+
+struct child;
+
+int supervisor_init(void);
+struct child *supervisor_reserve(void);
+void supervisor_cancel(struct child *c);
+void supervisor_watch(struct child *c, pid_t pid, int outfd, struct reply *owner,
+                      int timeout_ms, child_done_fn done, void *ctx);
+int supervisor_active(void);
+
+#endif